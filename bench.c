@@ -0,0 +1,456 @@
+/*
+    Benchmark del file system, usa direttamente filesystem.h senza passare dal montaggio FUSE.
+
+    Crea una catena di directory profonda depth e al suo interno files file, poi misura
+    una fase alla volta: creazione, ricerca del path, lettura degli attributi, lettura della directory,
+    scrittura e lettura sequenziale di size byte per file a blocchi di io_size byte,
+    scrittura e lettura in posizioni casuali.
+
+    L'output è in formato CSV, una riga per fase:
+    fase, operazioni, operazioni al secondo, latenza p50 e p99 in nanosecondi,
+    chiamate di sistema verso il dispositivo e page fault per operazione.
+
+    Uso: ./bench [--files=N] [--size=BYTE] [--io-size=BYTE] [--depth=N] [--random-ops=N]
+                 [--readdirs=N] [--block-size=BYTE] [--blocks=N] [--inodes=N] [--journal-blocks=N] [--readahead-kb=N]
+                 [--io-uring=0|1] [--image=PATH]
+*/
+
+#include <inttypes.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "filesystem.h"
+
+#define BENCH_PATH_LEN 4096
+
+/*
+    Parametri del benchmark, impostabili da riga di comando con --nome=valore.
+*/
+static struct bench_options{
+
+    uint32_t files;
+    uint32_t size;
+    uint32_t io_size;
+    uint32_t depth;
+    uint32_t random_ops;
+    uint32_t readdirs;
+    uint32_t block_size;
+    uint32_t blocks;
+    uint32_t inodes;
+    uint32_t journal_blocks;
+    uint32_t readahead_kb;
+    uint32_t io_uring;
+    const char* image;
+
+}options = {
+    .files = 1000,
+    .size = 65536,
+    .io_size = 4096,
+    .depth = 3,
+    .random_ops = 10000,
+    .readdirs = 100,
+    .block_size = DEFAULT_BLOCK_SIZE,
+    .blocks = 65536,
+    .inodes = 4096,
+    .journal_blocks = 0,
+    .readahead_kb = READAHEAD_DEFAULT_KB,
+    .io_uring = 1,
+    .image = "BENCH_FS"
+};
+
+static const struct{
+
+    const char* name;
+    uint32_t* value;
+
+}numeric_options[] = {
+    {"--files=",&options.files},
+    {"--size=",&options.size},
+    {"--io-size=",&options.io_size},
+    {"--depth=",&options.depth},
+    {"--random-ops=",&options.random_ops},
+    {"--readdirs=",&options.readdirs},
+    {"--block-size=",&options.block_size},
+    {"--blocks=",&options.blocks},
+    {"--inodes=",&options.inodes},
+    {"--journal-blocks=",&options.journal_blocks},
+    {"--readahead-kb=",&options.readahead_kb},
+    {"--io-uring=",&options.io_uring},
+};
+
+/*
+    Stato di una fase: latenze delle singole operazioni ed i contatori all'inizio della fase.
+*/
+typedef struct phase{
+
+    const char* name;
+    uint64_t* latencies;
+    uint32_t ops;
+    uint32_t capacity;
+    uint64_t start_ns;
+    uint64_t start_syscalls;
+    long start_faults;
+
+}phase_t;
+
+filesystem_t* filesystem;
+char** paths;           //Path dei file creati, indicizzati per numero di file
+char dir_path[BENCH_PATH_LEN];
+
+
+static uint64_t now_ns(){
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+static long page_faults(){
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+    return usage.ru_minflt + usage.ru_majflt;
+
+}
+
+static int parse_options(int argc, char* argv[]){
+
+    for(int i = 1; i < argc; i++){
+
+        uint8_t found = 0;
+
+        if(strncmp(argv[i],"--image=",8) == 0){
+            options.image = argv[i] + 8;
+            continue;
+        }
+
+        for(size_t j = 0; j < sizeof(numeric_options) / sizeof(numeric_options[0]); j++){
+
+            size_t len = strlen(numeric_options[j].name);
+
+            if(strncmp(argv[i],numeric_options[j].name,len) == 0 && sscanf(argv[i] + len,"%u",numeric_options[j].value) == 1)
+                found = 1;
+        }
+
+        if(!found){
+            fprintf(stderr,"Opzione non riconosciuta: %s\n",argv[i]);
+            return -1;
+        }
+    }
+
+    if(options.files == 0 || options.io_size == 0 || options.size < options.io_size){
+        fprintf(stderr,"Servono almeno un file ed una dimensione non inferiore a --io-size\n");
+        return -1;
+    }
+
+    return 0;
+
+}
+
+static void phase_begin(phase_t* phase, const char* name, uint32_t capacity){
+
+    phase->name = name;
+    phase->ops = 0;
+    phase->capacity = capacity;
+    phase->latencies = malloc(sizeof(uint64_t) * capacity);
+    phase->start_syscalls = filesystem->stats.syscalls;
+    phase->start_faults = page_faults();
+    phase->start_ns = now_ns();
+
+}
+
+static void phase_record(phase_t* phase, uint64_t op_start){
+
+    if(phase->ops < phase->capacity)
+        phase->latencies[phase->ops++] = now_ns() - op_start;
+
+}
+
+static int compare_latencies(const void* a, const void* b){
+
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+
+    return (x > y) - (x < y);
+
+}
+
+static void phase_end(phase_t* phase){
+
+    uint64_t elapsed = now_ns() - phase->start_ns;
+    uint64_t syscalls = filesystem->stats.syscalls - phase->start_syscalls;
+    long faults = page_faults() - phase->start_faults;
+    uint32_t ops = phase->ops;
+
+    qsort(phase->latencies,ops,sizeof(uint64_t),compare_latencies);
+
+    printf("%s,%u,%.0f,%" PRIu64 ",%" PRIu64 ",%.3f,%.3f\n",
+        phase->name,
+        ops,
+        elapsed > 0 ? ops * 1e9 / elapsed : 0.0,
+        ops > 0 ? phase->latencies[ops / 2] : 0,
+        ops > 0 ? phase->latencies[(uint64_t)ops * 99 / 100] : 0,
+        ops > 0 ? (double)syscalls / ops : 0.0,
+        ops > 0 ? (double)faults / ops : 0.0);
+
+    free(phase->latencies);
+
+}
+
+/*
+    Crea la catena di directory /d0/d1/... in cui verranno creati i file.
+*/
+static int make_dirs(){
+
+    file_t dir = {0};
+    size_t len = 0;
+
+    dir.mode = S_IFDIR | 0755;
+    dir_path[0] = '\0';
+
+    for(uint32_t i = 0; i < options.depth; i++){
+
+        snprintf(dir.name,MAX_FILE_NAME,"d%u",i);
+        len += snprintf(dir_path + len,BENCH_PATH_LEN - len,"/%s",dir.name);
+
+        if(len >= BENCH_PATH_LEN || new_file_to_dir(dir,dir_path,filesystem) != 0)
+            return -1;
+    }
+
+    return 0;
+
+}
+
+static void bench_create(){
+
+    phase_t phase;
+    file_t file = {0};
+    uint64_t start;
+
+    file.mode = S_IFREG | 0644;
+    phase_begin(&phase,"create",options.files);
+
+    for(uint32_t i = 0; i < options.files; i++){
+
+        snprintf(file.name,MAX_FILE_NAME,"f%u",i);
+        start = now_ns();
+
+        if(new_file_to_dir(file,paths[i],filesystem) != 0){
+            fprintf(stderr,"Creazione di %s fallita\n",paths[i]);
+            exit(1);
+        }
+
+        phase_record(&phase,start);
+    }
+
+    phase_end(&phase);
+
+}
+
+static void bench_lookup(inode_num_t* inodes){
+
+    phase_t phase;
+    uint64_t start;
+
+    phase_begin(&phase,"lookup",options.files);
+
+    for(uint32_t i = 0; i < options.files; i++){
+
+        start = now_ns();
+        inodes[i] = inode_from_path(paths[i],filesystem);
+        phase_record(&phase,start);
+    }
+
+    phase_end(&phase);
+
+}
+
+static void bench_getattr(const inode_num_t* inodes){
+
+    phase_t phase;
+    inode_t inode;
+    uint64_t start;
+    uint64_t total_size = 0;
+
+    phase_begin(&phase,"getattr",options.files);
+
+    for(uint32_t i = 0; i < options.files; i++){
+
+        start = now_ns();
+        lock_inode(inodes[i],0,filesystem);
+        inode = read_inode(inodes[i],filesystem);
+        unlock_inode(inodes[i],filesystem);
+        phase_record(&phase,start);
+
+        total_size += inode.size;
+    }
+
+    phase_end(&phase);
+
+    if(total_size != 0)
+        fprintf(stderr,"I file appena creati non sono vuoti\n");
+
+}
+
+static void bench_readdir(){
+
+    phase_t phase;
+    inode_num_t dir_inode = inode_from_path(options.depth > 0 ? dir_path : "/",filesystem);
+    dir_iter_t it;
+    uint32_t entries = 0;
+    uint64_t start;
+
+    phase_begin(&phase,"readdir",options.readdirs);
+
+    for(uint32_t i = 0; i < options.readdirs; i++){
+
+        start = now_ns();
+        entries = 0;
+        lock_inode(dir_inode,0,filesystem);
+        dir_iter_start(&it,dir_inode,0,filesystem);
+
+        while(dir_iter_next(&it,filesystem) == 1)
+            entries++;
+
+        unlock_inode(dir_inode,filesystem);
+        phase_record(&phase,start);
+    }
+
+    phase_end(&phase);
+
+    if(entries != options.files)
+        fprintf(stderr,"La directory contiene %u entry invece di %u\n",entries,options.files);
+
+}
+
+/*
+    Scrive o legge per intero ogni file, io_size byte alla volta.
+*/
+static void bench_sequential(const char* name, uint8_t write, const inode_num_t* inodes, char* buf){
+
+    phase_t phase;
+    uint32_t chunks = options.size / options.io_size;
+    uint64_t start;
+    size_t done;
+
+    phase_begin(&phase,name,options.files * chunks);
+
+    for(uint32_t i = 0; i < options.files; i++){
+
+        for(uint32_t c = 0; c < chunks; c++){
+
+            start = now_ns();
+
+            if(write)
+                done = write_to_file(inodes[i],buf,options.io_size,(off_t)c * options.io_size,filesystem);
+            else
+                done = read_file(buf,inodes[i],(off_t)c * options.io_size,options.io_size,filesystem);
+
+            phase_record(&phase,start);
+
+            if(done != options.io_size){
+                fprintf(stderr,"%s: %zu byte invece di %u (spazio esaurito?)\n",name,done,options.io_size);
+                exit(1);
+            }
+        }
+    }
+
+    phase_end(&phase);
+
+}
+
+/*
+    Scrive o legge io_size byte in un file ed in una posizione, allineata ad io_size, scelti a caso.
+*/
+static void bench_random(const char* name, uint8_t write, const inode_num_t* inodes, char* buf){
+
+    phase_t phase;
+    uint32_t chunks = options.size / options.io_size;
+    unsigned int seed = 42;
+    uint32_t file;
+    off_t offset;
+    uint64_t start;
+
+    phase_begin(&phase,name,options.random_ops);
+
+    for(uint32_t i = 0; i < options.random_ops; i++){
+
+        file = rand_r(&seed) % options.files;
+        offset = (off_t)(rand_r(&seed) % chunks) * options.io_size;
+        start = now_ns();
+
+        if(write)
+            write_to_file(inodes[file],buf,options.io_size,offset,filesystem);
+        else
+            read_file(buf,inodes[file],offset,options.io_size,filesystem);
+
+        phase_record(&phase,start);
+    }
+
+    phase_end(&phase);
+
+}
+
+int main(int argc, char* argv[]){
+
+    superblock_t geometry = {0};
+    inode_num_t* inodes;
+    char* buf;
+
+    if(parse_options(argc,argv) == -1)
+        return 1;
+
+    geometry.block_size = options.block_size;
+    geometry.blocks_count = options.blocks;
+    geometry.inodes_count = options.inodes;
+    geometry.journal_blocks = options.journal_blocks;
+
+    if(init_fs(&filesystem,options.image,&geometry) == NULL){
+        fprintf(stderr,"Impossibile creare il file system in %s\n",options.image);
+        return 1;
+    }
+
+    set_readahead_budget(options.readahead_kb,filesystem);
+    set_io_engine(options.io_uring ? IO_ENGINE_URING : IO_ENGINE_SYNC,filesystem);
+    init_root_dir(filesystem);
+
+    if(make_dirs() == -1){
+        fprintf(stderr,"Impossibile creare le directory\n");
+        return 1;
+    }
+
+    paths = malloc(sizeof(char*) * options.files);
+    inodes = calloc(options.files,sizeof(inode_num_t));
+    buf = malloc(options.io_size);
+    memset(buf,'b',options.io_size);
+
+    for(uint32_t i = 0; i < options.files; i++){
+        paths[i] = malloc(BENCH_PATH_LEN + MAX_FILE_NAME);
+        snprintf(paths[i],BENCH_PATH_LEN + MAX_FILE_NAME,"%s/f%u",dir_path,i);
+    }
+
+    printf("phase,ops,ops_per_sec,p50_ns,p99_ns,syscalls_per_op,faults_per_op\n");
+
+    bench_create();
+    name_cache_clear(filesystem->path_cache);    //La ricerca parte dalle dentry, non dai path appena inseriti
+    bench_lookup(inodes);
+    bench_getattr(inodes);
+    bench_readdir();
+    bench_sequential("seq_write",1,inodes,buf);
+    bench_sequential("seq_read",0,inodes,buf);
+    bench_random("rand_write",1,inodes,buf);
+    bench_random("rand_read",0,inodes,buf);
+
+    close_fs(filesystem);
+    unlink(options.image);
+
+    for(uint32_t i = 0; i < options.files; i++)
+        free(paths[i]);
+
+    free(paths);
+    free(inodes);
+    free(buf);
+
+    return 0;
+
+}
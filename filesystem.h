@@ -4,53 +4,204 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 #define MAX_FILE_NAME 256
-#define MAX_FILE_CONTENT 1024       //Ogni file può essere composto massimo da 4 blocchi 
-#define BLOCK_SIZE 256              
-#define MAX_BLOCKS_NUM 256
-#define MAX_BLOCKS_PER_NODE 251
-#define MAX_INODES 256
-#define MAX_DIR_ENTRIES 256
-#define MAX_FILE_SIZE 4096
-
-#define SIZE_OFFSET_IN_INODE 4
+#define MIN_BLOCK_SIZE 256
+#define MAX_BLOCK_SIZE 4096
+#define DEFAULT_BLOCK_SIZE 4096
+#define DEFAULT_BLOCKS_NUM 4096
+#define DEFAULT_INODES 1024
+#define MAX_EXTENTS_PER_NODE(fs) (((fs)->block_size - EXTENTS_OFFSET_IN_INODE) / sizeof(extent_t))
+#define MAX_EXTENT_ENTRIES ((MAX_BLOCK_SIZE - EXTENTS_OFFSET_IN_INODE) / sizeof(extent_t))
+#define INLINE_DATA_MAX(fs) ((fs)->block_size - EXTENTS_OFFSET_IN_INODE)    //Dimensione massima di un file con i dati nell'inode
+#define INODE_CACHE_SIZE 1024
+#define INODE_CACHE_BUCKETS 256
+#define DENTRY_CACHE_SIZE 4096
+#define PATH_CACHE_SIZE 4096
+#define NAME_CACHE_BUCKETS 1024
+#define INODE_LOCK_STRIPES 256
+
+#define SIZE_OFFSET_IN_INODE 8
 #define MODE_OFFSET_IN_INODE 0
+#define EXTENT_COUNT_OFFSET_IN_INODE 4
+#define EXTENTS_OFFSET_IN_INODE 16
+
+#define FSIM_MAGIC 0x4d495346      //"FSIM"
+#define FSIM_VERSION 6             //La revisione 1 è il formato originale a 256 blocchi da 256 byte, senza superblocco,
+                                   //la 2 usava un byte per blocco nella tabella dello spazio libero,
+                                   //la 3 un vettore di indici di blocco per inode, la 4 non aveva il journal,
+                                   //la 5 non aveva i dati dei file piccoli nell'inode
+#define SUPERBLOCK_BLOCK 0
+#define BITS_PER_WORD 64
+
+#define DIR_INITIAL_BUCKETS 1
+#define DIR_HEADER_BLOCK 0                     //Blocco logico della directory che contiene l'intestazione dell'indice
+#define BUCKET_USED_OFFSET 0
+#define BUCKET_OVERFLOW_OFFSET sizeof(uint16_t)
+#define BUCKET_HEADER_SIZE (sizeof(uint16_t) + sizeof(block_num_t))
+#define DIR_ENTRY_HEADER_SIZE (sizeof(inode_num_t) + sizeof(uint32_t) + sizeof(file_name_lenght_t))
+#define BUCKET_CAPACITY(fs) ((fs)->block_size - BUCKET_HEADER_SIZE)
+#define DIR_MAX_NAME(fs) (BUCKET_CAPACITY(fs) - DIR_ENTRY_HEADER_SIZE)
+#define DIR_SPLIT_PERCENT 75                   //Riempimento medio dei bucket, in percentuale, oltre il quale ne viene diviso uno
+#define DIR_COOKIE(bucket, index) (((uint64_t)(bucket) + 1) << 32 | (index))     //Posizione in una directory, vedi dir_iter_t
+
+#define JOURNAL_MAGIC 0x4c4e524a          //"JRNL", blocco descrittore di una transazione
+#define JOURNAL_COMMIT_MAGIC 0x54494d43   //"CMIT", blocco di commit
+#define JOURNAL_MIN_BLOCKS 8
+#define JOURNAL_DEFAULT_MAX_BLOCKS 1024
+#define JOURNAL_HEADER_SIZE (2 * sizeof(uint32_t) + sizeof(uint64_t))
+#define JOURNAL_COMMIT_HEADER_SIZE (3 * sizeof(uint32_t) + sizeof(uint64_t))   //Segue l'elenco dei blocchi revocati
+#define JOURNAL_GROUP_OPS 64               //Operazioni raggruppate al più in una transazione
+#define JOURNAL_BUCKETS 256
+#define READAHEAD_MIN_BLOCKS 4             //Prima finestra di read-ahead di una lettura sequenziale
+#define READAHEAD_DEFAULT_KB 1024          //Dimensione massima predefinita della finestra
+#define WRITE_BUFFER_MIN (64 * 1024)       //Capacità iniziale del buffer di scrittura di un inode
+#define WRITE_BUFFER_MAX (1024 * 1024)     //Dimensione massima del buffer di un inode
+#define WRITE_BUFFER_TOTAL_MAX (64 * 1024 * 1024)    //Dati in tutti i buffer oltre i quali questi vengono scritti
 
-#define SEEK_FREESPACE_TABLE_SET 256
+/*
+    Politiche di sincronizzazione dei metadati, le modifiche vengono sempre scritte tramite il journal:
+    FS_SYNC_LAZY    commit di gruppo ogni JOURNAL_GROUP_OPS operazioni (o prima se la transazione è grande),
+                    ad ogni fsync ed allo smontaggio
+    FS_SYNC_META    commit al termine di ogni operazione che modifica i metadati
+*/
+#define FS_SYNC_LAZY 0
+#define FS_SYNC_META 1
+
+/*
+    Motori di I/O verso il file del dispositivo, vedi io_engine_t:
+    IO_ENGINE_SYNC      una chiamata di sistema bloccante per ogni richiesta (msync)
+    IO_ENGINE_URING     richieste raccolte in una coda io_uring condivisa e completate in modo asincrono
+*/
+#define IO_ENGINE_SYNC 0
+#define IO_ENGINE_URING 1
+#define IO_RING_ENTRIES 128     //Posti nella coda di sottomissione di io_uring
+
+#define COUNT_STAT(fs, counter, n) __atomic_fetch_add(&(fs)->stats.counter,(n),__ATOMIC_RELAXED)   //Incrementa un contatore di fs_stats_t
+#define COUNT_SYSCALL(fs) COUNT_STAT(fs,syscalls,1)    //Conta una chiamata di sistema verso il dispositivo
 
 
-typedef uint8_t inode_num_t;
-typedef uint8_t block_num_t;
+typedef uint32_t inode_num_t;
+typedef uint32_t block_num_t;
 typedef uint16_t file_name_lenght_t;
 
+/*
+Superblocco, occupa il blocco 0 del dispositivo e ne descrive la geometria.
+Seguono la tabella degli inode (inodes_count numeri di blocco), la tabella dello spazio libero
+(una bitmap, un bit per blocco) ed il journal dei metadati, ognuno a partire da un blocco proprio.
+I blocchi da data_start in poi sono disponibili per inode e dati.
+*/
+typedef struct superblock{
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t blocks_count;
+    uint32_t inodes_count;
+    uint32_t inode_table_start;
+    uint32_t inode_table_blocks;
+    uint32_t freespace_table_start;
+    uint32_t freespace_table_blocks;
+    uint32_t journal_start;
+    uint32_t journal_blocks;
+    uint32_t data_start;
+
+}superblock_t;
+
+/*
+Sequenza di blocchi fisicamente contigui appartenenti ad un file: length blocchi a partire da start.
+*/
+typedef struct extent{
+
+    block_num_t start;
+    uint32_t length;
+
+}extent_t;
+
 /*
 
-Blocco di 256 byte in cui i primi 4 byte rappresentano i permessi ed il tipo del file, 
-i seguenti 251 byte rappresentano gli indici dei blocchi all'interno dei quali si trovano i dati
-del file rappresentato dall'inode.
+Blocco in cui i primi 4 byte rappresentano i permessi ed il tipo del file, i 4 byte all'offset 4 il numero di extent,
+gli 8 byte all'offset 8 la dimensione e i restanti byte, dall'offset 16, gli extent (inizio e lunghezza)
+all'interno dei quali si trovano i dati del file rappresentato dall'inode.
+Gli extent coprono in ordine i blocchi logici del file: il primo i blocchi logici da 0 a length - 1,
+il secondo quelli successivi e così via.
+In memoria il vettore degli extent è dimensionato per la dimensione di blocco massima, 
+ne vengono usati solo MAX_EXTENTS_PER_NODE(fs) elementi.
+Un file regolare senza extent e non vuoto, di al più INLINE_DATA_MAX(fs) byte, ha i dati direttamente
+nell'inode, dall'offset 16 al posto degli extent (vedi inode_is_inline): finché resta piccolo non occupa altri blocchi,
+quando cresce oltre il limite i dati vengono spostati in un blocco (vedi grow_inode).
 
 */
 typedef struct inode{
 
     mode_t mode;
-    size_t size;
-    block_num_t index_vector[MAX_BLOCKS_PER_NODE];
+    uint32_t extent_count;
+    uint64_t size;
+
+    union{
+        extent_t extents[MAX_EXTENT_ENTRIES];
+        uint8_t inline_data[MAX_BLOCK_SIZE - EXTENTS_OFFSET_IN_INODE];
+    };
 
 }inode_t;
 
 /*
-Rappresentazione del contenuto di una directory, ogni file contenuto in una directory 
-è rappresentato da una dir_entry. 
+Indice di una directory (hashing lineare).
+
+Il primo blocco logico della directory contiene un dir_header_t, i blocchi logici successivi
+sono i bucket: il bucket b si trova nel blocco logico b + 1. Un nome viene assegnato al bucket
+hash % (DIR_INITIAL_BUCKETS << level), oppure a hash % (DIR_INITIAL_BUCKETS << (level + 1))
+se il bucket così ottenuto è già stato diviso (è minore di split).
+
+Ogni blocco di un bucket inizia con il numero di byte occupati dalle entry (uint16_t) e con il blocco
+di overflow successivo (0 se assente), seguiti dalle entry impacchettate:
+numero di inode, hash del nome, lunghezza del nome e nome (senza terminatore).
+Quando un inserimento richiede un blocco di overflow, o quando le entry occupano in media più di
+DIR_SPLIT_PERCENT del primo blocco di ogni bucket, viene diviso il bucket indicato da split:
+in questo modo le catene restano lunghe circa un blocco qualunque sia il numero di entry
+e la ricerca di un nome legge solo il bucket che lo contiene.
 */
-typedef struct dir_entry{
-    
-    block_num_t inode_index;
-    file_name_lenght_t name_lenght;
+typedef struct dir_header{
+
+    uint32_t entry_count;
+    uint32_t level;
+    uint32_t split;
+    uint32_t entry_bytes;       //Byte occupati da tutte le entry, misura il riempimento dei bucket
+
+}dir_header_t;
+
+/*
+Iteratore sulle entry di una directory, scorre i bucket dell'indice nell'ordine senza copiarne
+il contenuto: occupa memoria costante qualunque sia la dimensione della directory.
+La posizione è riassunta da un cookie, DIR_COOKIE(bucket, entry del bucket già restituite), da cui
+una lettura successiva può riprendere. I cookie minori di DIR_COOKIE(0, 0) indicano l'inizio della directory,
+così che i valori 1 e 2 restino disponibili per "." e "..".
+Se tra due letture un bucket già letto viene diviso le sue entry spostate possono essere restituite di nuovo.
+Il chiamante deve tenere il lock della directory per tutto l'uso dell'iteratore.
+*/
+typedef struct dir_iter{
+
+    inode_t* dir_inode;
+    dir_header_t header;
+    uint32_t bucket;
+    uint32_t index;             //Entry del bucket corrente già restituite
+    block_num_t block;          //Blocco della catena del bucket corrente, 0 se la catena è finita
+    uint8_t* entry;
+    uint8_t* entries_end;
 
+    inode_num_t inode_num;      //Ultima entry restituita
+    file_name_lenght_t name_lenght;
     char name[MAX_FILE_NAME + 1];
 
-}dir_entry_t;
+}dir_iter_t;
 
 
 
@@ -60,22 +211,302 @@ Rappresentazione in memoria di un file.
 typedef struct file{
 
     char name[MAX_FILE_NAME];
-    char content[MAX_FILE_CONTENT];
 
     inode_num_t inode_num;
 
     size_t size;
     mode_t mode;
-    dir_entry_t entries[MAX_DIR_ENTRIES];
 
 }file_t;
 
+/*
+    Porzione contigua dei dati di un file all'interno del dispositivo, vedi map_file_range.
+*/
+typedef struct file_run{
+
+    off_t offset;       //Posizione nel dispositivo, -1 se la porzione va letta come zeri
+    size_t size;
+
+}file_run_t;
+
+/*
+    Stato del read-ahead di un file, mantenuto insieme all'inode in cache.
+    Viene aggiornato da letture concorrenti con il solo lock dell'inode in lettura, per questo
+    i campi sono letti e scritti atomicamente: una corsa tra due letture può al più
+    ripetere o saltare un suggerimento al kernel.
+*/
+typedef struct readahead{
+
+    uint32_t next_block;        //Blocco logico da cui partirebbe la prossima lettura sequenziale
+    uint32_t window;            //Finestra attuale in blocchi, 0 se l'accesso non è sequenziale
+    uint32_t ahead_until;       //Primo blocco logico non ancora richiesto al kernel
+
+}readahead_t;
+
+/*
+    Buffer di scrittura di un inode (allocazione ritardata): le scritture di un file aperto che proseguono
+    o si sovrappongono all'intervallo già presente vengono copiate qui, ed i blocchi vengono assegnati
+    tutti insieme quando il buffer viene scritto (flush, fsync, chiusura, lettura del file, buffer pieno
+    o troppi dati in attesa), così che una serie di piccole scritture in coda occupi un unico extent
+    e modifichi l'inode e la bitmap una volta sola. Protetto dal lock dell'inode.
+*/
+typedef struct write_buffer{
+
+    off_t offset;       //Posizione nel file del primo byte
+    size_t size;
+    size_t capacity;
+    char* data;
+
+}write_buffer_t;
+
+/*
+    Cache degli inode: gli inode letti vengono mantenuti decodificati in memoria,
+    indicizzati per numero di inode tramite una tabella hash ed ordinati in una lista LRU.
+    Le modifiche vengono fatte sulla copia in memoria (dirty) e riportate sul blocco
+    dell'inode solo quando l'elemento viene rimosso dalla cache o alla sincronizzazione.
+    Un elemento il cui lock (vedi lock_inode) è occupato non viene rimosso, per questo
+    il puntatore ritornato da get_inode resta valido finché il chiamante tiene il lock dell'inode.
+    Non viene rimosso neanche un elemento di un file aperto (pins, vedi open_inode).
+*/
+typedef struct inode_cache_entry{
+
+    inode_num_t inode_num;
+    uint8_t dirty;
+    int8_t write_error;         //-ENOSPC se la scrittura di un buffer non è riuscita, riportato da flush_open_file
+    uint8_t released;           //L'inode è stato liberato mentre il file era aperto, l'elemento non è più nella cache
+    uint32_t pins;              //File aperti sull'inode
+    uint32_t map_generation;    //Cambia quando gli extent vengono accorciati, vedi map_cursor_t
+    uint8_t mapped;             //map_open_file_range ha restituito blocchi del file da quando è stato aperto
+    extent_t* held;             //Blocchi liberati mentre erano mappati, vedi release_file_extent
+    uint32_t held_count;
+    write_buffer_t* wbuf;       //Scritture non ancora assegnate a blocchi, NULL se non ce ne sono
+    inode_t inode;
+    readahead_t ra;
+
+    struct inode_cache_entry* hash_next;
+    struct inode_cache_entry* lru_prev;
+    struct inode_cache_entry* lru_next;
+
+}inode_cache_entry_t;
+
+typedef struct inode_cache{
+
+    inode_cache_entry_t* buckets[INODE_CACHE_BUCKETS];
+    inode_cache_entry_t* lru_head;     //Elemento usato più di recente
+    inode_cache_entry_t* lru_tail;     //Elemento usato meno di recente
+    uint32_t count;
+    uint32_t dirty_count;              //Elementi modificati, verranno aggiunti alla transazione al commit
+    uint64_t hits;
+    uint64_t misses;
+    pthread_mutex_t lock;              //Protegge tabella hash, lista LRU e contatori, non il contenuto degli inode
+
+}inode_cache_t;
+
+/*
+    Posizione nella mappa dei blocchi di un file: l'extent in cui è terminato l'ultimo accesso ed il suo
+    primo blocco logico, così che un accesso sequenziale non scorra ogni volta gli extent dall'inizio.
+    Gli extent cambiano solo in coda, quindi la posizione resta valida finché non cambia la map_generation
+    dell'inode, incrementata quando gli extent vengono accorciati (vedi shrink_inode).
+*/
+typedef struct map_cursor{
+
+    uint32_t extent;
+    uint32_t first;
+    uint32_t generation;
+
+}map_cursor_t;
+
+/*
+    File aperto, associato a fuse_file_info::fh: evita di risolvere il path ad ogni lettura o scrittura.
+    L'elemento della cache con l'inode resta in cache finché il file è aperto; il read-ahead e la posizione
+    nella mappa dei blocchi sono quelli di questa apertura, così che due letture sequenziali
+    dello stesso file in punti diversi non si disturbino.
+*/
+typedef struct open_file{
+
+    inode_num_t inode_num;
+    inode_cache_entry_t* entry;
+    readahead_t ra;
+    map_cursor_t cursor;
+    pthread_mutex_t cursor_lock;    //Le letture dello stesso file aperto possono essere concorrenti
+
+}open_file_t;
+
+/*
+    Cache dei nomi: associa ad una coppia (inode della directory, nome) l'inode dell'elemento.
+    Viene usata sia come cache delle dentry, con il nome del singolo elemento, sia come cache
+    dei path completi, con parent sempre 0 ed il path come nome.
+    Vengono memorizzate solo le ricerche andate a buon fine.
+*/
+typedef struct name_cache_entry{
+
+    inode_num_t parent;
+    inode_num_t inode_num;
+    uint32_t hash;
+    char* name;
+
+    struct name_cache_entry* hash_next;
+    struct name_cache_entry* lru_prev;
+    struct name_cache_entry* lru_next;
+
+}name_cache_entry_t;
+
+typedef struct name_cache{
+
+    name_cache_entry_t* buckets[NAME_CACHE_BUCKETS];
+    name_cache_entry_t* lru_head;
+    name_cache_entry_t* lru_tail;
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t generation;        //Incrementata ad ogni svuotamento, vedi name_cache_insert_since
+    pthread_mutex_t lock;
+
+}name_cache_t;
+
+/*
+    Journal dei metadati (write-ahead).
+    Le modifiche ai blocchi di metadati (tabelle, inode, blocchi delle directory) non vengono fatte
+    nella mappatura ma in una copia del blocco (meta_block_t) che appartiene alla transazione in corso.
+    Al commit (sync_fs) le copie vengono scritte nel journal seguite da un blocco di commit con il checksum
+    della transazione, il journal viene reso persistente e solo dopo le copie vengono riportate
+    nella loro posizione (checkpoint).
+    Il journal è diviso in due metà usate alternativamente: una transazione non sovrascrive mai
+    la precedente, il cui checkpoint diventa persistente con la msync del commit successivo.
+    Sul dispositivo ogni transazione è formata dal blocco descrittore (magic, numero di blocchi,
+    numero di sequenza, blocchi di destinazione), dalle copie dei blocchi e dal blocco di commit
+    (magic, checksum, numero di sequenza, blocchi revocati). Un blocco della transazione precedente liberato
+    prima del commit viene revocato (vedi journal_revoke): il replay non lo riporta.
+*/
+typedef struct meta_block{
+
+    block_num_t block;
+    struct meta_block* hash_next;
+    struct meta_block* next;        //Blocco successivo della transazione
+    uint8_t data[];
+
+}meta_block_t;
+
+typedef struct journal{
+
+    meta_block_t* buckets[JOURNAL_BUCKETS];
+    meta_block_t* blocks;           //Blocchi modificati nella transazione in corso
+    uint32_t count;
+    uint32_t capacity;              //Numero massimo di blocchi di una transazione
+    uint32_t pending_ops;           //Operazioni concluse dall'ultimo commit
+    uint64_t sequence;              //Numero di sequenza del prossimo commit
+    block_num_t* committed;         //Blocchi dell'ultima transazione scritta nel journal e non ancora revocati, ordinati
+    uint32_t committed_count;
+    block_num_t* revoked;           //Blocchi di committed liberati dall'ultimo commit, vedi journal_revoke
+    uint32_t revoked_count;
+    meta_block_t* spare;            //Copie libere, riusate dalle transazioni successive
+    uint32_t spare_count;
+    uint8_t overflow;               //Una copia non è stata allocata, il commit scrive i blocchi direttamente
+    uint8_t direct;                 //Durante il commit diretto meta_ptr ritorna i blocchi nella mappatura
+    pthread_mutex_t lock;
+
+}journal_t;
+
+/*
+    Richiesta al motore di I/O: al completamento result contiene il risultato dell'operazione
+    (-errno in caso di errore) e completed diventa 1, vedi io_wait.
+*/
+typedef struct io_request{
+
+    int32_t result;
+    uint8_t completed;
+
+}io_request_t;
+
+/*
+    Motore di I/O tra il file system ed il file del dispositivo. I dati vengono letti e scritti
+    attraverso la mappatura, quindi le richieste che aspettano il dispositivo sono le scritture su disco
+    di un intervallo (fsync dell'intervallo, vedi flush_range). Con io_uring le richieste di tutti i thread
+    vengono preparate nella stessa coda di sottomissione e inviate insieme con una sola io_uring_enter,
+    più sincronizzazioni possono essere in corso insieme ed un solo thread alla volta aspetta i completamenti.
+    Le code sono quelle condivise con il kernel, mappate con mmap; i puntatori head e tail
+    sono aggiornati anche dal kernel, quindi vengono letti e scritti con operazioni atomiche.
+    Se io_uring non è disponibile (kernel vecchio o chiamata bloccata) viene usato IO_ENGINE_SYNC.
+*/
+typedef struct io_engine{
+
+    uint8_t kind;
+    int fd;                             //File del dispositivo
+    int ring_fd;
+    uint8_t* sq_ring;
+    size_t sq_ring_size;
+    uint8_t* cq_ring;                   //Uguale a sq_ring se il kernel usa una sola mappatura
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t* sq_array;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    struct io_uring_cqe* cqes;
+    uint32_t cq_mask;
+    uint32_t cq_entries;
+    uint32_t queued;                    //Richieste preparate e non ancora sottomesse
+    uint32_t inflight;                  //Richieste sottomesse e non ancora completate
+    uint8_t reaping;                    //Un thread sta aspettando dei completamenti nel kernel
+    pthread_mutex_t lock;               //Protegge le code ed i contatori
+    pthread_cond_t completion;          //Segnalata quando vengono raccolti dei completamenti
+
+}io_engine_t;
+
+/*
+    Contatori delle operazioni sul dispositivo, incrementati con COUNT_STAT senza prendere lock.
+    Successi e fallimenti delle cache sono contati nelle cache stesse, sotto il loro lock.
+*/
+typedef struct fs_stats{
+
+    uint64_t syscalls;          //Chiamate di sistema fatte sul dispositivo
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t seeks;             //Letture che non proseguono la precedente sullo stesso file
+    uint64_t flushes;           //msync della mappatura
+    uint64_t commits;           //Transazioni del journal
+    uint64_t readahead_blocks;  //Blocchi richiesti al kernel dal read-ahead
+    uint64_t buffer_flushes;    //Buffer di scrittura scritti sul dispositivo
+
+}fs_stats_t;
+
 typedef struct filesystem{
 
-    FILE* file;
-    uint8_t* free_space_table;
+    int fd;                     //File che rappresenta il dispositivo di memorizzazione
+    io_engine_t* io;
+    uint8_t* image;             //Mappatura in memoria dell'intero dispositivo
+    size_t image_size;
+    superblock_t sb;
+    uint32_t block_size;        //Copia di sb.block_size, usata ad ogni accesso ad un blocco
+    uint8_t sync_policy;
+    uint8_t read_only;              //Mappatura privata: le modifiche, compreso il replay del journal, non raggiungono il file
+    uint64_t* free_space_table;     //Bitmap dello spazio libero, un bit a 1 per ogni blocco occupato
+    uint8_t* free_space_dirty;      //Blocchi della bitmap modificati dall'ultima sincronizzazione
+    uint32_t free_space_words;
+    uint32_t free_blocks;
+    uint64_t* pending_free;         //Blocchi liberati nella transazione in corso, restano occupati fino al commit (release_pending_blocks)
+    uint32_t pending_blocks;
+    block_num_t alloc_cursor;       //Blocco da cui riprende la ricerca del prossimo blocco libero
     block_num_t* inode_table;
-    file_t* open_file;
+    uint8_t* inode_table_dirty;     //Blocchi della tabella degli inode modificati dall'ultima sincronizzazione
+    uint64_t* inode_bitmap;         //Un bit a 1 per ogni inode assegnato, ricavata dalla tabella degli inode
+    uint32_t inode_bitmap_words;
+    uint32_t free_inodes;
+    inode_num_t inode_cursor;       //Inode da cui riprende la ricerca del prossimo inode libero
+    pthread_mutex_t alloc_lock;     //Protegge bitmap, cursore, contatore dei blocchi liberi, tabella e bitmap degli inode
+    pthread_rwlock_t inode_locks[INODE_LOCK_STRIPES];   //Lock lettori/scrittori degli inode, uno ogni INODE_LOCK_STRIPES inode
+    inode_cache_t* inode_cache;
+    name_cache_t* dentry_cache;
+    name_cache_t* path_cache;
+    journal_t* journal;
+    uint32_t open_files;            //File aperti, vedi open_inode
+    uint64_t buffered_bytes;        //Dati nei buffer di scrittura, vedi write_buffer_t
+    uint32_t readahead_max;         //Finestra massima di read-ahead in blocchi, 0 lo disabilita
+    fs_stats_t stats;
 
 }filesystem_t;
 
@@ -83,865 +514,4727 @@ typedef struct filesystem{
 
 inode_num_t parent_dir_inode_from_path(const char* path,filesystem_t* fs);
 inode_num_t inode_from_path(const char* path,filesystem_t* fs);
-uint32_t block_free_space_left(block_num_t block_num,filesystem_t* fs);
-void move_to_block(block_num_t block_num,off_t offset ,filesystem_t* fs);
+uint8_t* block_ptr(block_num_t block_num,off_t offset ,filesystem_t* fs);
+uint8_t* meta_ptr(block_num_t block_num, off_t offset, uint8_t write, filesystem_t* fs);
+int8_t meta_reserve(block_num_t block_num, filesystem_t* fs);
+void meta_block_forget(block_num_t block_num, filesystem_t* fs);
+void meta_block_forget_range(block_num_t start, uint32_t length, filesystem_t* fs);
+void sync_inode_cache(filesystem_t* fs);
 block_num_t assign_block_to_inode(inode_num_t inode,filesystem_t* fs);
-void sync_fs(filesystem_t* fs);
+uint32_t sync_fs(filesystem_t* fs);
+void flush_write_buffers(filesystem_t* fs);
 int8_t new_file_to_dir(file_t file,const char* path , filesystem_t* fs);
-block_num_t reach_data_end(inode_num_t inode_num, filesystem_t* fs);
+int8_t resolve_parent(const char* path, inode_num_t* parent, const char** name, filesystem_t* fs);
+block_num_t file_block(inode_t* inode ,inode_num_t inode_num ,uint32_t index ,uint8_t alloc ,filesystem_t* fs);
+block_num_t map_file_block(const inode_t* inode, uint32_t index, uint32_t* run);
+int8_t grow_inode(inode_num_t inode_num, uint32_t blocks, filesystem_t* fs);
+void shrink_inode(inode_num_t inode_num, uint32_t keep, filesystem_t* fs);
+uint32_t inode_blocks(const inode_t* inode);
 /*
-    Carica un file system da un file
+    Calcola la disposizione del dispositivo a partire da dimensione del blocco, numero di blocchi
+    e numero di inode presenti in sb. Ritorna -1 se la geometria non è valida.
 */
-FILE* load_fs(char* path){
-    FILE* fs = fopen(path,"rb+");
-    if(fs == NULL)
-        return NULL;
-    return fs;
-}
+int8_t init_superblock(superblock_t* sb){
 
+    uint32_t block_size = sb->block_size;
 
-void format_fs(FILE* fs){
+    if(block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0)
+        return -1;
+
+    if(sb->inodes_count == 0)
+        return -1;
+
+    sb->magic = FSIM_MAGIC;
+    sb->version = FSIM_VERSION;
+    sb->inode_table_start = SUPERBLOCK_BLOCK + 1;
+    sb->inode_table_blocks = ((uint64_t)sb->inodes_count * sizeof(block_num_t) + block_size - 1) / block_size;
+    sb->freespace_table_start = sb->inode_table_start + sb->inode_table_blocks;
+    sb->freespace_table_blocks = ((uint64_t)sb->blocks_count + 8 * block_size - 1) / (8 * block_size);
+    sb->journal_start = sb->freespace_table_start + sb->freespace_table_blocks;
+
+    if(sb->journal_blocks == 0){    //Dimensione predefinita: 1/16 del dispositivo entro i limiti
+        sb->journal_blocks = sb->blocks_count / 16;
+        if(sb->journal_blocks < JOURNAL_MIN_BLOCKS)
+            sb->journal_blocks = JOURNAL_MIN_BLOCKS;
+        if(sb->journal_blocks > JOURNAL_DEFAULT_MAX_BLOCKS)
+            sb->journal_blocks = JOURNAL_DEFAULT_MAX_BLOCKS;
+    }
+
+    sb->journal_blocks &= ~1u;      //Due metà uguali
     
-    uint8_t zeroes[BLOCK_SIZE*MAX_BLOCKS_NUM];
-    memset(zeroes,0,BLOCK_SIZE*MAX_BLOCKS_NUM);
-    fseek(fs,0,0);
-    fwrite(zeroes,1,BLOCK_SIZE*MAX_BLOCKS_NUM,fs);
+    if(sb->journal_blocks < JOURNAL_MIN_BLOCKS)
+        return -1;
+
+    sb->data_start = sb->journal_start + sb->journal_blocks;
+
+    if((uint64_t)sb->blocks_count <= (uint64_t)sb->data_start + 2)    //Deve esserci spazio almeno per la directory root
+        return -1;
+
+    return 0;
 }
 
-/* Gestione tabella degli inode
+/*
 
-Nel primo blocco del dispositivo di memorizzazione (un file) è presente una tabella degli inode che 
-indicizzata per numero di inode associa all'inode il blocco in cui questo è contentuto.
+Motore di I/O, vedi io_engine_t
 
 */
-block_num_t* init_inode_table(){
 
-    block_num_t* new_inode_table =  calloc(MAX_INODES , sizeof(uint8_t));
-    
-    if(new_inode_table == NULL)
+/*
+    Crea una coda io_uring di IO_RING_ENTRIES posti con le chiamate di sistema io_uring_setup e mmap.
+    Ritorna -1 se io_uring non è disponibile o non supporta le operazioni usate.
+*/
+int8_t io_uring_open(io_engine_t* io){
+
+    struct io_uring_params params;
+    struct io_uring_probe* probe;
+    int ring_fd;
+    int8_t supported;
+
+    memset(&params,0,sizeof(params));
+    ring_fd = syscall(__NR_io_uring_setup,IO_RING_ENTRIES,&params);
+
+    if(ring_fd < 0)
+        return -1;
+
+    probe = calloc(1,sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+    supported = probe != NULL && syscall(__NR_io_uring_register,ring_fd,IORING_REGISTER_PROBE,probe,IORING_OP_LAST) == 0
+        && probe->last_op >= IORING_OP_FSYNC && (probe->ops[IORING_OP_FSYNC].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+
+    if(!supported){
+        close(ring_fd);
+        return -1;
+    }
+
+    io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    io->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        if(io->cq_ring_size > io->sq_ring_size)
+            io->sq_ring_size = io->cq_ring_size;
+        io->cq_ring_size = io->sq_ring_size;
+    }
+
+    io->sq_ring = mmap(NULL,io->sq_ring_size,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,ring_fd,IORING_OFF_SQ_RING);
+    io->cq_ring = io->sq_ring;
+
+    if(io->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+        io->cq_ring = mmap(NULL,io->cq_ring_size,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,ring_fd,IORING_OFF_CQ_RING);
+
+    io->sqes = mmap(NULL,params.sq_entries * sizeof(struct io_uring_sqe),PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,ring_fd,IORING_OFF_SQES);
+
+    if(io->sq_ring == MAP_FAILED || io->cq_ring == MAP_FAILED || io->sqes == MAP_FAILED){
+
+        if(io->sqes != MAP_FAILED)
+            munmap(io->sqes,params.sq_entries * sizeof(struct io_uring_sqe));
+        if(io->cq_ring != MAP_FAILED && io->cq_ring != io->sq_ring)
+            munmap(io->cq_ring,io->cq_ring_size);
+        if(io->sq_ring != MAP_FAILED)
+            munmap(io->sq_ring,io->sq_ring_size);
+
+        close(ring_fd);
+        return -1;
+    }
+
+    io->ring_fd = ring_fd;
+    io->sq_head = (uint32_t*)(io->sq_ring + params.sq_off.head);
+    io->sq_tail = (uint32_t*)(io->sq_ring + params.sq_off.tail);
+    io->sq_array = (uint32_t*)(io->sq_ring + params.sq_off.array);
+    io->sq_mask = *(uint32_t*)(io->sq_ring + params.sq_off.ring_mask);
+    io->sq_entries = params.sq_entries;
+    io->cq_head = (uint32_t*)(io->cq_ring + params.cq_off.head);
+    io->cq_tail = (uint32_t*)(io->cq_ring + params.cq_off.tail);
+    io->cqes = (struct io_uring_cqe*)(io->cq_ring + params.cq_off.cqes);
+    io->cq_mask = *(uint32_t*)(io->cq_ring + params.cq_off.ring_mask);
+    io->cq_entries = params.cq_entries;
+
+    return 0;
+}
+
+/*
+    Crea il motore di I/O di tipo kind per il file fd, con IO_ENGINE_SYNC se io_uring non è disponibile.
+    Ritorna NULL se non c'è memoria.
+*/
+io_engine_t* init_io_engine(int fd, uint8_t kind){
+
+    io_engine_t* io = calloc(1,sizeof(io_engine_t));
+
+    if(io == NULL)
         return NULL;
-    
-    return new_inode_table; 
 
+    io->fd = fd;
+    io->ring_fd = -1;
+    io->kind = IO_ENGINE_SYNC;
+    pthread_mutex_init(&io->lock,NULL);
+    pthread_cond_init(&io->completion,NULL);
+
+    if(kind == IO_ENGINE_URING && io_uring_open(io) == 0)
+        io->kind = IO_ENGINE_URING;
+
+    return io;
 }
+
 /*
-    Salva sul file che rappresenta il dispositivo di memorizzazione del file system lo stato attuale 
-    della tabella degli inode
+    Raccoglie i completamenti presenti nella coda, il chiamante deve tenere il lock del motore.
 */
-void sync_inode_table(filesystem_t* fs){
-    
-    fseek(fs->file,0,SEEK_SET);
-    fwrite(fs->inode_table,sizeof(block_num_t),MAX_INODES,fs->file);
-    fflush(fs->file);
+void io_reap(io_engine_t* io){
+
+    uint32_t head = *io->cq_head;
+    uint32_t tail = __atomic_load_n(io->cq_tail,__ATOMIC_ACQUIRE);
+    io_request_t* req;
+
+    if(head == tail)
+        return;
 
+    for(; head != tail; head++){
+
+        req = (io_request_t*)(uintptr_t)io->cqes[head & io->cq_mask].user_data;
+        req->result = io->cqes[head & io->cq_mask].res;
+        req->completed = 1;
+        io->inflight--;
+    }
+
+    __atomic_store_n(io->cq_head,head,__ATOMIC_RELEASE);
+    pthread_cond_broadcast(&io->completion);
 }
 
 /*
-    Legge da un file che rappresenta in dispositivo di memorizzazione del file system lo stato attuale della 
-    tabella degli inode
+    Ritorna un posto libero nella coda di sottomissione per la richiesta req, NULL se la coda è piena
+    o ci sono già tante richieste in corso quanti posti nella coda dei completamenti.
+    Il chiamante deve tenere il lock del motore e, dopo aver riempito il posto, chiamare io_queue.
 */
-void read_inode_table(filesystem_t* fs){
-    
-    fseek(fs->file,0,SEEK_SET);
-    fread(fs->inode_table,sizeof(block_num_t),MAX_INODES,fs->file);
+struct io_uring_sqe* io_get_sqe(io_engine_t* io, io_request_t* req){
+
+    uint32_t tail = *io->sq_tail;
+    struct io_uring_sqe* sqe;
 
+    io_reap(io);
+
+    if(tail - __atomic_load_n(io->sq_head,__ATOMIC_ACQUIRE) >= io->sq_entries || io->inflight + io->queued >= io->cq_entries)
+        return NULL;
+
+    sqe = &io->sqes[tail & io->sq_mask];
+    memset(sqe,0,sizeof(struct io_uring_sqe));
+    sqe->fd = io->fd;
+    sqe->user_data = (uint64_t)(uintptr_t)req;
+    req->completed = 0;
+
+    return sqe;
 }
-/*                             
-    Scorre la tabella degli inode fino a trovare un inode libero,
-    ritorna il numero di inode libero, 0 altrimenti.
-    (0 non potrà mai essere libero in quanto è assegnato alla directory root)
+
+/*
+    Aggiunge alla coda di sottomissione il posto ritornato da io_get_sqe, verrà inviato al kernel con io_submit.
 */
-inode_num_t get_free_inode_number(filesystem_t* fs){
+void io_queue(io_engine_t* io){
 
-    int i = 0;
-    while(i < MAX_INODES && fs->inode_table[i] != 0)
-        i++;
-    
-    if(fs->inode_table[i] == 0)
-        return i;
-    else 
-        return 0;
+    uint32_t tail = *io->sq_tail;
 
+    io->sq_array[tail & io->sq_mask] = tail & io->sq_mask;
+    __atomic_store_n(io->sq_tail,tail + 1,__ATOMIC_RELEASE);
+    io->queued++;
 }
 
 /*
-    Dato un numero di inode ne legge dal file il contenuto, ritorna una rappresentazione 
-    dell'inode letto come variabile di tipo inode_t
+    Invia al kernel con una sola chiamata tutte le richieste preparate da qualsiasi thread.
 */
-inode_t read_inode(uint8_t inode_num, filesystem_t* fs){
+void io_submit(filesystem_t* fs){
 
-    inode_t inode = {0};
-    block_num_t block = fs->inode_table[inode_num];
-   
+    io_engine_t* io = fs->io;
+    int ret;
 
-    inode.size = 0;
+    if(io->kind != IO_ENGINE_URING)
+        return;
 
-    move_to_block(block,0,fs);
-    
-    
-    fread(&(inode.mode),sizeof(mode_t),1,fs->file);
-    
-    fread(&(inode.size),sizeof(size_t),1,fs->file);
-    
-    fread(&(inode.index_vector),sizeof(block_num_t),251,fs->file);
-    
-    return inode;
-}
+    pthread_mutex_lock(&io->lock);
+
+    while(io->queued > 0){
 
+        ret = syscall(__NR_io_uring_enter,io->ring_fd,io->queued,0,0,NULL,0);
+        COUNT_SYSCALL(fs);
 
+        if(ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            break;      //Non può accadere con richieste ben formate, restano nella coda
 
+        if(ret > 0){
+            io->queued -= ret;
+            io->inflight += ret;
+        }
+    }
 
+    pthread_mutex_unlock(&io->lock);
+}
 
-/* Gestione dello spazio libero
-    Nel secondo blocco del dipositivo di memorizzazione è memorizzato un vettore 
-    che indicizzato per numero di blocco indica se lo stesso è occupato o meno
+/*
+    Aspetta il completamento della richiesta req, già sottomessa. Un solo thread alla volta
+    aspetta nel kernel, senza tenere il lock del motore, gli altri aspettano che raccolga i completamenti.
 */
-uint8_t* init_freespace_table(){
+void io_wait(io_request_t* req, filesystem_t* fs){
 
-    uint8_t* new_freespace_table =  calloc(MAX_BLOCKS_NUM , sizeof(uint8_t));
-    new_freespace_table[0] = 1; //Il blocco 0 contiene la tabella degli inode
-    new_freespace_table[1] = 1; //Il blocco 1 contiene la tabella dello spazio libero 
+    io_engine_t* io = fs->io;
 
-    if(new_freespace_table == NULL)
-        return NULL;
-    
-    return new_freespace_table; 
+    pthread_mutex_lock(&io->lock);
+
+    while(!req->completed){
+
+        io_reap(io);
+
+        if(req->completed)
+            break;
+
+        if(io->reaping){
+            pthread_cond_wait(&io->completion,&io->lock);
+            continue;
+        }
+
+        io->reaping = 1;
+        pthread_mutex_unlock(&io->lock);
 
+        syscall(__NR_io_uring_enter,io->ring_fd,0,1,IORING_ENTER_GETEVENTS,NULL,0);
+        COUNT_SYSCALL(fs);
+
+        pthread_mutex_lock(&io->lock);
+        io->reaping = 0;
+        pthread_cond_broadcast(&io->completion);     //Un altro thread può prendere il posto di questo
+    }
+
+    pthread_mutex_unlock(&io->lock);
 }
 
 /*
-    Salva lo stato attuale del vettore dello spazio libero all'interno del file usato come dispositivo di memorizzazione
+    Scrive su disco i byte [start, start + len) del dispositivo, con io_uring aspettando il completamento
+    di un fsync dell'intervallo (equivalente alla msync sincrona della mappatura), inviato insieme
+    alle altre richieste preparate. Un intervallo che arriva alla fine del dispositivo, o più lungo
+    di quanto entra nel campo len della richiesta, viene scritto fino alla fine del file.
+    Ritorna 0, -1 in caso di errore.
 */
-void sync_freespace_table(filesystem_t* fs){
+int8_t io_sync_range(off_t start, size_t len, filesystem_t* fs){
+
+    io_engine_t* io = fs->io;
+    io_request_t req = {0};
+    struct io_uring_sqe* sqe = NULL;
+
+    if(io->kind == IO_ENGINE_URING){
+
+        pthread_mutex_lock(&io->lock);
+        sqe = io_get_sqe(io,&req);
+
+        if(sqe != NULL){
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            sqe->off = start;
+            sqe->len = (len > UINT32_MAX || start + len >= fs->image_size) ? 0 : len;     //len vale 32 bit, 0 arriva fino alla fine del file
+            io_queue(io);
+        }
+
+        pthread_mutex_unlock(&io->lock);
 
-    fseek(fs->file,SEEK_FREESPACE_TABLE_SET,0);
-    fwrite(fs->free_space_table,sizeof(uint8_t),MAX_BLOCKS_NUM,fs->file);
-    fflush(fs->file);
+        if(sqe != NULL){
+            io_submit(fs);
+            io_wait(&req,fs);
+            return req.result < 0 ? -1 : 0;
+        }
+    }
 
+    COUNT_SYSCALL(fs);
+    return msync(fs->image + start,len,MS_SYNC) == -1 ? -1 : 0;
 }
 
+/*
+    Libera il motore di I/O, non devono esserci richieste in corso.
+*/
+void free_io_engine(io_engine_t* io){
+
+    if(io->kind == IO_ENGINE_URING){
+        munmap(io->sqes,io->sq_entries * sizeof(struct io_uring_sqe));
+        if(io->cq_ring != io->sq_ring)
+            munmap(io->cq_ring,io->cq_ring_size);
+        munmap(io->sq_ring,io->sq_ring_size);
+        close(io->ring_fd);
+    }
+
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->completion);
+    free(io);
+}
 
 /*
-    Legge da un file usato come dipositivo di memorizzazione lo stato del vettore dello spazio libero
+    Sceglie il motore di I/O, va chiamata senza richieste in corso (all'avvio).
+    Ritorna il tipo effettivamente in uso: IO_ENGINE_SYNC se io_uring non è disponibile.
 */
-void read_freespace_table(uint8_t* freespace_table, FILE* fs){
-    
-    fseek(fs,SEEK_FREESPACE_TABLE_SET,0);
-    fread(freespace_table,sizeof(uint8_t),MAX_BLOCKS_NUM,fs);
+uint8_t set_io_engine(uint8_t kind, filesystem_t* fs){
+
+    io_engine_t* io = init_io_engine(fs->fd,kind);
+
+    if(io == NULL)
+        return fs->io->kind;
 
+    free_io_engine(fs->io);
+    fs->io = io;
+
+    return io->kind;
 }
 
 /*
-    Scorre la tabella dello spazio libero finchè non trova un blocco libero
+    Carica un file system da un file mappandolo interamente in memoria, la dimensione
+    del dispositivo è data dal superblocco in fs->sb. Se il file è più piccolo del dispositivo viene esteso.
+    Con fs->read_only il file viene aperto in sola lettura e mappato privatamente, senza essere esteso.
+    Ritorna il puntatore alla mappatura, NULL in caso di errore.
 */
-uint8_t get_free_block(uint8_t* freespace_table){
-    
-    int i = 0;
-    
-    while(i < MAX_BLOCKS_NUM && freespace_table[i] != 0)
-        i++;
-    
-    if(freespace_table[i] == 0)
-        return i;
-    
-    else 
-        return 0;
-    
+uint8_t* load_fs(const char* path, filesystem_t* fs){
+
+    struct stat st;
+    size_t image_size = (size_t)fs->sb.blocks_count * fs->sb.block_size;
+    int fd = fs->read_only ? open(path,O_RDONLY) : open(path,O_RDWR | O_CREAT,0644);
+
+    COUNT_SYSCALL(fs);
+
+    if(fd == -1)
+        return NULL;
+
+    COUNT_SYSCALL(fs);
+
+    if(fstat(fd,&st) == -1){
+        close(fd);
+        return NULL;
+    }
+
+    if((size_t)st.st_size < image_size){
+
+        COUNT_SYSCALL(fs);
+
+        if(fs->read_only){
+            close(fd);
+            return NULL;
+        }
+
+        if(ftruncate(fd,image_size) == -1){
+            close(fd);
+            return NULL;
+        }
+    }
+
+    uint8_t* image = mmap(NULL,image_size,PROT_READ | PROT_WRITE,fs->read_only ? MAP_PRIVATE : MAP_SHARED,fd,0);
+    COUNT_SYSCALL(fs);
+
+    if(image == MAP_FAILED){
+        close(fd);
+        return NULL;
+    }
+
+    /*
+        Il read-ahead del kernel segue gli indirizzi della mappatura, non la disposizione dei file:
+        legge pagine vicine a quella richiesta anche durante accessi casuali ai metadati e non
+        segue un file i cui extent non sono contigui. Viene quindi disattivato e sostituito
+        da quello guidato dagli extent (vedi file_readahead).
+    */
+    madvise(image,image_size,MADV_RANDOM);
+    COUNT_SYSCALL(fs);
+
+    fs->io = init_io_engine(fd,IO_ENGINE_URING);
 
+    if(fs->io == NULL){
+        munmap(image,image_size);
+        close(fd);
+        return NULL;
+    }
+
+    fs->fd = fd;
+    fs->image = image;
+    fs->image_size = image_size;
+    fs->block_size = fs->sb.block_size;
+
+    return image;
 }
 
 /*
-    Scorre la tabella dello spazio libero finchè non trova un blocco libero 
-    e imposta come occupato il blocco trovato libero.
-    ritorna il numero del blocco libero trovato.
+    Formatta il dispositivo: scrive il superblocco ed azzera solo le tabelle,
+    i blocchi dati vengono azzerati quando vengono assegnati ad un file.
 */
-uint8_t get_and_set_free_block(filesystem_t* fs){
+void format_fs(filesystem_t* fs){
     
-    uint8_t i = 0;
-    
-    while(i < MAX_BLOCKS_NUM - 1 && fs->free_space_table[i] != 0)
-        i++;
-    
-    if(fs->free_space_table[i] == 0){
-        fs->free_space_table[i] = 1;
-        sync_freespace_table(fs);
-        return i;
+    memset(fs->image,0,(size_t)fs->sb.data_start * fs->block_size);
+    memcpy(block_ptr(SUPERBLOCK_BLOCK,0,fs),&fs->sb,sizeof(superblock_t));
+}
+
+/*
+    Rende persistente su disco l'intervallo [start, start + len) della mappatura, con MS_SYNC
+    tramite il motore di I/O (io_sync_range). msync richiede un indirizzo allineato alla pagina,
+    l'inizio viene quindi arrotondato per difetto.
+*/
+void flush_range(off_t start, size_t len, int flags, filesystem_t* fs){
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    off_t aligned_start = start - (start % page_size);
+
+    if(flags == MS_SYNC)
+        io_sync_range(aligned_start,len + (start - aligned_start),fs);
+    else{
+        msync(fs->image + aligned_start,len + (start - aligned_start),flags);
+        COUNT_SYSCALL(fs);
     }
-    
-    else 
-        return 0;
-    
 
+    COUNT_STAT(fs,flushes,1);
+
+}
+
+/*
+    Imposta la dimensione massima della finestra di read-ahead, in KiB, 0 lo disabilita.
+*/
+void set_readahead_budget(uint32_t kb, filesystem_t* fs){
+    fs->readahead_max = (uint64_t)kb * 1024 / fs->block_size;
 }
 
+/*
+    Punto di sincronizzazione esplicito (fsync, smontaggio): scrive i buffer di scrittura,
+    esegue il commit della transazione in corso e scrive su disco l'intera mappatura (il commit lo fa già se la transazione non è vuota).
+    Non va chiamata tenendo il lock di un inode.
+*/
+void flush_fs(filesystem_t* fs){
+
+    flush_write_buffers(fs);
+
+    if(sync_fs(fs) == 0)
+        flush_range(0,fs->image_size,MS_SYNC,fs);
+
+}
+
+/* Gestione tabella degli inode
+
+A partire dal blocco sb.inode_table_start del dispositivo di memorizzazione (un file) è presente una tabella degli inode che 
+indicizzata per numero di inode associa all'inode il blocco in cui questo è contentuto.
+Il blocco 0 è il superblocco, quindi un elemento a 0 indica sempre un inode libero (anche per l'inode 0, la root).
+
+Per l'assegnazione degli inode in memoria viene mantenuta una bitmap degli inode assegnati, aggiornata da
+set_inode_table_entry e ricostruita dalla tabella al montaggio: la tabella, scritta tramite il journal,
+resta l'unica rappresentazione persistente. La ricerca di un inode libero procede una parola da 64 bit
+alla volta a partire da un cursore, come per i blocchi.
+
+*/
+block_num_t* init_inode_table(uint32_t inodes_count){
+
+    block_num_t* new_inode_table =  calloc(inodes_count , sizeof(block_num_t));
+    
+    if(new_inode_table == NULL)
+        return NULL;
+    
+    return new_inode_table; 
+
+}
+/*
+    Crea la bitmap degli inode con tutti gli inode liberi, i bit oltre l'ultimo inode sono segnati come occupati.
+*/
+uint64_t* init_inode_bitmap(uint32_t inodes_count){
+
+    uint32_t words = (inodes_count + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    uint64_t* new_inode_bitmap = calloc(words,sizeof(uint64_t));
+
+    if(new_inode_bitmap == NULL)
+        return NULL;
+
+    for(uint64_t i = inodes_count; i < (uint64_t)words * BITS_PER_WORD; i++)
+        new_inode_bitmap[i / BITS_PER_WORD] |= 1ULL << (i % BITS_PER_WORD);
+
+    return new_inode_bitmap;
+
+}
+
+/*
+    Riporta nella transazione in corso i blocchi della tabella degli inode modificati dall'ultima sincronizzazione.
+*/
+void sync_inode_table(filesystem_t* fs){
+    
+    size_t table_size = sizeof(block_num_t) * fs->sb.inodes_count;
+    size_t offset;
+    size_t len;
+    uint8_t* block;
+
+    for(uint32_t i = 0; i < fs->sb.inode_table_blocks; i++){
+
+        if(fs->inode_table_dirty[i] == 0)
+            continue;
+
+        offset = (size_t)i * fs->block_size;
+        len = (table_size - offset < fs->block_size) ? table_size - offset : fs->block_size;
+        block = meta_ptr(fs->sb.inode_table_start + i,0,1,fs);
+
+        if(block == NULL)       //Resta da scrivere, vedi sync_fs
+            continue;
+
+        memcpy(block,(uint8_t*)fs->inode_table + offset,len);
+        fs->inode_table_dirty[i] = 0;
+    }
+
+}
+
+/*
+    Assegna un blocco ad un numero di inode nella tabella in memoria, va chiamata con alloc_lock.
+*/
+void set_inode_table_entry(inode_num_t inode, block_num_t block, filesystem_t* fs){
+
+    uint64_t mask = 1ULL << (inode % BITS_PER_WORD);
+    uint64_t* word = &fs->inode_bitmap[inode / BITS_PER_WORD];
+
+    if(block != 0 && fs->inode_table[inode] == 0){
+        *word |= mask;
+        fs->free_inodes--;
+    }
+    else if(block == 0 && fs->inode_table[inode] != 0){
+        *word &= ~mask;
+        fs->free_inodes++;
+
+        if(inode < fs->inode_cursor)    //Gli inode liberati vengono riusati per primi
+            fs->inode_cursor = inode;
+    }
+
+    fs->inode_table[inode] = block;
+    fs->inode_table_dirty[((size_t)inode * sizeof(block_num_t)) / fs->block_size] = 1;
+
+}
+
+/*
+    Legge da un file che rappresenta in dispositivo di memorizzazione del file system lo stato attuale della 
+    tabella degli inode
+*/
+void read_inode_table(filesystem_t* fs){
+    
+    memcpy(fs->inode_table,block_ptr(fs->sb.inode_table_start,0,fs),sizeof(block_num_t) * fs->sb.inodes_count);
+
+    for(inode_num_t i = 0; i < fs->sb.inodes_count; i++){
+        if(fs->inode_table[i] != 0){
+            fs->inode_bitmap[i / BITS_PER_WORD] |= 1ULL << (i % BITS_PER_WORD);
+            fs->free_inodes--;
+        }
+    }
+
+}
+/*
+    Cerca un inode libero a partire dal cursore, una parola della bitmap alla volta,
+    ricominciando dall'inizio una volta raggiunta la fine. Va chiamata con alloc_lock.
+    Ritorna 0 e scrive il numero di inode in inode, -1 se non ci sono inode liberi.
+*/
+int8_t get_free_inode_number(inode_num_t* inode, filesystem_t* fs){
+
+    uint32_t words = fs->inode_bitmap_words;
+    uint32_t w = fs->inode_cursor / BITS_PER_WORD;
+    uint64_t free_bits;
+
+    if(fs->free_inodes == 0)
+        return -1;
+
+    for(uint32_t n = 0; n <= words; n++){
+
+        free_bits = ~fs->inode_bitmap[w];
+
+        if(n == 0)      //Nella prima parola vanno ignorati gli inode che precedono il cursore
+            free_bits &= ~0ULL << (fs->inode_cursor % BITS_PER_WORD);
+
+        if(free_bits != 0){
+            *inode = (inode_num_t)w * BITS_PER_WORD + __builtin_ctzll(free_bits);
+            return 0;
+        }
+
+        w = (w + 1 == words) ? 0 : w + 1;
+    }
+
+    return -1;
+
+}
+
+/*
+    Ritorna 1 se i dati del file si trovano nell'inode invece che in blocchi propri.
+*/
+uint8_t inode_is_inline(const inode_t* inode, filesystem_t* fs){
+
+    return S_ISREG(inode->mode) && inode->extent_count == 0 && inode->size > 0 && inode->size <= INLINE_DATA_MAX(fs);
+}
+
+/*
+    Dato un numero di inode ne legge dal file il contenuto decodificandolo in inode.
+*/
+void load_inode(inode_num_t inode_num, inode_t* inode, filesystem_t* fs){
+
+    block_num_t block = fs->inode_table[inode_num];
+    uint8_t* inode_block = meta_ptr(block,0,0,fs);
+
+    memcpy(&(inode->mode),inode_block + MODE_OFFSET_IN_INODE,sizeof(mode_t));
+
+    memcpy(&(inode->extent_count),inode_block + EXTENT_COUNT_OFFSET_IN_INODE,sizeof(uint32_t));
+    
+    memcpy(&(inode->size),inode_block + SIZE_OFFSET_IN_INODE,sizeof(uint64_t));
+
+    if(inode->extent_count > MAX_EXTENTS_PER_NODE(fs))
+        inode->extent_count = MAX_EXTENTS_PER_NODE(fs);
+    
+    if(inode_is_inline(inode,fs))
+        memcpy(inode->inline_data,inode_block + EXTENTS_OFFSET_IN_INODE,inode->size);
+    else
+        memcpy(&(inode->extents),inode_block + EXTENTS_OFFSET_IN_INODE,sizeof(extent_t)*inode->extent_count);
+
+}
+
+/*
+    Scrive nel blocco dell'inode, all'interno della transazione in corso, il contenuto della sua rappresentazione in memoria.
+    Ritorna -1 se non c'è memoria per la copia del blocco, vedi meta_ptr.
+*/
+int8_t store_inode(inode_num_t inode_num, const inode_t* inode, filesystem_t* fs){
+
+    block_num_t block = fs->inode_table[inode_num];
+    uint8_t* inode_block = meta_ptr(block,0,1,fs);
+
+    if(inode_block == NULL)
+        return -1;
+
+    memcpy(inode_block + MODE_OFFSET_IN_INODE,&(inode->mode),sizeof(mode_t));
+
+    memcpy(inode_block + EXTENT_COUNT_OFFSET_IN_INODE,&(inode->extent_count),sizeof(uint32_t));
+    
+    memcpy(inode_block + SIZE_OFFSET_IN_INODE,&(inode->size),sizeof(uint64_t));
+    
+    if(inode_is_inline(inode,fs))
+        memcpy(inode_block + EXTENTS_OFFSET_IN_INODE,inode->inline_data,inode->size);
+    else
+        memcpy(inode_block + EXTENTS_OFFSET_IN_INODE,&(inode->extents),sizeof(extent_t)*inode->extent_count);
+
+    return 0;
+}
+
+/* Lock degli inode
+    Ogni inode è protetto dal lock lettori/scrittori inode_num % INODE_LOCK_STRIPES:
+    le letture (contenuto, attributi, ricerca in una directory) lo prendono in lettura,
+    le modifiche (scrittura, creazione di elementi in una directory) in scrittura.
+    Quando servono due inode i lock vengono presi in ordine di indice, così da non creare cicli.
+*/
+
+pthread_rwlock_t* inode_lock(inode_num_t inode_num, filesystem_t* fs){
+
+    return &fs->inode_locks[inode_num % INODE_LOCK_STRIPES];
+
+}
+
+void lock_inode(inode_num_t inode_num, uint8_t write, filesystem_t* fs){
+
+    if(write)
+        pthread_rwlock_wrlock(inode_lock(inode_num,fs));
+    else
+        pthread_rwlock_rdlock(inode_lock(inode_num,fs));
+
+}
+
+/*
+    Prova a prendere in lettura il lock di un inode senza attendere, ritorna 0 se è stato preso.
+    Serve a chi tiene già il lock di un altro inode e non può rispettare l'ordine tra i lock.
+*/
+int8_t try_lock_inode(inode_num_t inode_num, filesystem_t* fs){
+
+    return pthread_rwlock_tryrdlock(inode_lock(inode_num,fs)) == 0 ? 0 : -1;
+
+}
+
+void unlock_inode(inode_num_t inode_num, filesystem_t* fs){
+
+    pthread_rwlock_unlock(inode_lock(inode_num,fs));
+
+}
+
+/*
+    Prende in scrittura i lock di due inode, un'unica volta se appartengono allo stesso lock.
+*/
+void lock_inode_pair(inode_num_t a, inode_num_t b, filesystem_t* fs){
+
+    uint32_t first = a % INODE_LOCK_STRIPES;
+    uint32_t second = b % INODE_LOCK_STRIPES;
+
+    if(first > second){
+        uint32_t tmp = first;
+        first = second;
+        second = tmp;
+    }
+
+    pthread_rwlock_wrlock(&fs->inode_locks[first]);
+
+    if(second != first)
+        pthread_rwlock_wrlock(&fs->inode_locks[second]);
+
+}
+
+void unlock_inode_pair(inode_num_t a, inode_num_t b, filesystem_t* fs){
+
+    unlock_inode(a,fs);
+
+    if(a % INODE_LOCK_STRIPES != b % INODE_LOCK_STRIPES)
+        unlock_inode(b,fs);
+
+}
+
+/*
+    Prende in scrittura i lock di count inode, nell'ordine dei lock ed ognuno una sola volta:
+    serve alle operazioni che modificano più di due inode, come la rinomina.
+*/
+void lock_inodes(const inode_num_t* inodes, uint32_t count, filesystem_t* fs){
+
+    uint8_t held[INODE_LOCK_STRIPES] = {0};
+
+    for(uint32_t i = 0; i < count; i++)
+        held[inodes[i] % INODE_LOCK_STRIPES] = 1;
+
+    for(uint32_t i = 0; i < INODE_LOCK_STRIPES; i++)
+        if(held[i])
+            pthread_rwlock_wrlock(&fs->inode_locks[i]);
+
+}
+
+void unlock_inodes(const inode_num_t* inodes, uint32_t count, filesystem_t* fs){
+
+    uint8_t held[INODE_LOCK_STRIPES] = {0};
+
+    for(uint32_t i = 0; i < count; i++)
+        held[inodes[i] % INODE_LOCK_STRIPES] = 1;
+
+    for(uint32_t i = 0; i < INODE_LOCK_STRIPES; i++)
+        if(held[i])
+            pthread_rwlock_unlock(&fs->inode_locks[i]);
+
+}
+
+/* Gestione cache degli inode */
+
+inode_cache_t* init_inode_cache(){
+
+    inode_cache_t* new_cache = calloc(1,sizeof(inode_cache_t));
+
+    if(new_cache == NULL)
+        return NULL;
+
+    pthread_mutex_init(&new_cache->lock,NULL);
+    return new_cache;
+
+}
+
+void inode_cache_lru_unlink(inode_cache_entry_t* entry, inode_cache_t* cache){
+
+    if(entry->lru_prev != NULL)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        cache->lru_head = entry->lru_next;
+
+    if(entry->lru_next != NULL)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        cache->lru_tail = entry->lru_prev;
+
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+
+}
+
+void inode_cache_lru_push(inode_cache_entry_t* entry, inode_cache_t* cache){
+
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+
+    if(cache->lru_head != NULL)
+        cache->lru_head->lru_prev = entry;
+    else
+        cache->lru_tail = entry;
+
+    cache->lru_head = entry;
+
+}
+
+inode_cache_entry_t* inode_cache_lookup(inode_num_t inode_num, inode_cache_t* cache){
+
+    inode_cache_entry_t* entry = cache->buckets[inode_num % INODE_CACHE_BUCKETS];
+
+    while(entry != NULL && entry->inode_num != inode_num)
+        entry = entry->hash_next;
+
+    return entry;
+
+}
+
+/*
+    Rimuove dalla cache l'elemento usato meno di recente tra quelli il cui lock è libero e non aperti,
+    se è stato modificato lo scrive prima sul suo blocco. Ritorna l'elemento rimosso per poterlo
+    riutilizzare, NULL se tutti gli elementi sono in uso. Va chiamata con il lock della cache.
+*/
+inode_cache_entry_t* inode_cache_evict(filesystem_t* fs){
+
+    inode_cache_t* cache = fs->inode_cache;
+    inode_cache_entry_t* victim = cache->lru_tail;
+    inode_cache_entry_t* prev;
+    inode_cache_entry_t** link;
+
+    /*
+        Un elemento in uso viene spostato in testa alla lista: altrimenti, ad esempio durante molte creazioni
+        nella stessa directory, gli inode che ne condividono il lock si accumulerebbero in coda
+        e verrebbero esaminati di nuovo ad ogni rimozione.
+    */
+    for(uint32_t scanned = 0; victim != NULL && (victim->pins > 0 || pthread_rwlock_trywrlock(inode_lock(victim->inode_num,fs)) != 0); scanned++){
+
+        if(scanned == cache->count)
+            return NULL;
+
+        prev = victim->lru_prev;
+        inode_cache_lru_unlink(victim,cache);
+        inode_cache_lru_push(victim,cache);
+        victim = prev;
+    }
+
+    if(victim == NULL)
+        return NULL;
+
+    if(victim->dirty){
+
+        if(store_inode(victim->inode_num,&victim->inode,fs) == -1){     //Resta in cache fino al commit
+            unlock_inode(victim->inode_num,fs);
+            return NULL;
+        }
+
+        cache->dirty_count--;
+    }
+
+    unlock_inode(victim->inode_num,fs);
+
+    link = &cache->buckets[victim->inode_num % INODE_CACHE_BUCKETS];
+
+    while(*link != victim)
+        link = &(*link)->hash_next;
+
+    *link = victim->hash_next;
+    inode_cache_lru_unlink(victim,cache);
+    cache->count--;
+
+    return victim;
+
+}
+
+/*
+    Ritorna il puntatore alla copia in memoria dell'inode, caricandola dal dispositivo se non è in cache.
+    Il chiamante deve tenere il lock dell'inode, il puntatore resta valido finché lo tiene.
+    Ritorna NULL se l'inode non è in cache e non c'è memoria per caricarlo.
+*/
+inode_t* get_inode(inode_num_t inode_num, filesystem_t* fs){
+
+    inode_cache_t* cache = fs->inode_cache;
+    inode_cache_entry_t* entry;
+
+    pthread_mutex_lock(&cache->lock);
+    entry = inode_cache_lookup(inode_num,cache);
+
+    if(entry != NULL){
+        inode_cache_lru_unlink(entry,cache);
+        inode_cache_lru_push(entry,cache);
+        cache->hits++;
+        pthread_mutex_unlock(&cache->lock);
+        return &entry->inode;
+    }
+
+    cache->misses++;
+
+    if(cache->count >= INODE_CACHE_SIZE)
+        entry = inode_cache_evict(fs);
+
+    if(entry == NULL)       //Cache non piena o tutti gli elementi in uso
+        entry = malloc(sizeof(inode_cache_entry_t));
+
+    if(entry == NULL){
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+
+    entry->inode_num = inode_num;
+    entry->dirty = 0;
+    entry->write_error = 0;
+    entry->released = 0;
+    entry->pins = 0;
+    entry->map_generation = 0;
+    entry->mapped = 0;
+    entry->held = NULL;
+    entry->held_count = 0;
+    entry->wbuf = NULL;
+    memset(&entry->ra,0,sizeof(readahead_t));
+    load_inode(inode_num,&entry->inode,fs);
+
+    entry->hash_next = cache->buckets[inode_num % INODE_CACHE_BUCKETS];
+    cache->buckets[inode_num % INODE_CACHE_BUCKETS] = entry;
+    inode_cache_lru_push(entry,cache);
+    cache->count++;
+    pthread_mutex_unlock(&cache->lock);
+
+    return &entry->inode;
+
+}
+
+/*
+    Ritorna l'elemento della cache che contiene l'inode ritornato da get_inode.
+*/
+inode_cache_entry_t* inode_cache_entry_of(inode_t* inode){
+    return (inode_cache_entry_t*)((uint8_t*)inode - offsetof(inode_cache_entry_t,inode));
+}
+
+/*
+    Segna come modificata la copia in memoria di un inode, verrà scritta sul dispositivo
+    alla rimozione dalla cache o alla prossima sync_inode_cache.
+*/
+void mark_inode_dirty(inode_num_t inode_num, filesystem_t* fs){
+
+    inode_cache_entry_t* entry;
+
+    pthread_mutex_lock(&fs->inode_cache->lock);
+    entry = inode_cache_lookup(inode_num,fs->inode_cache);
+
+    if(entry != NULL && !entry->dirty){
+        entry->dirty = 1;
+        fs->inode_cache->dirty_count++;
+    }
+
+    pthread_mutex_unlock(&fs->inode_cache->lock);
+
+}
+
+/*
+    Rimuove dalla cache, senza scriverlo, un inode che è stato liberato, scartando il suo buffer di scrittura.
+    Se il file è ancora aperto l'elemento viene solo segnato come released e liberato alla chiusura
+    (con FUSE non accade: un file aperto viene rinominato invece di essere rimosso).
+    Il chiamante deve tenerne il lock in scrittura.
+*/
+void inode_cache_drop(inode_num_t inode_num, filesystem_t* fs){
+
+    inode_cache_t* cache = fs->inode_cache;
+    inode_cache_entry_t** link;
+    inode_cache_entry_t* entry;
+
+    pthread_mutex_lock(&cache->lock);
+    link = &cache->buckets[inode_num % INODE_CACHE_BUCKETS];
+
+    while(*link != NULL && (*link)->inode_num != inode_num)
+        link = &(*link)->hash_next;
+
+    entry = *link;
+
+    if(entry != NULL){
+        *link = entry->hash_next;
+        inode_cache_lru_unlink(entry,cache);
+        cache->count--;
+
+        if(entry->dirty)
+            cache->dirty_count--;
+
+        if(entry->wbuf != NULL){
+            __atomic_fetch_sub(&fs->buffered_bytes,entry->wbuf->size,__ATOMIC_RELAXED);
+            free(entry->wbuf->data);
+            free(entry->wbuf);
+            entry->wbuf = NULL;
+        }
+
+        if(entry->pins > 0)
+            entry->released = 1;
+        else
+            free(entry);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+}
+
+/*
+    Scrive sul dispositivo tutti gli inode modificati presenti in cache.
+    Non vengono presi i lock degli inode: un inode modificato in questo momento viene comunque
+    segnato di nuovo come dirty al termine della modifica e riscritto alla sincronizzazione successiva.
+    Anche un inode per cui non c'è memoria resta dirty, vedi sync_fs.
+*/
+void sync_inode_cache(filesystem_t* fs){
+
+    pthread_mutex_lock(&fs->inode_cache->lock);
+
+    inode_cache_entry_t* entry = fs->inode_cache->lru_head;
+
+    while(entry != NULL){
+
+        if(entry->dirty && store_inode(entry->inode_num,&entry->inode,fs) == 0){
+            entry->dirty = 0;
+            fs->inode_cache->dirty_count--;
+        }
+
+        entry = entry->lru_next;
+    }
+
+    pthread_mutex_unlock(&fs->inode_cache->lock);
+
+}
+
+void free_inode_cache(inode_cache_t* cache){
+
+    inode_cache_entry_t* entry = cache->lru_head;
+    inode_cache_entry_t* next;
+
+    while(entry != NULL){
+        next = entry->lru_next;
+        free(entry);
+        entry = next;
+    }
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+
+}
+
+/*
+    Ritorna una copia dell'inode dato il suo numero, il chiamante deve tenerne il lock.
+*/
+inode_t read_inode(inode_num_t inode_num, filesystem_t* fs){
+
+    return *get_inode(inode_num,fs);
+}
+
+
+
+
+
+/*
+
+Cache dei nomi
+
+*/
+
+/*
+    Hash FNV-1a dei primi name_lenght byte del nome combinato con il numero di inode della directory.
+*/
+uint32_t name_hash(inode_num_t parent, const char* name, size_t name_lenght){
+
+    uint32_t hash = 2166136261u ^ parent;
+
+    for(size_t i = 0; i < name_lenght; i++){
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+
+}
+
+name_cache_t* init_name_cache(uint32_t capacity){
+
+    name_cache_t* new_cache = calloc(1,sizeof(name_cache_t));
+
+    if(new_cache == NULL)
+        return NULL;
+
+    new_cache->capacity = capacity;
+    pthread_mutex_init(&new_cache->lock,NULL);
+    return new_cache;
+
+}
+
+void name_cache_lru_unlink(name_cache_entry_t* entry, name_cache_t* cache){
+
+    if(entry->lru_prev != NULL)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        cache->lru_head = entry->lru_next;
+
+    if(entry->lru_next != NULL)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        cache->lru_tail = entry->lru_prev;
+
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+
+}
+
+void name_cache_lru_push(name_cache_entry_t* entry, name_cache_t* cache){
+
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+
+    if(cache->lru_head != NULL)
+        cache->lru_head->lru_prev = entry;
+    else
+        cache->lru_tail = entry;
+
+    cache->lru_head = entry;
+
+}
+
+/*
+    Ritorna il puntatore al collegamento che punta all'elemento cercato all'interno della sua lista hash,
+    il collegamento punta a NULL se l'elemento non è presente. Il nome cercato sono i primi name_lenght byte di name,
+    che non deve essere terminato.
+*/
+name_cache_entry_t** name_cache_find(inode_num_t parent, const char* name, size_t name_lenght, uint32_t hash, name_cache_t* cache){
+
+    name_cache_entry_t** link = &cache->buckets[hash % NAME_CACHE_BUCKETS];
+
+    while(*link != NULL && ((*link)->hash != hash || (*link)->parent != parent
+        || strncmp((*link)->name,name,name_lenght) != 0 || (*link)->name[name_lenght] != '\0'))
+        link = &(*link)->hash_next;
+
+    return link;
+
+}
+
+void name_cache_unlink(name_cache_entry_t** link, name_cache_t* cache){
+
+    name_cache_entry_t* entry = *link;
+
+    *link = entry->hash_next;
+    name_cache_lru_unlink(entry,cache);
+    free(entry->name);
+    free(entry);
+    cache->count--;
+
+}
+
+/*
+    Ritorna l'inode associato al nome (i primi name_lenght byte di name) nella directory parent,
+    0 se non è presente in cache.
+*/
+inode_num_t name_cache_lookup(inode_num_t parent, const char* name, size_t name_lenght, name_cache_t* cache){
+
+    name_cache_entry_t* entry;
+    inode_num_t inode_num = 0;
+
+    pthread_mutex_lock(&cache->lock);
+    entry = *name_cache_find(parent,name,name_lenght,name_hash(parent,name,name_lenght),cache);
+
+    if(entry != NULL){
+        name_cache_lru_unlink(entry,cache);
+        name_cache_lru_push(entry,cache);
+        inode_num = entry->inode_num;
+        cache->hits++;
+    }
+    else
+        cache->misses++;
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return inode_num;
+
+}
+
+/*
+    Associa il nome all'inode, va chiamata con il lock della cache.
+*/
+void name_cache_add(inode_num_t parent, const char* name, size_t name_lenght, inode_num_t inode_num, name_cache_t* cache){
+
+    uint32_t hash = name_hash(parent,name,name_lenght);
+    name_cache_entry_t** link;
+    name_cache_entry_t* entry;
+
+    link = name_cache_find(parent,name,name_lenght,hash,cache);
+    entry = *link;
+
+    if(entry != NULL){
+        entry->inode_num = inode_num;
+        return;
+    }
+
+    if(cache->count >= cache->capacity){
+        entry = cache->lru_tail;
+        name_cache_unlink(name_cache_find(entry->parent,entry->name,strlen(entry->name),entry->hash,cache),cache);
+    }
+
+    entry = malloc(sizeof(name_cache_entry_t));
+
+    if(entry == NULL)
+        return;
+
+    entry->name = strndup(name,name_lenght);
+
+    if(entry->name == NULL){   //Senza memoria il nome semplicemente non viene messo in cache
+        free(entry);
+        return;
+    }
+
+    entry->parent = parent;
+    entry->inode_num = inode_num;
+    entry->hash = hash;
+
+    entry->hash_next = cache->buckets[hash % NAME_CACHE_BUCKETS];
+    cache->buckets[hash % NAME_CACHE_BUCKETS] = entry;
+    name_cache_lru_push(entry,cache);
+    cache->count++;
+
+}
+
+/*
+    Associa il nome all'inode. Per la cache delle dentry il chiamante deve tenere il lock della directory,
+    così che il nome non possa essere rimosso (invalidate_dir_entry) tra la ricerca e l'inserimento.
+*/
+void name_cache_insert(inode_num_t parent, const char* name, size_t name_lenght, inode_num_t inode_num, name_cache_t* cache){
+
+    pthread_mutex_lock(&cache->lock);
+    name_cache_add(parent,name,name_lenght,inode_num,cache);
+    pthread_mutex_unlock(&cache->lock);
+
+}
+
+/*
+    Generazione corrente della cache, da passare a name_cache_insert_since.
+*/
+uint64_t name_cache_generation(name_cache_t* cache){
+
+    uint64_t generation;
+
+    pthread_mutex_lock(&cache->lock);
+    generation = cache->generation;
+    pthread_mutex_unlock(&cache->lock);
+
+    return generation;
+
+}
+
+/*
+    Come name_cache_insert, ma il nome viene inserito solo se la cache non è stata svuotata dopo
+    la lettura di generation: un nome risolto senza lock nel frattempo può essere stato rimosso.
+*/
+void name_cache_insert_since(inode_num_t parent, const char* name, size_t name_lenght, inode_num_t inode_num, uint64_t generation, name_cache_t* cache){
+
+    pthread_mutex_lock(&cache->lock);
+
+    if(cache->generation == generation)
+        name_cache_add(parent,name,name_lenght,inode_num,cache);
+
+    pthread_mutex_unlock(&cache->lock);
+
+}
+
+/*
+    Rimuove dalla cache il nome dato, se presente.
+*/
+void name_cache_invalidate(inode_num_t parent, const char* name, name_cache_t* cache){
+
+    name_cache_entry_t** link;
+
+    pthread_mutex_lock(&cache->lock);
+    link = name_cache_find(parent,name,strlen(name),name_hash(parent,name,strlen(name)),cache);
+
+    if(*link != NULL)
+        name_cache_unlink(link,cache);
+
+    pthread_mutex_unlock(&cache->lock);
+
+}
+
+/*
+    Svuota la cache, va usata quando una modifica può rendere non validi più nomi insieme
+    (es. rinomina o rimozione di una directory per la cache dei path).
+*/
+void name_cache_clear(name_cache_t* cache){
+
+    pthread_mutex_lock(&cache->lock);
+    cache->generation++;
+
+    while(cache->lru_head != NULL){
+        name_cache_entry_t* entry = cache->lru_head;
+        name_cache_unlink(name_cache_find(entry->parent,entry->name,strlen(entry->name),entry->hash,cache),cache);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+}
+
+void free_name_cache(name_cache_t* cache){
+
+    name_cache_clear(cache);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+
+}
+
+/*
+    Da chiamare quando l'elemento name viene rimosso dalla directory dir_inode_num o rinominato:
+    rimuove la dentry e, non potendo sapere quali path passano per l'elemento, svuota la cache dei path.
+*/
+void invalidate_dir_entry(inode_num_t dir_inode_num, const char* name, filesystem_t* fs){
+
+    name_cache_invalidate(dir_inode_num,name,fs->dentry_cache);
+    name_cache_clear(fs->path_cache);
+
+}
+
+/*-------------------------*/
+
+
+/* Gestione dello spazio libero
+    A partire dal blocco sb.freespace_table_start del dipositivo di memorizzazione è memorizzata una bitmap 
+    che indicizzata per numero di blocco indica se lo stesso è occupato (bit a 1) o meno.
+    In memoria la bitmap è un vettore di parole da 64 bit (little endian, come sul dispositivo),
+    la ricerca di un blocco libero esamina una parola alla volta e riparte dall'ultimo blocco assegnato (next-fit).
+    Le modifiche vengono segnate per blocco della bitmap e scritte sul dispositivo solo alla sincronizzazione.
+    Un blocco liberato non torna libero subito: finché la transazione che lo libera non è stata scritta,
+    dopo un'interruzione il replay lo riporta al suo vecchio proprietario, e non può essere riassegnato
+    né sovrascritto nella sua posizione (ad esempio da grow_inode). Viene segnato in pending_free e
+    restituito alla bitmap da sync_fs, all'interno del commit.
+    get_and_set_free_block, get_and_set_free_extent, release_block e release_extent prendono alloc_lock,
+    le altre funzioni vanno chiamate con il lock già preso.
+*/
+uint64_t* init_freespace_table(const superblock_t* sb){
+
+    uint32_t words = ((uint64_t)sb->freespace_table_blocks * sb->block_size) / sizeof(uint64_t);
+    uint64_t* new_freespace_table =  calloc(words , sizeof(uint64_t));
+
+    if(new_freespace_table == NULL)
+        return NULL;
+
+    /* Superblocco e tabelle sono sempre occupati, come i bit oltre l'ultimo blocco del dispositivo */
+    for(uint32_t i = 0; i < sb->data_start; i++)
+        new_freespace_table[i / BITS_PER_WORD] |= 1ULL << (i % BITS_PER_WORD);
+
+    for(uint64_t i = sb->blocks_count; i < (uint64_t)words * BITS_PER_WORD; i++)
+        new_freespace_table[i / BITS_PER_WORD] |= 1ULL << (i % BITS_PER_WORD);
+    
+    return new_freespace_table; 
+
+}
+
+/*
+    Conta i blocchi liberi della bitmap, una parola alla volta.
+*/
+uint32_t count_free_blocks(filesystem_t* fs){
+
+    uint32_t used = 0;
+
+    for(uint32_t i = 0; i < fs->free_space_words; i++)
+        used += __builtin_popcountll(fs->free_space_table[i]);
+
+    return fs->free_space_words * BITS_PER_WORD - used;
+
+}
+
+/*
+    Riporta nella transazione in corso i blocchi della bitmap modificati dall'ultima sincronizzazione.
+*/
+void sync_freespace_table(filesystem_t* fs){
+
+    uint8_t* block;
+
+    for(uint32_t i = 0; i < fs->sb.freespace_table_blocks; i++){
+
+        if(fs->free_space_dirty[i] == 0)
+            continue;
+
+        block = meta_ptr(fs->sb.freespace_table_start + i,0,1,fs);
+
+        if(block == NULL)       //Resta da scrivere, vedi sync_fs
+            continue;
+
+        memcpy(block,(uint8_t*)fs->free_space_table + (size_t)i * fs->block_size,fs->block_size);
+        fs->free_space_dirty[i] = 0;
+    }
+
+}
+
+
+/*
+    Legge da un file usato come dipositivo di memorizzazione lo stato della bitmap dello spazio libero
+*/
+void read_freespace_table(uint64_t* freespace_table, filesystem_t* fs){
+    
+    memcpy(freespace_table,block_ptr(fs->sb.freespace_table_start,0,fs),(size_t)fs->sb.freespace_table_blocks * fs->block_size);
+
+}
+
+uint8_t is_block_used(block_num_t block_num, filesystem_t* fs){
+
+    return (fs->free_space_table[block_num / BITS_PER_WORD] >> (block_num % BITS_PER_WORD)) & 1;
+
+}
+
+/*
+    Imposta lo stato di un blocco nella bitmap e segna come modificato il blocco della bitmap che lo contiene.
+*/
+void set_block_state(block_num_t block_num, uint8_t used, filesystem_t* fs){
+
+    uint64_t mask = 1ULL << (block_num % BITS_PER_WORD);
+    uint64_t* word = &fs->free_space_table[block_num / BITS_PER_WORD];
+
+    if(used == is_block_used(block_num,fs))
+        return;
+
+    if(used){
+        *word |= mask;
+        fs->free_blocks--;
+    }
+    else{
+        *word &= ~mask;
+        fs->free_blocks++;
+    }
+
+    fs->free_space_dirty[block_num / (8 * fs->block_size)] = 1;
+
+}
+
+/*
+    Cerca un blocco libero a partire dal cursore, una parola da 64 bit alla volta,
+    ricominciando dall'inizio della bitmap una volta raggiunta la fine.
+    Ritorna 0 se non ci sono blocchi liberi (il blocco 0 è sempre occupato dal superblocco).
+*/
+block_num_t get_free_block(filesystem_t* fs){
+    
+    uint32_t words = fs->free_space_words;
+    uint32_t start = fs->alloc_cursor / BITS_PER_WORD;
+    uint32_t w = start;
+    uint64_t free_bits;
+
+    if(fs->free_blocks == 0)
+        return 0;
+
+    for(uint32_t n = 0; n <= words; n++){
+
+        free_bits = ~fs->free_space_table[w];
+
+        if(n == 0)      //Nella prima parola vanno ignorati i blocchi che precedono il cursore
+            free_bits &= ~0ULL << (fs->alloc_cursor % BITS_PER_WORD);
+
+        if(free_bits != 0)
+            return (block_num_t)w * BITS_PER_WORD + __builtin_ctzll(free_bits);
+
+        w = (w + 1 == words) ? 0 : w + 1;
+    }
+
+    return 0;
+
+}
+
+/*
+    Cerca un blocco libero e lo imposta come occupato, il cursore viene spostato
+    subito dopo il blocco assegnato.
+    ritorna il numero del blocco libero trovato, 0 se non ce ne sono.
+*/
+block_num_t get_and_set_free_block(filesystem_t* fs){
+    
+    pthread_mutex_lock(&fs->alloc_lock);
+
+    block_num_t i = get_free_block(fs);
+    
+    if(i != 0){
+        set_block_state(i,1,fs);
+        fs->alloc_cursor = (i + 1 < fs->sb.blocks_count) ? i + 1 : fs->sb.data_start;
+    }
+
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    return i;
+
+}
+
+/*
+    Assegna fino a want blocchi contigui: a partire da goal se è libero, in modo da estendere
+    l'extent che termina in goal, altrimenti dal primo blocco libero dopo il cursore.
+    Ritorna il primo blocco assegnato ed in got il numero di blocchi, 0 se non ci sono blocchi liberi.
+*/
+block_num_t get_and_set_free_extent(block_num_t goal, uint32_t want, uint32_t* got, filesystem_t* fs){
+
+    block_num_t start = goal;
+    uint32_t n = 0;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+
+    if(goal < fs->sb.data_start || goal >= fs->sb.blocks_count || is_block_used(goal,fs))
+        start = get_free_block(fs);
+
+    if(start == 0){
+        pthread_mutex_unlock(&fs->alloc_lock);
+        *got = 0;
+        return 0;
+    }
+
+    while(n < want && start + n < fs->sb.blocks_count && !is_block_used(start + n,fs)){
+        set_block_state(start + n,1,fs);
+        n++;
+    }
+
+    fs->alloc_cursor = (start + n < fs->sb.blocks_count) ? start + n : fs->sb.data_start;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    *got = n;
+
+    return start;
+
+}
+
+/*
+    Segna come liberati i blocchi della parola w indicati da mask, va chiamata con alloc_lock.
+*/
+void set_blocks_pending(uint32_t w, uint64_t mask, filesystem_t* fs){
+
+    mask &= fs->free_space_table[w] & ~fs->pending_free[w];
+    fs->pending_free[w] |= mask;
+    fs->pending_blocks += __builtin_popcountll(mask);
+
+}
+
+/*
+    Libera un blocco, che torna assegnabile al commit successivo.
+*/
+void release_block(block_num_t block_num, filesystem_t* fs){
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    set_blocks_pending(block_num / BITS_PER_WORD,1ULL << (block_num % BITS_PER_WORD),fs);
+    meta_block_forget(block_num,fs);    //Il blocco può essere riassegnato come blocco dati, la copia non va più riportata
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+}
+
+/*
+    Libera length blocchi contigui a partire da start, una parola della bitmap alla volta, vedi release_block.
+*/
+void release_extent(block_num_t start, uint32_t length, filesystem_t* fs){
+
+    block_num_t end = start + length;
+    block_num_t next;
+    uint64_t mask;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+
+    for(block_num_t block = start; block < end; block = next){
+
+        next = (block / BITS_PER_WORD + 1) * BITS_PER_WORD;
+        if(next > end)
+            next = end;
+
+        mask = (next - block == BITS_PER_WORD) ? ~0ULL : ((1ULL << (next - block)) - 1) << (block % BITS_PER_WORD);
+        set_blocks_pending(block / BITS_PER_WORD,mask,fs);
+    }
+
+    meta_block_forget_range(start,length,fs);
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+}
+
+/*
+    Restituisce alla bitmap i blocchi liberati dall'ultimo commit, così che la bitmap raccolta nella transazione
+    li riporti liberi. Va chiamata da sync_fs con alloc_lock, tenuto fino al commit: nessun blocco
+    restituito può essere riassegnato prima che la transazione che lo libera sia persistente.
+*/
+void release_pending_blocks(filesystem_t* fs){
+
+    uint64_t* word;
+
+    if(fs->pending_blocks == 0)
+        return;
+
+    for(uint32_t w = 0; w < fs->free_space_words; w++){
+
+        if(fs->pending_free[w] == 0)
+            continue;
+
+        word = &fs->free_space_table[w];
+        fs->free_blocks += __builtin_popcountll(*word & fs->pending_free[w]);
+        *word &= ~fs->pending_free[w];
+        fs->pending_free[w] = 0;
+        fs->free_space_dirty[(size_t)w * BITS_PER_WORD / (8 * fs->block_size)] = 1;
+    }
+
+    fs->pending_blocks = 0;
+
+}
+
+
+/* Journal dei metadati
+    Le funzioni che accedono alla transazione in corso prendono il lock del journal;
+    il commit (sync_fs) ferma prima tutte le operazioni prendendo i lock di tutti gli inode,
+    per questo i puntatori ritornati da meta_ptr restano validi per tutta l'operazione che li ha ottenuti.
+*/
+
+/*
+    Libera una lista di copie collegate da next.
+*/
+void free_meta_blocks(meta_block_t* copy){
+
+    meta_block_t* next;
+
+    for(; copy != NULL; copy = next){
+        next = copy->next;
+        free(copy);
+    }
+
+}
+
+/*
+    Le copie dei blocchi vengono allocate all'avvio, una per ogni blocco di una transazione che entra
+    nel journal, e riusate: un'operazione non resta senza memoria a metà di una transazione.
+*/
+journal_t* init_journal(const superblock_t* sb){
+
+    journal_t* new_journal = calloc(1,sizeof(journal_t));
+    uint32_t descriptor_entries = (sb->block_size - JOURNAL_HEADER_SIZE) / sizeof(block_num_t);
+    uint32_t revoke_entries = (sb->block_size - JOURNAL_COMMIT_HEADER_SIZE) / sizeof(block_num_t);
+
+    if(new_journal == NULL)
+        return NULL;
+
+    new_journal->capacity = sb->journal_blocks / 2 - 2;     //Ogni metà contiene anche descrittore e commit
+    if(new_journal->capacity > descriptor_entries)
+        new_journal->capacity = descriptor_entries;
+    if(new_journal->capacity > revoke_entries)             //Il commit deve poter revocare tutta la transazione precedente
+        new_journal->capacity = revoke_entries;
+
+    new_journal->committed = malloc(sizeof(block_num_t) * new_journal->capacity);
+    new_journal->revoked = malloc(sizeof(block_num_t) * new_journal->capacity);
+
+    for(uint32_t i = 0; i < new_journal->capacity && new_journal->committed != NULL && new_journal->revoked != NULL; i++){
+
+        meta_block_t* copy = malloc(sizeof(meta_block_t) + sb->block_size);
+
+        if(copy == NULL)
+            break;
+
+        copy->next = new_journal->spare;
+        new_journal->spare = copy;
+        new_journal->spare_count++;
+    }
+
+    if(new_journal->spare_count < new_journal->capacity){
+        free_meta_blocks(new_journal->spare);
+        free(new_journal->committed);
+        free(new_journal->revoked);
+        free(new_journal);
+        return NULL;
+    }
+
+    new_journal->sequence = 1;
+    pthread_mutex_init(&new_journal->lock,NULL);
+
+    return new_journal;
+
+}
+
+/*
+    Prende una copia libera, o ne alloca una se sono finite. Va chiamata con il lock del journal.
+    Ritorna NULL se non c'è memoria.
+*/
+meta_block_t* meta_block_alloc(filesystem_t* fs){
+
+    journal_t* journal = fs->journal;
+    meta_block_t* copy = journal->spare;
+
+    if(copy == NULL)
+        return malloc(sizeof(meta_block_t) + fs->block_size);
+
+    journal->spare = copy->next;
+    journal->spare_count--;
+
+    return copy;
+
+}
+
+/*
+    Restituisce una copia non più usata: ne vengono tenute libere quante ne servono ad una transazione
+    che entra nel journal, le altre liberate. Va chiamata con il lock del journal.
+*/
+void meta_block_release(meta_block_t* copy, journal_t* journal){
+
+    if(journal->spare_count >= journal->capacity){
+        free(copy);
+        return;
+    }
+
+    copy->next = journal->spare;
+    journal->spare = copy;
+    journal->spare_count++;
+
+}
+
+/*
+    Ritorna il puntatore al collegamento che punta alla copia del blocco nella transazione,
+    il collegamento punta a NULL se il blocco non è stato modificato. Va chiamata con il lock del journal.
+*/
+meta_block_t** meta_block_find(block_num_t block_num, journal_t* journal){
+
+    meta_block_t** link = &journal->buckets[block_num % JOURNAL_BUCKETS];
+
+    while(*link != NULL && (*link)->block != block_num)
+        link = &(*link)->hash_next;
+
+    return link;
+
+}
+
+/*
+    Equivalente di block_ptr per i blocchi di metadati. In lettura ritorna la copia del blocco
+    se è stato modificato nella transazione in corso, altrimenti il blocco nella mappatura;
+    in scrittura crea la copia, se non esiste, e la aggiunge alla transazione.
+    In scrittura ritorna NULL se non c'è memoria per la copia, cosa possibile solo quando la transazione
+    supera la capacità del journal: il commit successivo scriverà i blocchi direttamente.
+*/
+uint8_t* meta_ptr(block_num_t block_num, off_t offset, uint8_t write, filesystem_t* fs){
+
+    journal_t* journal = fs->journal;
+    meta_block_t** link;
+    meta_block_t* copy;
+
+    pthread_mutex_lock(&journal->lock);
+    link = meta_block_find(block_num,journal);
+    copy = *link;
+
+    if(copy == NULL && write && !journal->direct){
+
+        copy = meta_block_alloc(fs);
+
+        if(copy == NULL){
+            journal->overflow = 1;
+            pthread_mutex_unlock(&journal->lock);
+            return NULL;
+        }
+
+        copy->block = block_num;
+        memcpy(copy->data,block_ptr(block_num,0,fs),fs->block_size);
+
+        copy->hash_next = NULL;
+        *link = copy;
+        copy->next = journal->blocks;
+        journal->blocks = copy;
+        journal->count++;
+    }
+
+    pthread_mutex_unlock(&journal->lock);
+
+    if(copy == NULL)
+        return block_ptr(block_num,offset,fs);
+
+    return copy->data + offset;
+
+}
+
+/*
+    Aggiunge il blocco alla transazione in corso prima di modificarlo: un'operazione che cambia più blocchi
+    li aggiunge tutti prima di cambiarne uno, così da poter fallire senza lasciare modifiche a metà.
+    Ritorna 0, -ENOMEM se non c'è memoria per la copia.
+*/
+int8_t meta_reserve(block_num_t block_num, filesystem_t* fs){
+
+    return meta_ptr(block_num,0,1,fs) == NULL ? -ENOMEM : 0;
+}
+
+/*
+    Revoca i blocchi [start, start + length) dell'ultima transazione scritta nel journal, che sono stati liberati:
+    la transazione resta valida nella sua metà fino al commit successivo ed un replay dopo un'interruzione
+    riscriverebbe la vecchia copia sopra il blocco, nel frattempo forse riassegnato come blocco dati.
+    I blocchi revocati vengono elencati nel commit successivo ed il replay non li riporta dalla transazione precedente.
+    Va chiamata con il lock del journal.
+*/
+void journal_revoke(block_num_t start, uint32_t length, journal_t* journal){
+
+    uint32_t low = 0;
+    uint32_t high = journal->committed_count;
+    uint32_t end;
+    uint32_t mid;
+
+    while(low < high){     //Primo blocco di committed non minore di start
+        mid = (low + high) / 2;
+        if(journal->committed[mid] < start)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    for(end = low; end < journal->committed_count && journal->committed[end] - start < length; end++)
+        journal->revoked[journal->revoked_count++] = journal->committed[end];
+
+    memmove(journal->committed + low,journal->committed + end,(journal->committed_count - end) * sizeof(block_num_t));
+    journal->committed_count -= end - low;
+
+}
+
+/*
+    Rimuove dalla transazione la copia di un blocco che è stato liberato e lo revoca dalla transazione precedente.
+*/
+void meta_block_forget(block_num_t block_num, filesystem_t* fs){
+
+    journal_t* journal = fs->journal;
+    meta_block_t** link;
+    meta_block_t** list;
+    meta_block_t* copy;
+
+    pthread_mutex_lock(&journal->lock);
+    link = meta_block_find(block_num,journal);
+    copy = *link;
+
+    if(copy != NULL){
+
+        *link = copy->hash_next;
+
+        for(list = &journal->blocks; *list != copy; list = &(*list)->next)
+            ;
+
+        *list = copy->next;
+        journal->count--;
+        meta_block_release(copy,journal);
+    }
+
+    journal_revoke(block_num,1,journal);
+    pthread_mutex_unlock(&journal->lock);
+
+}
+
+/*
+    Rimuove dalla transazione le copie dei blocchi [start, start + length) che sono stati liberati,
+    scorrendo una sola volta i blocchi della transazione invece di cercarli uno ad uno, e li revoca
+    dalla transazione precedente.
+*/
+void meta_block_forget_range(block_num_t start, uint32_t length, filesystem_t* fs){
+
+    journal_t* journal = fs->journal;
+    meta_block_t** list;
+    meta_block_t* copy;
+
+    pthread_mutex_lock(&journal->lock);
+    list = &journal->blocks;
+
+    while(*list != NULL){
+
+        copy = *list;
+
+        if(copy->block < start || copy->block - start >= length){
+            list = &copy->next;
+            continue;
+        }
+
+        *meta_block_find(copy->block,journal) = copy->hash_next;
+        *list = copy->next;
+        journal->count--;
+        meta_block_release(copy,journal);
+    }
+
+    journal_revoke(start,length,journal);
+    pthread_mutex_unlock(&journal->lock);
+
+}
+
+/*
+    Checksum FNV-1a di len byte (multiplo di 4) calcolato una parola da 32 bit alla volta, a partire da seed.
+*/
+uint32_t journal_checksum(uint32_t seed, const uint8_t* data, size_t len){
+
+    uint32_t word;
+
+    for(size_t i = 0; i < len; i += sizeof(uint32_t)){
+        memcpy(&word,data + i,sizeof(uint32_t));
+        seed ^= word;
+        seed *= 16777619u;
+    }
+
+    return seed;
+
+}
+
+block_num_t journal_slot_start(uint64_t sequence, filesystem_t* fs){
+
+    return fs->sb.journal_start + (sequence % 2) * (fs->sb.journal_blocks / 2);
+
+}
+
+int compare_block_num(const void* a, const void* b){
+
+    block_num_t x = *(const block_num_t*)a;
+    block_num_t y = *(const block_num_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+    Scrive la transazione in corso nella metà del journal che le spetta: descrittore, copie dei blocchi e commit,
+    che elenca anche i blocchi revocati dalla transazione precedente. I blocchi della transazione diventano
+    quelli da revocare se liberati prima del prossimo commit.
+*/
+void journal_write_transaction(filesystem_t* fs){
+
+    journal_t* journal = fs->journal;
+    block_num_t start = journal_slot_start(journal->sequence,fs);
+    uint8_t* descriptor = block_ptr(start,0,fs);
+    uint8_t* commit;
+    uint32_t magic = JOURNAL_MAGIC;
+    uint32_t commit_magic = JOURNAL_COMMIT_MAGIC;
+    uint32_t checksum;
+    uint32_t i = 0;
+
+    memset(descriptor,0,fs->block_size);
+    memcpy(descriptor,&magic,sizeof(uint32_t));
+    memcpy(descriptor + sizeof(uint32_t),&journal->count,sizeof(uint32_t));
+    memcpy(descriptor + 2 * sizeof(uint32_t),&journal->sequence,sizeof(uint64_t));
+
+    for(meta_block_t* copy = journal->blocks; copy != NULL; copy = copy->next, i++){
+        memcpy(descriptor + JOURNAL_HEADER_SIZE + i * sizeof(block_num_t),&copy->block,sizeof(block_num_t));
+        memcpy(block_ptr(start + 1 + i,0,fs),copy->data,fs->block_size);
+        journal->committed[i] = copy->block;
+    }
+
+    checksum = journal_checksum(2166136261u,descriptor,(size_t)(journal->count + 1) * fs->block_size);
+
+    if(journal->revoked_count > 0)      //Senza revoche il checksum resta quello dei commit che non le prevedevano
+        checksum = journal_checksum(checksum,(uint8_t*)journal->revoked,journal->revoked_count * sizeof(block_num_t));
+
+    commit = block_ptr(start + 1 + journal->count,0,fs);
+    memset(commit,0,fs->block_size);
+    memcpy(commit,&commit_magic,sizeof(uint32_t));
+    memcpy(commit + sizeof(uint32_t),&checksum,sizeof(uint32_t));
+    memcpy(commit + 2 * sizeof(uint32_t),&journal->sequence,sizeof(uint64_t));
+    memcpy(commit + 2 * sizeof(uint32_t) + sizeof(uint64_t),&journal->revoked_count,sizeof(uint32_t));
+    memcpy(commit + JOURNAL_COMMIT_HEADER_SIZE,journal->revoked,journal->revoked_count * sizeof(block_num_t));
+
+    qsort(journal->committed,journal->count,sizeof(block_num_t),compare_block_num);
+    journal->committed_count = journal->count;
+    journal->revoked_count = 0;
+
+}
+
+/*
+    Riporta le copie dei blocchi nella loro posizione e svuota la transazione.
+*/
+void journal_checkpoint(filesystem_t* fs){
+
+    journal_t* journal = fs->journal;
+    meta_block_t* next;
+
+    for(meta_block_t* copy = journal->blocks; copy != NULL; copy = next){
+        next = copy->next;
+        memcpy(block_ptr(copy->block,0,fs),copy->data,fs->block_size);
+        meta_block_release(copy,journal);
+    }
+
+    memset(journal->buckets,0,sizeof(journal->buckets));
+    journal->blocks = NULL;
+    journal->count = 0;
+
+}
+
+/*
+    Dimentica le transazioni già scritte nel journal, dopo che questo è stato invalidato: non c'è più niente da revocare.
+*/
+void journal_forget_committed(journal_t* journal){
+
+    journal->committed_count = 0;
+    journal->revoked_count = 0;
+
+}
+
+/*
+    Ritorna il numero di blocchi della transazione scritta nella metà slot del journal se è completa
+    (descrittore e commit validi, checksum corretto), -1 altrimenti. In sequence viene scritto il suo numero di sequenza.
+*/
+int64_t journal_validate_slot(uint32_t slot, uint64_t* sequence, filesystem_t* fs){
+
+    block_num_t start = fs->sb.journal_start + slot * (fs->sb.journal_blocks / 2);
+    uint8_t* descriptor = block_ptr(start,0,fs);
+    uint8_t* commit;
+    uint32_t magic;
+    uint32_t count;
+    uint32_t checksum;
+    uint32_t expected;
+    uint32_t revoked;
+    uint64_t commit_sequence;
+
+    memcpy(&magic,descriptor,sizeof(uint32_t));
+    memcpy(&count,descriptor + sizeof(uint32_t),sizeof(uint32_t));
+    memcpy(sequence,descriptor + 2 * sizeof(uint32_t),sizeof(uint64_t));
+
+    if(magic != JOURNAL_MAGIC || count > fs->journal->capacity)
+        return -1;
+
+    commit = block_ptr(start + 1 + count,0,fs);
+    memcpy(&magic,commit,sizeof(uint32_t));
+    memcpy(&checksum,commit + sizeof(uint32_t),sizeof(uint32_t));
+    memcpy(&commit_sequence,commit + 2 * sizeof(uint32_t),sizeof(uint64_t));
+    memcpy(&revoked,commit + 2 * sizeof(uint32_t) + sizeof(uint64_t),sizeof(uint32_t));
+
+    if(magic != JOURNAL_COMMIT_MAGIC || commit_sequence != *sequence || revoked > fs->journal->capacity)
+        return -1;
+
+    expected = journal_checksum(2166136261u,descriptor,(size_t)(count + 1) * fs->block_size);
+
+    if(revoked > 0)
+        expected = journal_checksum(expected,commit + JOURNAL_COMMIT_HEADER_SIZE,revoked * sizeof(block_num_t));
+
+    if(checksum != expected)
+        return -1;
+
+    return count;
+
+}
+
+/*
+    Rende invalide entrambe le metà del journal.
+*/
+void journal_invalidate(filesystem_t* fs){
+
+    memset(block_ptr(fs->sb.journal_start,0,fs),0,fs->block_size);
+    memset(block_ptr(fs->sb.journal_start + fs->sb.journal_blocks / 2,0,fs),0,fs->block_size);
+
+}
+
+/*
+    Ritorna 1 se block è tra i blocchi revocati dal commit della transazione nella metà slot, già validata.
+*/
+uint8_t journal_slot_revokes(uint32_t slot, uint32_t count, block_num_t block, filesystem_t* fs){
+
+    uint8_t* commit = block_ptr(fs->sb.journal_start + slot * (fs->sb.journal_blocks / 2) + 1 + count,0,fs);
+    uint32_t revoked;
+    block_num_t entry;
+
+    memcpy(&revoked,commit + 2 * sizeof(uint32_t) + sizeof(uint64_t),sizeof(uint32_t));
+
+    for(uint32_t i = 0; i < revoked; i++){
+        memcpy(&entry,commit + JOURNAL_COMMIT_HEADER_SIZE + i * sizeof(block_num_t),sizeof(block_num_t));
+        if(entry == block)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+    Riapplica le transazioni complete presenti nel journal, dalla più vecchia alla più recente,
+    così che il dispositivo torni allo stato dell'ultimo commit anche dopo un'interruzione durante il checkpoint.
+    Dalla transazione più vecchia non vengono riportati i blocchi revocati dalla più recente (vedi journal_revoke).
+    Riportate e rese persistenti le transazioni il journal viene invalidato: una volta liberati, i loro blocchi
+    non sono nell'elenco di quelli da revocare e non devono essere riportati di nuovo.
+    Ritorna il numero di transazioni riapplicate.
+*/
+uint32_t replay_journal(filesystem_t* fs){
+
+    int64_t counts[2];
+    uint64_t sequences[2];
+    uint32_t order[2] = {0,1};
+    uint32_t replayed = 0;
+    block_num_t start;
+    block_num_t home;
+    uint8_t both;
+
+    for(uint32_t slot = 0; slot < 2; slot++)
+        counts[slot] = journal_validate_slot(slot,&sequences[slot],fs);
+
+    both = counts[0] != -1 && counts[1] != -1;
+
+    if(both && sequences[1] < sequences[0]){
+        order[0] = 1;
+        order[1] = 0;
+    }
+
+    for(uint32_t i = 0; i < 2; i++){
+
+        uint32_t slot = order[i];
+
+        if(counts[slot] == -1)
+            continue;
+
+        start = fs->sb.journal_start + slot * (fs->sb.journal_blocks / 2);
+
+        for(uint32_t b = 0; b < counts[slot]; b++){
+            memcpy(&home,block_ptr(start,JOURNAL_HEADER_SIZE + b * sizeof(block_num_t),fs),sizeof(block_num_t));
+
+            if(home >= fs->sb.blocks_count || home == SUPERBLOCK_BLOCK)
+                continue;
+
+            if(i == 0 && both && journal_slot_revokes(order[1],counts[order[1]],home,fs))
+                continue;
+
+            memcpy(block_ptr(home,0,fs),block_ptr(start + 1 + b,0,fs),fs->block_size);
+        }
+
+        if(sequences[slot] >= fs->journal->sequence)
+            fs->journal->sequence = sequences[slot] + 1;
+
+        replayed++;
+    }
+
+    if(replayed > 0){
+        flush_range(0,fs->image_size,MS_SYNC,fs);
+        journal_invalidate(fs);
+        flush_range((off_t)fs->sb.journal_start * fs->block_size,(size_t)fs->sb.journal_blocks * fs->block_size,MS_SYNC,fs);
+    }
+
+    return replayed;
+
+}
+
+void free_journal(journal_t* journal){
+
+    free_meta_blocks(journal->blocks);
+    free_meta_blocks(journal->spare);
+    pthread_mutex_destroy(&journal->lock);
+    free(journal->committed);
+    free(journal->revoked);
+    free(journal);
+
+}
+
+
+/*
+    Utils
+*/
+
+
+/*
+    Ritorna il puntatore al byte offset del blocco dato all'interno della mappatura.
+*/
+uint8_t* block_ptr(block_num_t block_num,off_t offset ,filesystem_t* fs){
+    return fs->image + (size_t)block_num * fs->block_size + offset;
+}
+
+
+/*
+    Gestione indice delle directory
+*/
+
+uint32_t dir_bucket_count(const dir_header_t* header){
+
+    return (DIR_INITIAL_BUCKETS << header->level) + header->split;
+}
+
+/*
+    Ritorna il bucket in cui si trova (o va inserito) un nome dato il suo hash.
+*/
+uint32_t dir_bucket_of(uint32_t hash, const dir_header_t* header){
+
+    uint32_t bucket = hash % (DIR_INITIAL_BUCKETS << header->level);
+
+    if(bucket < header->split)
+        bucket = hash % (DIR_INITIAL_BUCKETS << (header->level + 1));
+
+    return bucket;
+}
+
+uint16_t bucket_used(block_num_t block, filesystem_t* fs){
+
+    uint16_t used;
+    memcpy(&used,meta_ptr(block,BUCKET_USED_OFFSET,0,fs),sizeof(uint16_t));
+    return used;
+}
+
+block_num_t bucket_overflow(block_num_t block, filesystem_t* fs){
+
+    block_num_t overflow;
+    memcpy(&overflow,meta_ptr(block,BUCKET_OVERFLOW_OFFSET,0,fs),sizeof(block_num_t));
+    return overflow;
+}
+
+void set_bucket_header(block_num_t block, uint16_t used, block_num_t overflow, filesystem_t* fs){
+
+    memcpy(meta_ptr(block,BUCKET_USED_OFFSET,1,fs),&used,sizeof(uint16_t));
+    memcpy(meta_ptr(block,BUCKET_OVERFLOW_OFFSET,1,fs),&overflow,sizeof(block_num_t));
+}
+
+void read_dir_header(inode_t* dir_inode, dir_header_t* header, filesystem_t* fs){
+
+    memcpy(header,meta_ptr(map_file_block(dir_inode,DIR_HEADER_BLOCK,NULL),0,0,fs),sizeof(dir_header_t));
+}
+
+void write_dir_header(inode_t* dir_inode, const dir_header_t* header, filesystem_t* fs){
+
+    memcpy(meta_ptr(map_file_block(dir_inode,DIR_HEADER_BLOCK,NULL),0,1,fs),header,sizeof(dir_header_t));
+}
+
+/*
+    Crea l'indice di una directory appena creata: il blocco con l'intestazione ed il primo bucket vuoto.
+    Ritorna 0, -ENOSPC se mancano blocchi liberi, -ENOMEM se non c'è memoria per la transazione;
+    i blocchi già assegnati restano all'inode.
+*/
+int8_t init_dir_index(inode_num_t dir_inode_num, filesystem_t* fs){
+
+    dir_header_t header = {0};
+    inode_t* dir_inode = get_inode(dir_inode_num,fs);
+    block_num_t header_block;
+    block_num_t bucket;
+
+    header_block = file_block(dir_inode,dir_inode_num,DIR_HEADER_BLOCK,1,fs);
+    bucket = header_block == 0 ? 0 : file_block(dir_inode,dir_inode_num,1,1,fs);
+
+    if(bucket == 0)
+        return -ENOSPC;
+
+    if(meta_reserve(header_block,fs) != 0 || meta_reserve(bucket,fs) != 0)
+        return -ENOMEM;
+
+    write_dir_header(dir_inode,&header,fs);
+    set_bucket_header(bucket,0,0,fs);
+
+    return 0;
+}
+
+/*
+    Accoda una entry già serializzata alla catena di blocchi del bucket che inizia in block,
+    usando il primo blocco con spazio sufficiente ed aggiungendo un blocco di overflow se nessuno ne ha.
+    Ritorna 1 se è stato necessario un blocco di overflow, 0 altrimenti, -1 se non ci sono blocchi liberi
+    o memoria per la transazione. Il blocco block deve essere già nella transazione, vedi meta_reserve.
+*/
+int8_t bucket_append(block_num_t block, const uint8_t* entry, uint16_t entry_size, filesystem_t* fs){
+
+    uint16_t used = bucket_used(block,fs);
+    block_num_t overflow = bucket_overflow(block,fs);
+    int8_t grown = 0;
+
+    while(used + entry_size > BUCKET_CAPACITY(fs)){
+
+        if(overflow == 0){
+
+            overflow = get_and_set_free_block(fs);
+
+            if(overflow == 0)
+                return -1;
+
+            if(meta_reserve(overflow,fs) != 0){
+                release_block(overflow,fs);
+                return -1;
+            }
+
+            set_bucket_header(overflow,0,0,fs);
+            set_bucket_header(block,used,overflow,fs);
+            grown = 1;
+        }
+
+        block = overflow;
+        used = bucket_used(block,fs);
+        overflow = bucket_overflow(block,fs);
+    }
+
+    memcpy(meta_ptr(block,BUCKET_HEADER_SIZE + used,1,fs),entry,entry_size);
+    set_bucket_header(block,used + entry_size,overflow,fs);
+
+    return grown;
+}
+
+/*
+    Serializza una entry (inode, hash, lunghezza del nome, nome) in buf, ritorna la dimensione della entry.
+*/
+uint16_t pack_dir_entry(uint8_t* buf, inode_num_t inode_num, uint32_t hash, const char* name, file_name_lenght_t name_lenght){
+
+    memcpy(buf,&inode_num,sizeof(inode_num_t));
+    memcpy(buf + sizeof(inode_num_t),&hash,sizeof(uint32_t));
+    memcpy(buf + sizeof(inode_num_t) + sizeof(uint32_t),&name_lenght,sizeof(file_name_lenght_t));
+    memcpy(buf + DIR_ENTRY_HEADER_SIZE,name,name_lenght);
+
+    return DIR_ENTRY_HEADER_SIZE + name_lenght;
+}
+
+/*
+    Divide il bucket indicato da split: le sue entry vengono ridistribuite tra il bucket stesso
+    ed un nuovo bucket accodato alla directory, i blocchi di overflow vengono liberati.
+    Se non è possibile assegnare i blocchi, o non c'è memoria, la divisione non avviene e la catena resta invariata.
+*/
+void split_dir_bucket(inode_num_t dir_inode_num, dir_header_t* header, filesystem_t* fs){
+
+    inode_t* dir_inode = get_inode(dir_inode_num,fs);
+    uint32_t old_bucket = header->split;
+    uint32_t new_bucket = dir_bucket_count(header);
+    uint32_t modulo = DIR_INITIAL_BUCKETS << (header->level + 1);
+    uint32_t blocks = inode_blocks(dir_inode);
+    block_num_t old_block = file_block(dir_inode,dir_inode_num,old_bucket + 1,0,fs);
+    block_num_t new_block;
+    block_num_t block;
+    block_num_t next;
+    uint8_t* entries;
+    size_t entries_size = 0;
+    uint32_t hash;
+    file_name_lenght_t name_lenght;
+
+    /*
+        Alla prima divisione di un livello vengono assegnati insieme i blocchi di tutti i bucket del livello:
+        aggiunti uno alla volta finirebbero tra i blocchi dei file creati nel frattempo e la directory
+        esaurirebbe presto gli extent disponibili nell'inode.
+    */
+    if(header->split == 0 && grow_inode(dir_inode_num,modulo + 1,fs) == -1){
+        shrink_inode(dir_inode_num,blocks,fs);      //Toglie i blocchi assegnati prima dell'errore
+        return;
+    }
+
+    new_block = file_block(dir_inode,dir_inode_num,new_bucket + 1,1,fs);
+
+    if(new_block == 0)  //La directory non può avere altri blocchi, le catene continueranno a crescere
+        return;
+
+    /* I blocchi della catena ed il nuovo bucket entrano nella transazione prima di essere modificati */
+    for(block = old_block; block != 0 && meta_reserve(block,fs) == 0; block = bucket_overflow(block,fs))
+        entries_size += bucket_used(block,fs);
+
+    if(block != 0 || meta_reserve(new_block,fs) != 0){
+        shrink_inode(dir_inode_num,blocks,fs);
+        return;
+    }
+
+    entries = malloc(entries_size);
+
+    if(entries == NULL && entries_size > 0){
+        shrink_inode(dir_inode_num,blocks,fs);
+        return;
+    }
+
+    set_bucket_header(new_block,0,0,fs);
+    entries_size = 0;
+
+    for(block = old_block; block != 0; block = next){
+
+        next = bucket_overflow(block,fs);
+        memcpy(entries + entries_size,meta_ptr(block,BUCKET_HEADER_SIZE,0,fs),bucket_used(block,fs));
+        entries_size += bucket_used(block,fs);
+
+        if(block != old_block)
+            release_block(block,fs);
+    }
+
+    set_bucket_header(old_block,0,0,fs);
+
+    for(size_t off = 0; off < entries_size; off += DIR_ENTRY_HEADER_SIZE + name_lenght){
+
+        memcpy(&hash,entries + off + sizeof(inode_num_t),sizeof(uint32_t));
+        memcpy(&name_lenght,entries + off + sizeof(inode_num_t) + sizeof(uint32_t),sizeof(file_name_lenght_t));
+
+        block = (hash % modulo == old_bucket) ? old_block : new_block;
+        bucket_append(block,entries + off,DIR_ENTRY_HEADER_SIZE + name_lenght,fs);
+    }
+
+    free(entries);
+
+    header->split++;
+
+    if(header->split == (DIR_INITIAL_BUCKETS << header->level)){
+        header->level++;
+        header->split = 0;
+    }
+
+}
+
+/*
+    Cerca tra le entry del blocco di un bucket quella con il nome dato (ed il suo hash).
+    Ritorna il puntatore alla entry, NULL se il nome non è nel blocco.
+*/
+uint8_t* bucket_find_entry(block_num_t block, uint32_t hash, const char* name, file_name_lenght_t name_lenght, filesystem_t* fs){
+
+    uint8_t* entry = meta_ptr(block,BUCKET_HEADER_SIZE,0,fs);
+    uint8_t* entries_end = entry + bucket_used(block,fs);
+    file_name_lenght_t entry_name_lenght;
+    uint32_t entry_hash;
+
+    while(entry < entries_end){
+
+        memcpy(&entry_hash,entry + sizeof(inode_num_t),sizeof(uint32_t));
+        memcpy(&entry_name_lenght,entry + sizeof(inode_num_t) + sizeof(uint32_t),sizeof(file_name_lenght_t));
+
+        if(entry_hash == hash && entry_name_lenght == name_lenght && memcmp(entry + DIR_ENTRY_HEADER_SIZE,name,name_lenght) == 0)
+            return entry;
+
+        entry += DIR_ENTRY_HEADER_SIZE + entry_name_lenght;
+    }
+
+    return NULL;
+}
+
+/*
+    Cerca un nome (name_lenght byte, non terminato) nella catena del bucket che lo può contenere. Ritorna il puntatore alla entry ed in block
+    il blocco che la contiene, in prev il blocco che lo precede nella catena (0 se è il primo);
+    ritorna NULL se il nome non è presente.
+*/
+uint8_t* dir_find_entry(inode_t* dir_inode, const dir_header_t* header, const char* name, file_name_lenght_t name_lenght, block_num_t* block, block_num_t* prev, filesystem_t* fs){
+
+    uint32_t hash = name_hash(0,name,name_lenght);
+    uint8_t* entry;
+
+    *prev = 0;
+
+    for(*block = map_file_block(dir_inode,dir_bucket_of(hash,header) + 1,NULL); *block != 0; *block = bucket_overflow(*block,fs)){
+
+        entry = bucket_find_entry(*block,hash,name,name_lenght,fs);
+
+        if(entry != NULL)
+            return entry;
+
+        *prev = *block;
+    }
+
+    return NULL;
+}
+
+/*
+    Cerca un nome, di name_lenght byte, all'interno di una directory leggendo solo il bucket che lo può contenere.
+    Ritorna il numero di inode dell'elemento, 0 se non è presente.
+*/
+inode_num_t dir_lookup(inode_num_t dir_inode_num, const char* name, file_name_lenght_t name_lenght, filesystem_t* fs){
+
+    inode_t* dir_inode = get_inode(dir_inode_num,fs);
+    dir_header_t header;
+    inode_num_t entry_inode;
+    block_num_t block;
+    block_num_t prev;
+    uint8_t* entry;
+
+    if(dir_inode->extent_count == 0)
+        return 0;
+
+    read_dir_header(dir_inode,&header,fs);
+    entry = dir_find_entry(dir_inode,&header,name,name_lenght,&block,&prev,fs);
+
+    if(entry == NULL)
+        return 0;
+
+    memcpy(&entry_inode,entry,sizeof(inode_num_t));
+    return entry_inode;
+}
+
+/*
+    Inserisce nell'indice della directory le informazioni necessarie ad indicare che un file 
+    si trova all'interno della directory: numero di inode, hash e lunghezza del nome e nome del file.
+    La catena del bucket viene letta una sola volta, controllando che il nome non sia già presente
+    e cercando il primo blocco con spazio sufficiente; la entry, già serializzata, viene copiata
+    in quel blocco con un'unica memcpy e cambia solo il blocco che la riceve (più l'intestazione
+    della directory ed il blocco di overflow, se è stato necessario aggiungerlo).
+    Ritorna 0 se l'inserimento è andato a buon fine, -EEXIST se il nome è già presente,
+    -ENAMETOOLONG se il nome è troppo lungo, -ENOSPC se non c'è spazio, -EIO se la directory non ha indice,
+    -ENOMEM se non c'è memoria per la transazione (la directory resta invariata).
+*/
+int8_t insert_file_info(const char* name, inode_num_t inode_num, inode_num_t dir_inode_num, filesystem_t* fs){
+
+    inode_t* dir_inode = get_inode(dir_inode_num,fs);
+    dir_header_t header;
+    uint8_t entry[DIR_ENTRY_HEADER_SIZE + MAX_FILE_NAME];
+    file_name_lenght_t file_name_lenght = strlen(name);
+    uint32_t hash = name_hash(0,name,file_name_lenght);
+    uint16_t entry_size;
+    block_num_t block;
+    block_num_t last = 0;
+    block_num_t target = 0;
+    uint16_t used;
+    uint8_t grown = 0;
+
+    if(file_name_lenght > DIR_MAX_NAME(fs))
+        return -ENAMETOOLONG;
+
+    if(dir_inode->extent_count == 0)
+        return -EIO;
+
+    read_dir_header(dir_inode,&header,fs);
+    entry_size = pack_dir_entry(entry,inode_num,hash,name,file_name_lenght);
+
+    for(block = map_file_block(dir_inode,dir_bucket_of(hash,&header) + 1,NULL); block != 0; block = bucket_overflow(block,fs)){
+
+        if(bucket_find_entry(block,hash,name,file_name_lenght,fs) != NULL)
+            return -EEXIST;
+
+        if(target == 0 && bucket_used(block,fs) + entry_size <= BUCKET_CAPACITY(fs))
+            target = block;
+
+        last = block;
+    }
+
+    if(target == 0){    //Nessun blocco della catena ha spazio, viene aggiunto un blocco di overflow
+
+        target = get_and_set_free_block(fs);
+
+        if(target == 0)
+            return -ENOSPC;
+
+        grown = 1;
+    }
+
+    if(meta_reserve(target,fs) != 0 || meta_reserve(last,fs) != 0 || meta_reserve(map_file_block(dir_inode,DIR_HEADER_BLOCK,NULL),fs) != 0){
+
+        if(grown)
+            release_block(target,fs);
+
+        return -ENOMEM;
+    }
+
+    if(grown){
+        set_bucket_header(target,0,0,fs);
+        set_bucket_header(last,bucket_used(last,fs),target,fs);
+    }
+
+    used = bucket_used(target,fs);
+    memcpy(meta_ptr(target,BUCKET_HEADER_SIZE + used,1,fs),entry,entry_size);
+    set_bucket_header(target,used + entry_size,bucket_overflow(target,fs),fs);
+
+    header.entry_count++;
+    header.entry_bytes += entry_size;
+
+    if(grown || header.entry_bytes > (uint64_t)dir_bucket_count(&header) * BUCKET_CAPACITY(fs) * DIR_SPLIT_PERCENT / 100)
+        split_dir_bucket(dir_inode_num,&header,fs);
+
+    write_dir_header(get_inode(dir_inode_num,fs),&header,fs);
+
+    return 0;
+}
+
+int8_t write_file_info(file_t file,inode_num_t dir_inode_num ,filesystem_t* fs){
+
+    return insert_file_info(file.name,file.inode_num,dir_inode_num,fs);
+}
+
+/*
+    Rimuove un nome dall'indice della directory: le entry successive del blocco vengono spostate indietro
+    ed un blocco di overflow rimasto vuoto viene tolto dalla catena e liberato, così che le catene
+    non restino lunghe dopo molte rimozioni. I bucket non vengono mai riuniti.
+    Le entry del bucket che seguono quella rimossa cambiano posizione: una lettura della directory
+    ripresa da un cookie può saltarne una.
+    Ritorna 0, -ENOENT se il nome non è presente, -ENOMEM se non c'è memoria per la transazione
+    (la directory resta invariata).
+*/
+int8_t remove_file_info(const char* name, inode_num_t dir_inode_num, filesystem_t* fs){
+
+    inode_t* dir_inode = get_inode(dir_inode_num,fs);
+    dir_header_t header;
+    file_name_lenght_t name_lenght;
+    block_num_t block;
+    block_num_t prev;
+    uint8_t* entry;
+    uint8_t* entries;
+    uint16_t entry_size;
+    uint16_t used;
+    size_t offset;
+
+    if(dir_inode->extent_count == 0)
+        return -ENOENT;
+
+    read_dir_header(dir_inode,&header,fs);
+    entry = dir_find_entry(dir_inode,&header,name,strlen(name),&block,&prev,fs);
+
+    if(entry == NULL)
+        return -ENOENT;
+
+    memcpy(&name_lenght,entry + sizeof(inode_num_t) + sizeof(uint32_t),sizeof(file_name_lenght_t));
+    entry_size = DIR_ENTRY_HEADER_SIZE + name_lenght;
+    offset = entry - meta_ptr(block,BUCKET_HEADER_SIZE,0,fs);
+    used = bucket_used(block,fs);
+
+    if(meta_reserve(block,fs) != 0 || meta_reserve(map_file_block(dir_inode,DIR_HEADER_BLOCK,NULL),fs) != 0
+        || (used == entry_size && prev != 0 && meta_reserve(prev,fs) != 0))
+        return -ENOMEM;
+
+    entries = meta_ptr(block,BUCKET_HEADER_SIZE,1,fs);
+    memmove(entries + offset,entries + offset + entry_size,used - offset - entry_size);
+    set_bucket_header(block,used - entry_size,bucket_overflow(block,fs),fs);
+
+    if(used == entry_size && prev != 0){
+        set_bucket_header(prev,bucket_used(prev,fs),bucket_overflow(block,fs),fs);
+        release_block(block,fs);
+    }
+
+    header.entry_count--;
+    header.entry_bytes = (header.entry_bytes > entry_size) ? header.entry_bytes - entry_size : 0;   //Le directory create prima di entry_bytes partono da 0
+    write_dir_header(dir_inode,&header,fs);
+
+    return 0;
+}
+
+/*
+    Fa puntare ad un altro inode un nome già presente nella directory.
+    Ritorna 0, -ENOENT se il nome non è presente, -ENOMEM se non c'è memoria per la transazione.
+*/
+int8_t replace_file_info(const char* name, inode_num_t inode_num, inode_num_t dir_inode_num, filesystem_t* fs){
+
+    inode_t* dir_inode = get_inode(dir_inode_num,fs);
+    dir_header_t header;
+    block_num_t block;
+    block_num_t prev;
+    uint8_t* entry;
+    size_t offset;
+
+    if(dir_inode->extent_count == 0)
+        return -ENOENT;
+
+    read_dir_header(dir_inode,&header,fs);
+    entry = dir_find_entry(dir_inode,&header,name,strlen(name),&block,&prev,fs);
+
+    if(entry == NULL)
+        return -ENOENT;
+
+    offset = entry - meta_ptr(block,0,0,fs);
+    entry = meta_ptr(block,offset,1,fs);
+
+    if(entry == NULL)
+        return -ENOMEM;
+
+    memcpy(entry,&inode_num,sizeof(inode_num_t));
+
+    return 0;
+}
+
+/*
+    Ritorna 1 se la directory non contiene elementi, il chiamante deve tenerne il lock.
+*/
+uint8_t dir_is_empty(inode_num_t dir_inode_num, filesystem_t* fs){
+
+    inode_t* dir_inode = get_inode(dir_inode_num,fs);
+    dir_header_t header;
+
+    if(dir_inode->extent_count == 0)
+        return 1;
+
+    read_dir_header(dir_inode,&header,fs);
+    return header.entry_count == 0;
+}
+
+
+/*
+Assegna un inode libero ad un blocco, questo blocco conterrà gli extent di tutti i blocchi facenti parti del file
+rappresentato dall'inode. La scelta del numero di inode e l'assegnazione avvengono con alloc_lock,
+così che due creazioni concorrenti non ottengano lo stesso inode.
+Ritorna il numero di inode in inode, -1 se non ci sono inode liberi.
+*/
+int8_t assign_inode_to_block(inode_num_t* inode, block_num_t block ,filesystem_t* fs){
+    
+    pthread_mutex_lock(&fs->alloc_lock);
+
+    if(get_free_inode_number(inode,fs) == -1){
+        pthread_mutex_unlock(&fs->alloc_lock);
+        return -1;
+    }
+
+    set_inode_table_entry(*inode,block,fs);
+    fs->inode_cursor = (*inode + 1 < fs->sb.inodes_count) ? *inode + 1 : 0;
+    set_block_state(block,1,fs);
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    return 0;
+
+}
+
+/*
+    Rende nuovamente liberi un inode ed il suo blocco.
+*/
+void release_inode(inode_num_t inode, filesystem_t* fs){
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    block_num_t block = fs->inode_table[inode];
+    set_inode_table_entry(inode,0,fs);
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    release_block(block,fs);
+
+}
+
+/*
+    Numero di blocchi logici del file, somma delle lunghezze degli extent.
+*/
+uint32_t inode_blocks(const inode_t* inode){
+
+    uint32_t blocks = 0;
+
+    for(uint32_t i = 0; i < inode->extent_count; i++)
+        blocks += inode->extents[i].length;
+
+    return blocks;
+}
+
+/*
+    Come map_file_block, ma la ricerca dell'extent parte dalla posizione cursor, se è valida e precede index,
+    e cursor viene spostato sull'extent trovato. inode deve essere la copia in cache.
+*/
+block_num_t map_file_block_from(const inode_t* inode, uint32_t index, uint32_t* run, map_cursor_t* cursor){
+
+    uint32_t generation = (cursor != NULL) ? inode_cache_entry_of((inode_t*)inode)->map_generation : 0;
+    uint32_t i = 0;
+    uint32_t first = 0;
+
+    if(cursor != NULL && cursor->generation == generation && cursor->extent < inode->extent_count && cursor->first <= index){
+        i = cursor->extent;
+        first = cursor->first;
+    }
+
+    for(; i < inode->extent_count; i++){
+
+        if(index - first < inode->extents[i].length){
+
+            if(run != NULL)
+                *run = inode->extents[i].length - (index - first);
+
+            if(cursor != NULL){
+                cursor->extent = i;
+                cursor->first = first;
+                cursor->generation = generation;
+            }
+
+            return inode->extents[i].start + (index - first);
+        }
+
+        first += inode->extents[i].length;
+    }
+
+    if(run != NULL)
+        *run = 0;
+
+    return 0;
+}
+
+/*
+    Ritorna il blocco fisico corrispondente al blocco logico index del file, 0 se non è assegnato.
+    Se run non è NULL vi scrive il numero di blocchi fisicamente contigui a partire da quello ritornato,
+    in questo modo una lettura o scrittura sequenziale può coprire l'intero extent con una sola copia.
+*/
+block_num_t map_file_block(const inode_t* inode, uint32_t index, uint32_t* run){
+
+    return map_file_block_from(inode,index,run,NULL);
+}
+
+/*
+    Assegna all'inode i blocchi necessari ad arrivare a blocks blocchi logici.
+    I nuovi blocchi vengono cercati subito dopo la fine dell'ultimo extent, se sono liberi l'extent
+    viene esteso, altrimenti ne viene aggiunto uno nuovo con il maggior numero possibile di blocchi contigui.
+    Ritorna 0 se tutti i blocchi sono stati assegnati, -1 altrimenti (i blocchi già assegnati restano al file).
+    Se i dati del file si trovano nell'inode vengono copiati nel primo blocco assegnato.
+*/
+int8_t grow_inode(inode_num_t inode_num, uint32_t blocks, filesystem_t* fs){
+
+    inode_t* node = get_inode(inode_num,fs);
+    uint32_t current = inode_blocks(node);
+    extent_t* last;
+    block_num_t goal;
+    block_num_t start;
+    uint32_t got;
+    uint8_t inline_data[MAX_BLOCK_SIZE];
+    size_t inline_size = 0;
+
+    if(current < blocks && inode_is_inline(node,fs)){     //Gli extent prenderanno il posto dei dati
+        inline_size = node->size;
+        memcpy(inline_data,node->inline_data,inline_size);
+    }
+
+    while(current < blocks){
+
+        last = (node->extent_count > 0) ? &node->extents[node->extent_count - 1] : NULL;
+        goal = (last != NULL) ? last->start + last->length : 0;
+
+        start = get_and_set_free_extent(goal,blocks - current,&got,fs);
+
+        if(start == 0)
+            return -1;
+
+        if(last != NULL && start == goal)
+            last->length += got;
+        else if(node->extent_count < MAX_EXTENTS_PER_NODE(fs)){
+            node->extents[node->extent_count].start = start;
+            node->extents[node->extent_count].length = got;
+            node->extent_count++;
+        }
+        else{       //Il blocco dell'inode è pieno
+            for(uint32_t i = 0; i < got; i++)
+                release_block(start + i,fs);
+            return -1;
+        }
+
+        memset(block_ptr(start,0,fs),0,(size_t)got * fs->block_size);    //I blocchi potrebbero contenere dati di un file eliminato
+
+        if(current == 0 && inline_size > 0)
+            memcpy(block_ptr(start,0,fs),inline_data,inline_size);
+
+        current += got;
+        mark_inode_dirty(inode_num,fs);
+    }
+
+    return 0;
+}
+
+/*
+Assegna un blocco libero ad un inode in coda ai suoi blocchi, imposta il blocco assegnato come occupato.
+*/
+block_num_t assign_block_to_inode(inode_num_t inode,filesystem_t* fs){
+    
+    inode_t* node = get_inode(inode,fs);
+    uint32_t blocks = inode_blocks(node);
+
+    if(grow_inode(inode,blocks + 1,fs) == -1)
+        return 0;
+
+    return map_file_block(node,blocks,NULL);
+}
+
+/*
+    Libera length blocchi del file a partire da start. Se il file è aperto e map_open_file_range ne ha
+    restituito dei blocchi, i blocchi vengono trattenuti fino alla chiusura dell'ultimo file aperto sull'inode
+    (unpin_inode): FUSE li legge dal dispositivo dopo il ritorno di read_buf, ma non rilascia il file
+    prima di aver risposto alle sue letture. Fino ad allora un'interruzione li lascia occupati ma senza
+    proprietario, come li trova fsck. Se non c'è memoria per trattenerli vengono liberati subito.
+*/
+void release_file_extent(inode_cache_entry_t* entry, block_num_t start, uint32_t length, filesystem_t* fs){
+
+    inode_cache_t* cache = fs->inode_cache;
+    extent_t* held = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+
+    if(__atomic_load_n(&entry->mapped,__ATOMIC_RELAXED) && entry->pins > 0){
+
+        held = realloc(entry->held,sizeof(extent_t) * (entry->held_count + 1));
+
+        if(held != NULL){
+            held[entry->held_count].start = start;
+            held[entry->held_count].length = length;
+            entry->held = held;
+            entry->held_count++;
+        }
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    if(held == NULL)
+        release_extent(start,length,fs);
+
+}
+
+/*
+    Libera i blocchi logici del file da keep in poi, accorciando o togliendo gli ultimi extent.
+    Il chiamante deve tenere il lock dell'inode in scrittura.
+*/
+void shrink_inode(inode_num_t inode_num, uint32_t keep, filesystem_t* fs){
+
+    inode_t* node = get_inode(inode_num,fs);
+    uint32_t blocks = inode_blocks(node);
+    extent_t* last;
+    uint32_t drop;
+
+    if(blocks <= keep)
+        return;
+
+    while(blocks > keep){
+
+        last = &node->extents[node->extent_count - 1];
+        drop = (blocks - keep < last->length) ? blocks - keep : last->length;
+
+        release_file_extent(inode_cache_entry_of(node),last->start + last->length - drop,drop,fs);
+        last->length -= drop;
+        blocks -= drop;
+
+        if(last->length == 0)
+            node->extent_count--;
+    }
+
+    inode_cache_entry_of(node)->map_generation++;
+    mark_inode_dirty(inode_num,fs);
+}
+
+/*
+    Libera un file, o una directory vuota, con tutti i suoi blocchi. Una directory vuota non ha blocchi
+    di overflow, perché remove_file_info li libera quando si svuotano. L'inode viene tolto dalla cache
+    senza essere scritto. Il chiamante deve tenerne il lock in scrittura.
+*/
+void free_inode(inode_num_t inode_num, filesystem_t* fs){
+
+    shrink_inode(inode_num,0,fs);
+    inode_cache_drop(inode_num,fs);
+    release_inode(inode_num,fs);
+}
+
+
+/*----------------------------------------*/
+
+/*Gestione Filesystem*/
+
+/*
+    Riporta nella transazione in corso le tabelle e gli inode modificati, va chiamata con alloc_lock
+    e con i lock di tutti gli inode.
+*/
+void sync_collect(filesystem_t* fs){
+
+    sync_inode_table(fs);
+    sync_freespace_table(fs);
+    sync_inode_cache(fs);
+
+}
+
+/*
+    Commit della transazione in corso. Vengono fermate tutte le operazioni prendendo i lock di tutti
+    gli inode, raccolti nella transazione le tabelle e gli inode modificati, poi la transazione viene scritta
+    nel journal, resa persistente insieme ai blocchi dati scritti fino a questo momento, e riportata
+    nella posizione dei blocchi. I blocchi liberati dal commit precedente tornano assegnabili con questa
+    transazione, vedi release_pending_blocks.
+    Se la transazione non entra nel journal, o per un blocco non c'è stata memoria per la copia,
+    il journal viene invalidato ed i blocchi scritti direttamente: in questo caso il commit non è atomico
+    rispetto ad un'interruzione. Non va chiamata tenendo il lock di un inode.
+    Ritorna il numero di blocchi di metadati scritti.
+*/
+uint32_t sync_fs(filesystem_t* fs){
+
+    journal_t* journal = fs->journal;
+    uint32_t count;
+    
+    for(uint32_t i = 0; i < INODE_LOCK_STRIPES; i++)
+        pthread_rwlock_wrlock(&fs->inode_locks[i]);
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    release_pending_blocks(fs);
+    sync_collect(fs);
+
+    pthread_mutex_lock(&journal->lock);
+    count = journal->count;
+
+    if(count > journal->capacity || journal->overflow){
+        journal_invalidate(fs);
+        journal_forget_committed(journal);
+        flush_range((off_t)fs->sb.journal_start * fs->block_size,(size_t)fs->sb.journal_blocks * fs->block_size,MS_SYNC,fs);
+        journal_checkpoint(fs);
+
+        if(journal->overflow){      //Le tabelle e gli inode rimasti senza copia vengono scritti nella loro posizione
+            journal->overflow = 0;
+            journal->direct = 1;
+            pthread_mutex_unlock(&journal->lock);
+            sync_collect(fs);
+            pthread_mutex_lock(&journal->lock);
+            journal->direct = 0;
+        }
+
+        flush_range(0,fs->image_size,MS_SYNC,fs);
+    }
+    else if(count > 0){
+        journal_write_transaction(fs);
+        flush_range(0,fs->image_size,MS_SYNC,fs);    //Punto di commit, rende persistenti anche i checkpoint precedenti
+        journal_checkpoint(fs);
+        journal->sequence++;
+        COUNT_STAT(fs,commits,1);
+    }
+
+    journal->pending_ops = 0;
+    pthread_mutex_unlock(&journal->lock);
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    for(uint32_t i = 0; i < INODE_LOCK_STRIPES; i++)
+        pthread_rwlock_unlock(&fs->inode_locks[i]);
+
+    return count;
+}
+
+/*
+    Da chiamare al termine di ogni operazione che modifica i metadati, senza tenere lock di inode:
+    esegue il commit se la politica di sincronizzazione lo richiede, se la transazione è cresciuta abbastanza
+    o se i blocchi liberati in attesa del commit sono più di quelli liberi.
+*/
+void end_metadata_op(filesystem_t* fs){
+
+    journal_t* journal = fs->journal;
+    uint32_t dirty_inodes;
+    uint8_t low_space;
+    uint8_t commit;
+
+    pthread_mutex_lock(&fs->inode_cache->lock);
+    dirty_inodes = fs->inode_cache->dirty_count;
+    pthread_mutex_unlock(&fs->inode_cache->lock);
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    low_space = fs->pending_blocks > fs->free_blocks;     //I blocchi liberati servono prima del commit di gruppo
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    pthread_mutex_lock(&journal->lock);
+    journal->pending_ops++;
+    commit = fs->sync_policy == FS_SYNC_META || journal->pending_ops >= JOURNAL_GROUP_OPS || low_space
+        || journal->count + dirty_inodes >= journal->capacity / 2;     //Gli inode modificati entreranno nella transazione
+    pthread_mutex_unlock(&journal->lock);
+
+    if(commit)
+        sync_fs(fs);
+
+}
+
+
+/*
+    Alloca le strutture in memoria di un file system con il superblocco sb, già validato.
+    Ritorna NULL in caso di errore.
+*/
+filesystem_t* alloc_fs(const superblock_t* sb){
+
+    filesystem_t* new_fs = calloc(1,sizeof(filesystem_t));
+
+    if(new_fs == NULL)
+        return NULL;
+
+    new_fs->sb = *sb;
+    new_fs->free_space_table = init_freespace_table(&new_fs->sb);
+    new_fs->free_space_words = ((uint64_t)new_fs->sb.freespace_table_blocks * new_fs->sb.block_size) / sizeof(uint64_t);
+    new_fs->free_space_dirty = calloc(new_fs->sb.freespace_table_blocks,sizeof(uint8_t));
+    new_fs->pending_free = calloc(new_fs->free_space_words,sizeof(uint64_t));
+    new_fs->alloc_cursor = new_fs->sb.data_start;
+    new_fs->inode_table = init_inode_table(new_fs->sb.inodes_count);
+    new_fs->inode_table_dirty = calloc(new_fs->sb.inode_table_blocks,sizeof(uint8_t));
+    new_fs->inode_bitmap = init_inode_bitmap(new_fs->sb.inodes_count);
+    new_fs->inode_bitmap_words = (new_fs->sb.inodes_count + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    new_fs->free_inodes = new_fs->sb.inodes_count;
+    new_fs->journal = init_journal(&new_fs->sb);
+    new_fs->inode_cache = init_inode_cache();
+    new_fs->dentry_cache = init_name_cache(DENTRY_CACHE_SIZE);
+    new_fs->path_cache = init_name_cache(PATH_CACHE_SIZE);
+    new_fs->open_files = 0;
+    new_fs->sync_policy = FS_SYNC_LAZY;
+    new_fs->readahead_max = (uint64_t)READAHEAD_DEFAULT_KB * 1024 / new_fs->sb.block_size;
+    pthread_mutex_init(&new_fs->alloc_lock,NULL);
+
+    for(uint32_t i = 0; i < INODE_LOCK_STRIPES; i++)
+        pthread_rwlock_init(&new_fs->inode_locks[i],NULL);
+
+    if(new_fs->inode_table == NULL || new_fs->inode_table_dirty == NULL || new_fs->inode_bitmap == NULL || new_fs->free_space_table == NULL || new_fs->free_space_dirty == NULL || new_fs->pending_free == NULL
+        || new_fs->journal == NULL || new_fs->inode_cache == NULL || new_fs->dentry_cache == NULL || new_fs->path_cache == NULL)
+        return NULL;
+
+    return new_fs;
+
+}
+
+/*
+    Crea un nuovo file system (mkfs) nel file path con la geometria indicata da sb
+    (dimensione del blocco, numero di blocchi, numero di inode e blocchi del journal).
+*/
+filesystem_t* init_fs(filesystem_t** fs, const char* path, const superblock_t* sb){
+    
+    superblock_t geometry = *sb;
+    filesystem_t* new_fs;
+
+    if(init_superblock(&geometry) == -1)
+        return NULL;
+
+    new_fs = alloc_fs(&geometry);
+
+    if(new_fs == NULL || load_fs(path,new_fs) == NULL)
+        return NULL;
+
+    new_fs->free_blocks = count_free_blocks(new_fs);
+
+    format_fs(new_fs);
+    memset(new_fs->free_space_dirty,1,new_fs->sb.freespace_table_blocks);  //Le tabelle appena create vanno scritte per intero
+    memset(new_fs->inode_table_dirty,1,new_fs->sb.inode_table_blocks);
+    sync_fs(new_fs);
+    *fs = new_fs;
+
+    return new_fs;
+
+}
+
+/*
+    Legge il superblocco dal file path e controlla che descriva un file system di questa revisione:
+    la disposizione ricalcolata dalla geometria deve coincidere con quella memorizzata ed il file
+    deve contenere tutti i blocchi. Ritorna 0 se il superblocco è valido, -1 altrimenti.
+*/
+int8_t read_superblock(const char* path, superblock_t* sb){
+
+    superblock_t geometry = {0};
+    struct stat st;
+    int fd = open(path,O_RDONLY);
+
+    if(fd == -1)
+        return -1;
+
+    if(pread(fd,sb,sizeof(superblock_t),SUPERBLOCK_BLOCK) != sizeof(superblock_t) || fstat(fd,&st) == -1){
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    if(sb->magic != FSIM_MAGIC || sb->version != FSIM_VERSION)
+        return -1;
+
+    geometry.block_size = sb->block_size;
+    geometry.blocks_count = sb->blocks_count;
+    geometry.inodes_count = sb->inodes_count;
+    geometry.journal_blocks = sb->journal_blocks;
+
+    if(init_superblock(&geometry) == -1 || memcmp(&geometry,sb,sizeof(superblock_t)) != 0)
+        return -1;
+
+    if((uint64_t)st.st_size < (uint64_t)sb->blocks_count * sb->block_size)
+        return -1;
+
+    return 0;
+
+}
+
+/*
+    Monta il file system esistente nel file path: dopo aver validato il superblocco riapplica
+    le transazioni complete del journal e carica le tabelle con un'unica copia ciascuna dalla mappatura.
+    Il journal contiene transazioni solo se il file system non è stato smontato con close_fs,
+    il contenuto del dispositivo non viene modificato se non dal loro replay.
+    Con read_only il dispositivo non viene mai modificato: il replay e le modifiche successive restano
+    nella mappatura privata (vedi load_fs).
+*/
+filesystem_t* mount_fs_mode(filesystem_t** fs, const char* path, uint8_t read_only){
+
+    superblock_t sb;
+    filesystem_t* new_fs;
+
+    if(read_superblock(path,&sb) == -1)
+        return NULL;
+
+    new_fs = alloc_fs(&sb);
+
+    if(new_fs == NULL)
+        return NULL;
+
+    new_fs->read_only = read_only;
+
+    if(load_fs(path,new_fs) == NULL)
+        return NULL;
+
+    replay_journal(new_fs);
+    read_inode_table(new_fs);
+    read_freespace_table(new_fs->free_space_table,new_fs);
+    new_fs->free_blocks = count_free_blocks(new_fs);
+
+    if(new_fs->inode_table[0] == 0)     //Manca la directory root
+        return NULL;
+
+    *fs = new_fs;
+
+    return new_fs;
+
+}
+
+filesystem_t* mount_fs(filesystem_t** fs, const char* path){
+
+    return mount_fs_mode(fs,path,0);
+}
+
+/*
+    Scrive su disco lo stato del file system e rilascia la mappatura.
+    Reso persistente anche il checkpoint dell'ultimo commit, il journal viene invalidato:
+    al montaggio successivo non c'è niente da riapplicare.
+*/
+void close_fs(filesystem_t* fs){
+
+    flush_write_buffers(fs);
+    sync_fs(fs);
+    flush_range(0,fs->image_size,MS_SYNC,fs);
+    journal_invalidate(fs);
+    flush_range((off_t)fs->sb.journal_start * fs->block_size,(size_t)fs->sb.journal_blocks * fs->block_size,MS_SYNC,fs);
+    free_io_engine(fs->io);
+    munmap(fs->image,fs->image_size);
+    close(fs->fd);
+    free_inode_cache(fs->inode_cache);
+    free_name_cache(fs->dentry_cache);
+    free_name_cache(fs->path_cache);
+    free(fs->free_space_table);
+    free(fs->free_space_dirty);
+    free(fs->pending_free);
+    free(fs->inode_table);
+    free(fs->inode_table_dirty);
+    free(fs->inode_bitmap);
+    free_journal(fs->journal);
+    pthread_mutex_destroy(&fs->alloc_lock);
+
+    for(uint32_t i = 0; i < INODE_LOCK_STRIPES; i++)
+        pthread_rwlock_destroy(&fs->inode_locks[i]);
+
+    free(fs);
+
+}
+
+
+/*---------------------------*/
+
+
+/*Statistiche*/
+
+/*
+    Azzera i contatori del dispositivo e delle cache.
+*/
+void reset_fs_stats(filesystem_t* fs){
+
+    uint64_t* counters = (uint64_t*)&fs->stats;
+
+    for(size_t i = 0; i < sizeof(fs_stats_t) / sizeof(uint64_t); i++)
+        __atomic_store_n(&counters[i],0,__ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&fs->inode_cache->lock);
+    fs->inode_cache->hits = fs->inode_cache->misses = 0;
+    pthread_mutex_unlock(&fs->inode_cache->lock);
+
+    pthread_mutex_lock(&fs->dentry_cache->lock);
+    fs->dentry_cache->hits = fs->dentry_cache->misses = 0;
+    pthread_mutex_unlock(&fs->dentry_cache->lock);
+
+    pthread_mutex_lock(&fs->path_cache->lock);
+    fs->path_cache->hits = fs->path_cache->misses = 0;
+    pthread_mutex_unlock(&fs->path_cache->lock);
+
+}
+
+/*
+    Scrive in buf i contatori del dispositivo e delle cache, una riga "nome valore" per contatore.
+    Ritorna il numero di caratteri che servirebbero, come snprintf.
+*/
+int format_fs_stats(char* buf, size_t size, filesystem_t* fs){
+
+    uint64_t cache_counters[6];
+    uint32_t free_blocks;
+    uint32_t free_inodes;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    free_blocks = fs->free_blocks;
+    free_inodes = fs->free_inodes;
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    pthread_mutex_lock(&fs->inode_cache->lock);
+    cache_counters[0] = fs->inode_cache->hits;
+    cache_counters[1] = fs->inode_cache->misses;
+    pthread_mutex_unlock(&fs->inode_cache->lock);
+
+    pthread_mutex_lock(&fs->dentry_cache->lock);
+    cache_counters[2] = fs->dentry_cache->hits;
+    cache_counters[3] = fs->dentry_cache->misses;
+    pthread_mutex_unlock(&fs->dentry_cache->lock);
+
+    pthread_mutex_lock(&fs->path_cache->lock);
+    cache_counters[4] = fs->path_cache->hits;
+    cache_counters[5] = fs->path_cache->misses;
+    pthread_mutex_unlock(&fs->path_cache->lock);
+
+    return snprintf(buf,size,
+        "syscalls %" PRIu64 "\n"
+        "bytes_read %" PRIu64 "\n"
+        "bytes_written %" PRIu64 "\n"
+        "seeks %" PRIu64 "\n"
+        "flushes %" PRIu64 "\n"
+        "commits %" PRIu64 "\n"
+        "readahead_blocks %" PRIu64 "\n"
+        "buffer_flushes %" PRIu64 "\n"
+        "inode_cache_hits %" PRIu64 "\n"
+        "inode_cache_misses %" PRIu64 "\n"
+        "dentry_cache_hits %" PRIu64 "\n"
+        "dentry_cache_misses %" PRIu64 "\n"
+        "path_cache_hits %" PRIu64 "\n"
+        "path_cache_misses %" PRIu64 "\n"
+        "free_blocks %" PRIu32 "\n"
+        "free_inodes %" PRIu32 "\n"
+        "open_files %" PRIu32 "\n"
+        "buffered_bytes %" PRIu64 "\n"
+        "io_uring %" PRIu8 "\n",
+        __atomic_load_n(&fs->stats.syscalls,__ATOMIC_RELAXED),
+        __atomic_load_n(&fs->stats.bytes_read,__ATOMIC_RELAXED),
+        __atomic_load_n(&fs->stats.bytes_written,__ATOMIC_RELAXED),
+        __atomic_load_n(&fs->stats.seeks,__ATOMIC_RELAXED),
+        __atomic_load_n(&fs->stats.flushes,__ATOMIC_RELAXED),
+        __atomic_load_n(&fs->stats.commits,__ATOMIC_RELAXED),
+        __atomic_load_n(&fs->stats.readahead_blocks,__ATOMIC_RELAXED),
+        __atomic_load_n(&fs->stats.buffer_flushes,__ATOMIC_RELAXED),
+        cache_counters[0],cache_counters[1],cache_counters[2],
+        cache_counters[3],cache_counters[4],cache_counters[5],
+        free_blocks,free_inodes,__atomic_load_n(&fs->open_files,__ATOMIC_RELAXED),
+        __atomic_load_n(&fs->buffered_bytes,__ATOMIC_RELAXED),fs->io->kind == IO_ENGINE_URING);
+
+}
+
+
+/*---------------------------*/
+
+
+/*Manipolazione dei file*/
+
+/*
+    Assegna al file un inode ed il blocco che lo contiene, il numero di inode viene scritto in file->inode_num.
+    Ritorna 0 se è stato possibile, -ENOSPC se mancano blocchi o inode liberi.
+*/
+int8_t new_inode(file_t* file, filesystem_t* fs){
+
+    block_num_t block_num = get_and_set_free_block(fs);
+
+    if(block_num == 0)
+        return -ENOSPC;
+
+    if(assign_inode_to_block(&file->inode_num, block_num, fs) == -1){
+        release_block(block_num,fs);
+        return -ENOSPC;
+    }
+
+    return 0;
+}
+
+/*
+    Inizializza l'inode appena assegnato al file, il chiamante deve tenerne il lock in scrittura.
+    Ritorna 0, oppure -ENOSPC o -ENOMEM (vedi init_dir_index) dopo aver liberato l'inode.
+*/
+int8_t init_new_inode(const file_t* file, filesystem_t* fs){
+
+    inode_t* inode = get_inode(file->inode_num,fs);
+    int8_t ret = 0;
+
+    if(inode == NULL){
+        release_inode(file->inode_num,fs);
+        return -ENOMEM;
+    }
+
+    memset(inode,0,sizeof(inode_t));
+    inode->mode = file->mode;   //i metadati del file verranno salvati sul dispositivo alla sincronizzazione della cache
+    inode->size = file->size;
+    mark_inode_dirty(file->inode_num,fs);
+
+    if(S_ISDIR(file->mode))
+        ret = init_dir_index(file->inode_num,fs);
+
+    if(ret != 0)
+        free_inode(file->inode_num,fs);
+
+    return ret;
+}
+
+int8_t sync_new_file(file_t* file, filesystem_t* fs){
+
+    int8_t ret;
+    
+    if(new_inode(file,fs) != 0)
+        return -1;
+
+    lock_inode(file->inode_num,1,fs);
+    ret = init_new_inode(file,fs);
+    unlock_inode(file->inode_num,fs);
+    end_metadata_op(fs);
+    
+    return ret == 0 ? 0 : -1;
+}
+
+
+/*
+    Il chiamante deve tenere il lock dell'inode in scrittura.
+*/
+void update_file_size(inode_num_t file_inode ,size_t new_size,filesystem_t* fs){
+    
+    get_inode(file_inode,fs)->size = new_size;
+    mark_inode_dirty(file_inode,fs);
+
+}
+
+void update_file_mode(inode_num_t file_inode ,mode_t new_mode,filesystem_t* fs){
+    
+    lock_inode(file_inode,1,fs);
+    get_inode(file_inode,fs)->mode = new_mode;
+    mark_inode_dirty(file_inode,fs);
+    unlock_inode(file_inode,fs);
+    end_metadata_op(fs);
+
+}
+
+
+void init_root_dir(filesystem_t* fs){
+
+    file_t new_file;
+
+    new_file.mode = S_IFDIR | 0644;
+    new_file.size = 0;
+    sync_new_file(&new_file,fs);
+
+}
+
+void sync_test_files(filesystem_t* fs,uint8_t num){
+
+    file_t new_file;
+
+    new_file.mode = S_IFREG | 0644;
+    new_file.size = 0;
+
+    for(int i = 0; i < num ; i++){
+
+    snprintf(new_file.name,256,"Test_%d",i);
+    new_file_to_dir(new_file,"/",fs);
+
+    }
+
+}
+
+void sync_test_dir(filesystem_t* fs,uint8_t num){
+
+    file_t new_file;
+
+    new_file.mode = S_IFDIR | 0755;
+    new_file.size = 0;
+
+    for(int i = 0; i < num ; i++){
+
+    snprintf(new_file.name,256,"DirTest_%d",i);
+    new_file_to_dir(new_file,"/",fs);
+
+    }
+
+}
+
+
+
+/*
+    Crea il file con nome file.name: nella root se path è "/", altrimenti nella directory che contiene path.
+    Ritorna 0, -ENOENT o -ENOTDIR se la directory non esiste o non è una directory, -ENAMETOOLONG,
+    -ENOSPC se mancano blocchi o inode liberi, -EEXIST se il nome è già presente, -ENOMEM se non c'è
+    memoria per la transazione.
+*/
+int8_t new_file_to_dir(file_t file,const char* path , filesystem_t* fs){
+
+    inode_num_t dir_inode_num = 0;
+    const char* name;
+    int8_t ret;
+
+    if(strcmp(path,"/") != 0 && (ret = resolve_parent(path,&dir_inode_num,&name,fs)) != 0)
+        return ret;
+             
+    if(strlen(file.name) > DIR_MAX_NAME(fs))
+        return -ENAMETOOLONG;
+
+    ret = new_inode(&file,fs);
+
+    if(ret != 0)
+        return ret;
+
+    lock_inode_pair(dir_inode_num,file.inode_num,fs);
+    ret = init_new_inode(&file,fs);     //Prima del nome, così che un errore non lasci nella directory un inode non valido
+
+    if(ret == 0 && (ret = write_file_info(file,dir_inode_num,fs)) != 0)    //Fallisce anche se il nome è già presente
+        free_inode(file.inode_num,fs);
+
+    if(ret != 0){
+        unlock_inode_pair(dir_inode_num,file.inode_num,fs);
+        end_metadata_op(fs);
+        return ret;
+    }
+
+    name_cache_insert(dir_inode_num,file.name,strlen(file.name),file.inode_num,fs->dentry_cache);
+    if(strcmp(path,"/") != 0)
+        name_cache_invalidate(0,path,fs->path_cache);
+
+    unlock_inode_pair(dir_inode_num,file.inode_num,fs);
+    end_metadata_op(fs);
+
+    return 0;
+}
+
+/*
+    Posiziona l'iteratore all'inizio del blocco block della catena del bucket corrente.
+*/
+void dir_iter_load_block(dir_iter_t* it, block_num_t block, filesystem_t* fs){
+
+    it->block = block;
+
+    if(block != 0){
+        it->entry = meta_ptr(block,BUCKET_HEADER_SIZE,0,fs);
+        it->entries_end = it->entry + bucket_used(block,fs);
+    }
+}
+
+/*
+    Posiziona l'iteratore sul primo blocco del bucket corrente.
+*/
+void dir_iter_load_bucket(dir_iter_t* it, filesystem_t* fs){
+
+    dir_iter_load_block(it,map_file_block(it->dir_inode,it->bucket + 1,NULL),fs);
+}
+
+/*
+    Prepara l'iteratore a scorrere la directory dalla posizione cookie (0 per l'inizio).
+    Ritorna -1 se l'inode non è una directory o non ha un indice.
+*/
+int8_t dir_iter_start(dir_iter_t* it, inode_num_t dir_inode_num, uint64_t cookie, filesystem_t* fs){
+
+    uint32_t skip = 0;
+
+    it->dir_inode = get_inode(dir_inode_num,fs);
+    it->bucket = 0;
+    it->index = 0;
+    it->block = 0;
+
+    if(!S_ISDIR(it->dir_inode->mode) || it->dir_inode->extent_count == 0)
+        return -1;
+
+    read_dir_header(it->dir_inode,&it->header,fs);
+
+    if(cookie >= DIR_COOKIE(0,0)){
+        it->bucket = (cookie >> 32) - 1;
+        skip = (uint32_t)cookie;
+    }
+
+    if(it->bucket < dir_bucket_count(&it->header))
+        dir_iter_load_bucket(it,fs);
+
+    /* Salta le entry già restituite senza uscire dal bucket, che potrebbe essersi accorciato */
+    while(it->block != 0 && it->index < skip){
+
+        if(it->entry < it->entries_end){
+            memcpy(&it->name_lenght,it->entry + sizeof(inode_num_t) + sizeof(uint32_t),sizeof(file_name_lenght_t));
+            it->entry += DIR_ENTRY_HEADER_SIZE + it->name_lenght;
+            it->index++;
+        }
+        else
+            dir_iter_load_block(it,bucket_overflow(it->block,fs),fs);
+    }
+
+    return 0;
+}
+
+/*
+    Avanza alla entry successiva, copiandone numero di inode e nome (terminato) nell'iteratore.
+    Ritorna 1 se c'è una entry, 0 se la directory è finita.
+*/
+int8_t dir_iter_next(dir_iter_t* it, filesystem_t* fs){
+
+    while(it->bucket < dir_bucket_count(&it->header)){
+
+        while(it->block != 0){
+
+            if(it->entry < it->entries_end){
+
+                memcpy(&it->inode_num,it->entry,sizeof(inode_num_t));
+                memcpy(&it->name_lenght,it->entry + sizeof(inode_num_t) + sizeof(uint32_t),sizeof(file_name_lenght_t));
+                memcpy(it->name,it->entry + DIR_ENTRY_HEADER_SIZE,it->name_lenght);
+                it->name[it->name_lenght] = '\0';
+
+                it->entry += DIR_ENTRY_HEADER_SIZE + it->name_lenght;
+                it->index++;
+                return 1;
+            }
+
+            dir_iter_load_block(it,bucket_overflow(it->block,fs),fs);
+        }
+
+        it->bucket++;
+        it->index = 0;
+
+        if(it->bucket < dir_bucket_count(&it->header))
+            dir_iter_load_bucket(it,fs);
+    }
+
+    return 0;
+}
+
+/*
+    Cookie da cui riprendere la lettura dopo l'ultima entry restituita.
+*/
+uint64_t dir_iter_cookie(const dir_iter_t* it){
+
+    return DIR_COOKIE(it->bucket,it->index);
+}
+
+/*
+
+Tokenizzazione path e lookup
+
+*/
+
+
+/*
+    Iteratore sui componenti di un path: ritorna il puntatore al primo componente che inizia in path o dopo,
+    saltando le barre, ed in len la sua lunghezza; NULL se non ci sono altri componenti.
+    I componenti non vengono copiati né terminati, il successivo si ottiene con path_component(name + len, &len).
+*/
+const char* path_component(const char* path, size_t* len){
+
+    while(*path == '/')
+        path++;
+
+    if(*path == '\0')
+        return NULL;
+
+    *len = strcspn(path,"/");
+    return path;
+}
+
+
+/*
+Ritorna il numero di inode di un elemento all'interno di una directory
+dato il nome, di len byte e non necessariamente terminato.
+*/
+inode_num_t get_dir_element_inode(const char* name, size_t len, inode_num_t inode_num, filesystem_t* fs){
+    
+    inode_num_t element_inode;
+
+    if(len > MAX_FILE_NAME)
+        return 0;
+
+    element_inode = name_cache_lookup(inode_num,name,len,fs->dentry_cache);
+
+    if(element_inode != 0)
+        return element_inode;
+
+    lock_inode(inode_num,0,fs);
+    element_inode = dir_lookup(inode_num,name,len,fs);
+
+    if(element_inode != 0)      //Con il lock della directory il nome non può essere rimosso prima dell'inserimento
+        name_cache_insert(inode_num,name,len,element_inode,fs->dentry_cache);
+
+    unlock_inode(inode_num,fs);
+
+    return element_inode;
+
+}
+
+/*
+    Ritorna l'inode individuato dai primi path_len byte del path, 0 se non esiste (o se è la root).
+    Il prefisso viene cercato nella cache dei path, altrimenti risolto un componente alla volta
+    senza copiare il path ed inserito nella cache solo se nel frattempo non è stata svuotata.
+*/
+inode_num_t inode_from_path_prefix(const char* path, size_t path_len, filesystem_t* fs){
+
+    const char* end = path + path_len;
+    const char* name;
+    size_t len;
+    uint64_t generation = name_cache_generation(fs->path_cache);
+    inode_num_t inode_num = name_cache_lookup(0,path,path_len,fs->path_cache);
+
+    if(inode_num != 0)
+        return inode_num;
+
+    for(name = path_component(path,&len); name != NULL && name < end; name = path_component(name + len,&len)){
+
+        inode_num = get_dir_element_inode(name,len,inode_num,fs);
+
+        if(inode_num == 0)
+            return 0;
+    }
+
+    if(inode_num != 0)      //Non viene inserito se una rimozione o rinomina ha svuotato la cache durante la risoluzione
+        name_cache_insert_since(0,path,path_len,inode_num,generation,fs->path_cache);
+
+    return inode_num;
+}
+
+/*
+Dato il path ritorna l'inode del file individuato.
+*/
+inode_num_t inode_from_path(const char* path,filesystem_t* fs){
+
+    if(strcmp(path,"/") == 0)
+        return 0;
+
+    return inode_from_path_prefix(path,strlen(path),fs);
+}
+
+
+/*
+Dato un path ritorna la directory che contiene il file individuato dal path
+
+*/
+inode_num_t parent_dir_inode_from_path(const char* path,filesystem_t* fs){
+
+    const char* last_slash = strrchr(path,'/');
+
+    if(last_slash == NULL || last_slash == path)   //Il file si trova nella root
+        return 0;
+
+    return inode_from_path_prefix(path,last_slash - path,fs);    //Il path della directory viene risolto tramite la cache dei path
+
+}
+
+/*
+    Ritorna il nome dell'elemento individuato dal path, come puntatore all'interno del path.
+*/
+const char* file_name_from_path(const char* path){
+
+    const char* last_slash = strrchr(path,'/');
+
+    if(strcmp(path,"/") == 0)
+        return "/";
+
+    return (last_slash != NULL) ? last_slash + 1 : path;
+}
+ 
+/*-------------------------*/
+
+
+/*Operazioni */
+
+/*
+    Ritorna il blocco in cui si trova il blocco logico index del file rappresentato dall'inode.
+    Se il blocco non è presente ed alloc vale 1 assegna all'inode tutti i blocchi mancanti fino ad index,
+    in questo caso inode deve essere quello in cache.
+    Ritorna 0 se il blocco non esiste o non è stato possibile assegnarlo.
+*/
+block_num_t file_block(inode_t* inode ,inode_num_t inode_num ,uint32_t index ,uint8_t alloc ,filesystem_t* fs){
+
+    block_num_t block = map_file_block(inode,index,NULL);
+
+    if(block != 0 || alloc == 0)
+        return block;
+
+    if(grow_inode(inode_num,index + 1,fs) == -1)
+        return 0;
+
+    return map_file_block(inode,index,NULL);
+}
+
+/*
+    Scrive size byte di buf a partire da offset nel file inode_num, di cui inode è la copia in cache.
+    I blocchi mancanti vengono assegnati tutti insieme prima della copia, così da ottenere extent
+    il più possibile lunghi, poi la richiesta viene divisa in porzioni che non superano la fine di un extent,
+    ognuna copiata con un'unica memcpy. cursor, se non è NULL, è la posizione nella mappa dei blocchi
+    da cui cercare il primo blocco. Il chiamante deve tenere il lock dell'inode in scrittura e chiamare
+    end_metadata_op dopo averlo rilasciato. Ritorna il numero di byte scritti.
+*/
+size_t write_inode_data(inode_num_t inode_num, inode_t* inode, map_cursor_t* cursor, const char* buf, size_t size, off_t offset, filesystem_t* fs){
+
+    uint32_t index = offset / fs->block_size;
+    uint32_t offset_inside_block = offset % fs->block_size;
+    uint64_t needed = ((uint64_t)offset + size + fs->block_size - 1) / fs->block_size;
+    block_num_t block;
+    uint32_t run;
+    size_t written = 0;
+    size_t chunk;
+
+    /* Un file piccolo senza blocchi viene scritto nell'inode, che verrà scritto nel journal al commit */
+    if(S_ISREG(inode->mode) && inode->extent_count == 0 && inode->size <= INLINE_DATA_MAX(fs) && offset + size <= INLINE_DATA_MAX(fs)){
+
+        if((uint64_t)offset > inode->size)
+            memset(inode->inline_data + inode->size,0,offset - inode->size);
+
+        memcpy(inode->inline_data + offset,buf,size);
+
+        if(offset + size > inode->size)
+            inode->size = offset + size;
+
+        mark_inode_dirty(inode_num,fs);
+        COUNT_STAT(fs,bytes_written,size);
+
+        return size;
+    }
+
+    if(needed > fs->sb.blocks_count)
+        needed = fs->sb.blocks_count;
+
+    grow_inode(inode_num,needed,fs);     //Se non tutti i blocchi sono stati assegnati si scrive quanto possibile
+
+    while(written < size){
+
+        block = map_file_block_from(inode,index,&run,cursor);
+
+        if(block == 0)  //Non è stato possibile assegnare un blocco
+            break;
+
+        chunk = (size_t)run * fs->block_size - offset_inside_block;
+        if(chunk > size - written)
+            chunk = size - written;
+
+        memcpy(block_ptr(block,offset_inside_block,fs),buf + written,chunk);
+
+        written += chunk;
+        index += (offset_inside_block + chunk) / fs->block_size;
+        offset_inside_block = 0;
+    }
+
+    if(offset + written > inode->size)
+        update_file_size(inode_num,offset + written,fs);
+
+    COUNT_STAT(fs,bytes_written,written);
+
+    return written;
+}
+
+/*
+
+Buffer di scrittura, vedi write_buffer_t
+
+*/
+
+/*
+    Scrive sul dispositivo il buffer di scrittura del file inode_num, di cui inode è la copia in cache,
+    assegnando in un'unica volta i blocchi che mancano. Il chiamante deve tenere il lock dell'inode
+    in scrittura e chiamare end_metadata_op dopo averlo rilasciato.
+    Ritorna 0, -ENOSPC se non è stato possibile scrivere tutto il buffer (l'errore resta anche in write_error).
+*/
+int8_t flush_write_buffer(inode_num_t inode_num, inode_t* inode, map_cursor_t* cursor, filesystem_t* fs){
+
+    inode_cache_entry_t* entry = inode_cache_entry_of(inode);
+    write_buffer_t* wbuf = entry->wbuf;
+    int8_t ret = 0;
+
+    if(wbuf == NULL)
+        return 0;
+
+    entry->wbuf = NULL;
+
+    if(write_inode_data(inode_num,inode,cursor,wbuf->data,wbuf->size,wbuf->offset,fs) < wbuf->size)
+        ret = entry->write_error = -ENOSPC;
+
+    __atomic_fetch_sub(&fs->buffered_bytes,wbuf->size,__ATOMIC_RELAXED);
+    COUNT_STAT(fs,buffer_flushes,1);
+    free(wbuf->data);
+    free(wbuf);
+
+    return ret;
+}
+
+/*
+    Copia nel buffer di scrittura del file size byte di buf da scrivere a partire da offset.
+    Il buffer accetta solo scritture di file regolari che proseguono o si sovrappongono all'intervallo
+    già presente e che non lo portano oltre WRITE_BUFFER_MAX, e solo se c'è spazio libero per tutti
+    i dati in attesa, così che un file system pieno riporti l'errore alla scrittura.
+    Il chiamante deve tenere il lock dell'inode in scrittura.
+    Ritorna 0 se i dati sono stati copiati, -1 se vanno scritti sul dispositivo.
+*/
+int8_t buffer_write(inode_t* inode, const char* buf, size_t size, off_t offset, filesystem_t* fs){
+
+    inode_cache_entry_t* entry = inode_cache_entry_of(inode);
+    write_buffer_t* wbuf = entry->wbuf;
+    uint64_t free_bytes;
+    size_t end;
+    size_t capacity;
+    char* data;
+
+    if(!S_ISREG(inode->mode) || size == 0 || size >= WRITE_BUFFER_MAX)
+        return -1;
+
+    if(wbuf != NULL && (offset < wbuf->offset || (uint64_t)offset > wbuf->offset + wbuf->size
+        || offset + size - wbuf->offset > WRITE_BUFFER_MAX))
+        return -1;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    free_bytes = (uint64_t)fs->free_blocks * fs->block_size;
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    if(free_bytes < __atomic_load_n(&fs->buffered_bytes,__ATOMIC_RELAXED) + size)
+        return -1;
+
+    if(wbuf == NULL){
+        wbuf = calloc(1,sizeof(write_buffer_t));
+
+        if(wbuf == NULL)
+            return -1;
+
+        wbuf->offset = offset;
+        entry->wbuf = wbuf;
+    }
+
+    end = offset + size - wbuf->offset;
+
+    if(end > wbuf->capacity){
+
+        for(capacity = wbuf->capacity > 0 ? wbuf->capacity : WRITE_BUFFER_MIN; capacity < end; capacity *= 2);
+
+        if(capacity > WRITE_BUFFER_MAX)
+            capacity = WRITE_BUFFER_MAX;
+
+        data = realloc(wbuf->data,capacity);
+
+        if(data == NULL)        //Un buffer vuoto viene liberato alla scrittura
+            return -1;
+
+        wbuf->data = data;
+        wbuf->capacity = capacity;
+    }
+
+    memcpy(wbuf->data + (offset - wbuf->offset),buf,size);
+
+    if(end > wbuf->size){
+        __atomic_fetch_add(&fs->buffered_bytes,end - wbuf->size,__ATOMIC_RELAXED);
+        wbuf->size = end;
+    }
+
+    return 0;
+}
+
+/*
+    Dimensione del file di cui inode è la copia in cache, compresi i dati nel buffer di scrittura.
+    Il chiamante deve tenere il lock dell'inode.
+*/
+uint64_t inode_size(const inode_t* inode){
+
+    write_buffer_t* wbuf = inode_cache_entry_of((inode_t*)inode)->wbuf;
+
+    if(wbuf != NULL && wbuf->offset + wbuf->size > inode->size)
+        return wbuf->offset + wbuf->size;
+
+    return inode->size;
+}
+
+/*
+    Prende il lock dell'inode in lettura per accedere ai dati del file, dopo aver scritto
+    il suo buffer di scrittura. file, se non è NULL, è un file aperto sull'inode.
+    Ritorna la copia in cache dell'inode, NULL se il file aperto è stato liberato:
+    in entrambi i casi il chiamante deve poi rilasciare il lock.
+*/
+inode_t* lock_inode_data(inode_num_t inode_num, open_file_t* file, filesystem_t* fs){
+
+    inode_t* inode;
+
+    lock_inode(inode_num,0,fs);
+
+    if(file != NULL && file->entry->released)
+        return NULL;
+
+    inode = file != NULL ? &file->entry->inode : get_inode(inode_num,fs);
+
+    if(inode_cache_entry_of(inode)->wbuf == NULL)
+        return inode;
+
+    unlock_inode(inode_num,fs);
+    lock_inode(inode_num,1,fs);
+
+    if(file == NULL || !file->entry->released)
+        flush_write_buffer(inode_num,file != NULL ? &file->entry->inode : get_inode(inode_num,fs),NULL,fs);
+
+    unlock_inode(inode_num,fs);
+    end_metadata_op(fs);
+    lock_inode(inode_num,0,fs);     //Nel frattempo il buffer può essere stato riempito di nuovo, come per una scrittura concorrente
+
+    if(file != NULL)
+        return file->entry->released ? NULL : &file->entry->inode;
+
+    return get_inode(inode_num,fs);
+}
+
+/*
+    Scrive size byte di buf a partire da offset nel file inode_num, vedi write_inode_data.
+*/
+size_t write_to_file(inode_num_t inode_num,const char* buf, size_t size,off_t offset,filesystem_t* fs){
+
+    inode_t* inode;
+    size_t written;
+
+    lock_inode(inode_num,1,fs);
+    inode = get_inode(inode_num,fs);
+    flush_write_buffer(inode_num,inode,NULL,fs);
+    written = write_inode_data(inode_num,inode,NULL,buf,size,offset,fs);
+    unlock_inode(inode_num,fs);
+    end_metadata_op(fs);
+
+    return written;
+}
+
+/*
+    Chiede al kernel di portare nella page cache i blocchi logici [first, last) del file,
+    con una madvise per ogni extent.
+    La madvise avvia le letture senza aspettarle, quindi non passa dal motore di I/O: con io_uring
+    la stessa richiesta (fadvise) viene sempre eseguita da un thread del kernel, ed a dati già
+    in memoria la lettura sequenziale risultava più lenta di circa un quarto.
+*/
+void prefetch_file_blocks(const inode_t* inode, uint32_t first, uint32_t last, filesystem_t* fs){
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    block_num_t block;
+    uint32_t run;
+    size_t start;
+    size_t end;
+
+    while(first < last){
 
-/*
-    Utils
-*/
+        block = map_file_block(inode,first,&run);
 
+        if(run == 0)    //Oltre l'ultimo blocco assegnato
+            return;
 
-/*
-    Se il blocco in cui stanno venendo scritti dei dati risulta pieno, assegna un nuovo blocco
-    all'inode che rappresenta il file sul quale si sta scrivendo e sposta la posizione all'interno
-    del file che rappresenta il file system a quella di questo nuovo blocco.
-*/
-block_num_t reach_new_block_if_full(inode_num_t inode_num,block_num_t starting_block,filesystem_t* fs){
+        if(run > last - first)
+            run = last - first;
 
-    block_num_t new_block;
-    uint16_t pos = ftell(fs->file);
-    if(block_free_space_left(starting_block,fs) == 0){
+        start = (size_t)block * fs->block_size;
+        end = start + (size_t)run * fs->block_size;
+        start -= start % page_size;
 
-            new_block = assign_block_to_inode(inode_num,fs);
-            move_to_block(new_block,0,fs);
-            pos = ftell(fs->file);
-            return new_block;
-        }
+        madvise(fs->image + start,end - start,MADV_WILLNEED);
+        COUNT_SYSCALL(fs);
+        COUNT_STAT(fs,readahead_blocks,run);
 
-    else{
-        ftell(fs->file);
-        return starting_block;
+        first += run;
     }
 }
 
 /*
-    Scrive sul file che rappresenta il file system le informazioni necessarie
-    ad indicare che un file si trova all'interno della directory: Numero di inode,
-    lunghezza del nome e nome del file. Queste informazioni vanno scritte all'interno di un blocco dati
-    facente parte di una directory, ogni campo viene scritto byte per byte.
+    Read-ahead adattivo di una lettura di size byte a partire da offset.
+    Una lettura che riprende da dove è finita la precedente (o che parte dall'inizio del file) è sequenziale:
+    la prima volta vengono richiesti READAHEAD_MIN_BLOCKS blocchi oltre la lettura, poi ogni volta che
+    la parte già richiesta scende sotto metà della finestra la finestra raddoppia, fino a fs->readahead_max.
+    Una lettura non sequenziale azzera la finestra ed è contata in stats.seeks. Il chiamante deve tenere il lock dell'inode.
 */
-void write_file_info(file_t file,inode_num_t dir_inode_num ,filesystem_t* fs){
+void file_readahead(readahead_t* ra, const inode_t* inode, off_t offset, size_t size, filesystem_t* fs){
 
-    file_name_lenght_t file_name_lenght = strlen(file.name);
-    block_num_t block = reach_data_end(dir_inode_num,fs);
-    uint8_t inode_num_bytes[sizeof(inode_num_t)];
-    uint8_t file_name_lenght_bytes[sizeof(file_name_lenght_t)];
-    uint32_t pos = ftell(fs->file);
+    uint32_t first = offset / fs->block_size;
+    uint32_t end = (offset + size + fs->block_size - 1) / fs->block_size;    //Primo blocco dopo la lettura
+    uint32_t window = __atomic_load_n(&ra->window,__ATOMIC_RELAXED);
+    uint32_t ahead = __atomic_load_n(&ra->ahead_until,__ATOMIC_RELAXED);
+    uint32_t target;
 
-    for(uint8_t j = 0; j < sizeof(inode_num_t); j++){
-        inode_num_bytes[j] = file.inode_num & (0xff >> j * 8); 
-    }
+    if(__atomic_exchange_n(&ra->next_block,end,__ATOMIC_RELAXED) != first){
 
-    for(uint8_t j = 0; j < sizeof(file_name_lenght); j++){
-        file_name_lenght_bytes[j] = file_name_lenght & (0xff >> j * 8); 
-    }
+        window = 0;
+        ahead = 0;
 
-    for(uint8_t j = 0; j < sizeof(inode_num_t);j++){
-        block = reach_new_block_if_full(dir_inode_num,block,fs);
-        fwrite(inode_num_bytes + j,1,1,fs->file);
-    }
-    
-    for(uint8_t j = 0; j < sizeof(file_name_lenght);j++){
-        block = reach_new_block_if_full(dir_inode_num,block,fs);
-        fwrite(file_name_lenght_bytes + j,1,1,fs->file);
+        if(first != 0){
+            COUNT_STAT(fs,seeks,1);
+            __atomic_store_n(&ra->window,0,__ATOMIC_RELAXED);
+            __atomic_store_n(&ra->ahead_until,0,__ATOMIC_RELAXED);
+            return;
+        }
     }
 
-    for(file_name_lenght_t j = 0; j < file_name_lenght; j++){
+    if(fs->readahead_max == 0)
+        return;
 
-        block = reach_new_block_if_full(dir_inode_num,block,fs);
-        fwrite(file.name + j,1,1,fs->file);
-    }
+    if(ahead < end)
+        ahead = end;
 
-    fflush(fs->file);
-}
+    if(window != 0 && ahead - end >= window / 2)     //Restano abbastanza blocchi già richiesti
+        return;
 
+    window = window == 0 ? READAHEAD_MIN_BLOCKS : window * 2;
+    if(window > fs->readahead_max)
+        window = fs->readahead_max;
 
+    target = end + window;
+    if(target > inode_blocks(inode))
+        target = inode_blocks(inode);
 
+    if(ahead < target){
+        prefetch_file_blocks(inode,ahead,target,fs);
+        ahead = target;
+    }
 
-/*
-    Sposta la posizione all'interno del file che rappresenta il file system ad un blocco dato.
-*/
-void move_to_block(block_num_t block_num,off_t offset ,filesystem_t* fs){
-    fseek(fs->file,block_num*BLOCK_SIZE + offset,SEEK_SET);
-    uint32_t pos = ftell(fs->file);
+    __atomic_store_n(&ra->window,window,__ATOMIC_RELAXED);
+    __atomic_store_n(&ra->ahead_until,ahead,__ATOMIC_RELAXED);
 }
 
-
 /*
-    
-    Dato un blocco sposta la posizione all'interno del file che rappresenta il file system, si sposta 
-    al primo byte libero all'interno del blocco.
-    ritorna -1 se il blocco è pieno, altrimenti lo scostamento all'interno del blocco.
-    Se il blocco in esame è un inode questo va segnalato tramite il parametro is_inode.
-
+    Legge al più size byte del file di cui inode è la copia in cache a partire da offset, un extent alla volta,
+    aggiornando il read-ahead ra e, se non è NULL, la posizione nella mappa dei blocchi cursor.
+    Il chiamante deve tenere il lock dell'inode, basta in lettura: letture di file diversi,
+    o dello stesso file, procedono in parallelo. Ritorna il numero di byte letti.
 */
-int16_t move_to_empty_space_in_block(block_num_t block_num,uint8_t is_inode,filesystem_t* fs){
-
-    uint8_t block[BLOCK_SIZE];
-    uint8_t offset;
-
-    move_to_block(block_num,0,fs);
-    fread(block,1,BLOCK_SIZE,fs->file);
-    
-    if(is_inode == 1)
-         offset = sizeof(mode_t) + sizeof(size_t);
-    else
-        offset = 0;
+size_t read_inode_data(inode_t* inode, readahead_t* ra, map_cursor_t* cursor, char* buf, off_t offset, size_t size, filesystem_t* fs){
 
-    int i = 0 + offset;
-    int free_space_candidate = -1;
-    
-    while(i < BLOCK_SIZE){
+    uint32_t index = offset / fs->block_size;
+    uint32_t offset_inside_block = offset % fs->block_size;
+    block_num_t block;
+    uint32_t run;
+    size_t bytes_read = 0;
+    size_t chunk;
 
-        if(block[i] == 0 && free_space_candidate == -1)
-            free_space_candidate = i;
+    if(offset >= inode->size)
+        return 0;
 
-        if(block[i] != 0 && free_space_candidate != -1)
-            free_space_candidate = -1;
+    if(offset + size > inode->size)
+        size = inode->size - offset;
 
-        i++;
+    if(inode_is_inline(inode,fs)){
+        memcpy(buf,inode->inline_data + offset,size);
+        COUNT_STAT(fs,bytes_read,size);
+        return size;
     }
 
-    if(free_space_candidate == -1)
-        return -1;
-
-    else
-        move_to_block(block_num,free_space_candidate,fs);
-
-    return 0;
+    file_readahead(ra,inode,offset,size,fs);
 
-}
+    while(bytes_read < size){
 
-/*
-Sposta la posizione all'interno del file all'ultimo blocco dati di un file a partire dal numero di inode, non dovesse essere presente un blocco dati libero,
-ne assegna uno. TODO  QUESTA VA USATA SOLO SE NON SI TROVA NESSUNO SPAZIO LIBERO NEI BLOCCHI GIA' OCCUPATI.
-IN TAL CASO SI VA ALLA FINE DELLO SPAZIO DISPONIBILE PER IL FILE CON QEUSTA FUNZIONE, AGGIUNGERE UNA FUNZIONI CHE TROVI SPAZIO
-*/
+        block = map_file_block_from(inode,index,&run,cursor);
 
-block_num_t reach_data_end(inode_num_t inode_num, filesystem_t* fs){
+        if(run == 0)    //Blocco non assegnato, viene letto come zeri
+            run = 1;
 
-    uint8_t i = 0;
-    inode_t inode = read_inode(inode_num,fs); 
-    uint16_t pos = ftell(fs->file);;
-    while(inode.index_vector[i] != 0){
+        chunk = (size_t)run * fs->block_size - offset_inside_block;
+        if(chunk > size - bytes_read)
+            chunk = size - bytes_read;
 
-        if(move_to_empty_space_in_block(inode.index_vector[i],0,fs) != -1)
-            break;
+        if(block == 0)
+            memset(buf + bytes_read,0,chunk);
         else
-            i++;
-    }
+            memcpy(buf + bytes_read,block_ptr(block,offset_inside_block,fs),chunk);
 
-    if(inode.index_vector[i] == 0){
-        assign_block_to_inode(inode_num,fs);
-        inode= read_inode(inode_num,fs);
-        move_to_block(inode.index_vector[i],0,fs);
-        pos = ftell(fs->file);
-    }
-    pos = ftell(fs->file);
-    return inode.index_vector[i];
+        bytes_read += chunk;
+        index += (offset_inside_block + chunk) / fs->block_size;
+        offset_inside_block = 0;
+    }        
+
+    COUNT_STAT(fs,bytes_read,bytes_read);
 
+    return bytes_read;
 }
 
 /*
-Assegna un inode ad un blocco, questo blocco conterrà gli indici di tutti i blocchi facenti parti del file
-rappresentato dall'inode
+    Legge al più size byte del file inode_num a partire da offset, vedi read_inode_data.
 */
-void assign_inode_to_block(inode_num_t inode, block_num_t block ,filesystem_t* fs){
-    
-    fs->inode_table[inode] = block;
-    fs->free_space_table[block] = 1;
-    sync_fs(fs);
+size_t read_file(char* buf ,inode_num_t inode_num ,off_t offset ,size_t size ,filesystem_t* fs){
+
+    inode_t* inode;
+    size_t bytes_read;
 
+    inode = lock_inode_data(inode_num,NULL,fs);
+    bytes_read = read_inode_data(inode,&inode_cache_entry_of(inode)->ra,NULL,buf,offset,size,fs);
+    unlock_inode(inode_num,fs);
+
+    return bytes_read;
 }
 
 /*
-Assegna un blocco libero ad un inode, imposta il blocco assegnato come occupato.
+    Equivalente di read_inode_data che non copia i dati: scrive in *runs (allocato con malloc, da liberare
+    dal chiamante) le porzioni del dispositivo che contengono al più size byte del file a partire da offset,
+    una per ogni extent toccato più una porzione di zeri per la parte non assegnata, così che il chiamante
+    possa leggerle direttamente dal file del dispositivo (fs->fd).
+    Le porzioni vanno lette prima che il file venga modificato, il chiamante deve tenere il lock dell'inode.
+    Ritorna il numero di porzioni, 0 oltre la fine del file, -1 se i dati si trovano nell'inode
+    (vanno letti con read_inode_data), -ENOMEM se non c'è memoria per le porzioni.
 */
-block_num_t assign_block_to_inode(inode_num_t inode,filesystem_t* fs){
-    
-    int8_t ret;
-    block_num_t block_num = get_and_set_free_block(fs);
-    inode_num_t inode_block_num = fs->inode_table[inode];
+int32_t map_inode_range(inode_t* inode, readahead_t* ra, map_cursor_t* cursor, off_t offset, size_t size, file_run_t** runs, filesystem_t* fs){
 
-    ret = move_to_empty_space_in_block(inode_block_num,1,fs);
-    
-    if(ret == -1) //Il blocco è pieno 
-        return 0;
+    uint32_t index = offset / fs->block_size;
+    uint32_t offset_inside_block = offset % fs->block_size;
+    block_num_t block;
+    uint32_t run;
+    size_t mapped = 0;
+    size_t chunk;
+    int32_t count = 0;
 
-    fwrite(&block_num,sizeof(block_num_t),1,fs->file);
-    fflush(fs->file);
-    return block_num;
-}
+    *runs = NULL;
 
+    if(inode_is_inline(inode,fs))
+        return -1;
 
-uint32_t block_free_space_left(block_num_t block_num,filesystem_t* fs){
-    
-    uint32_t pos = ftell(fs->file);
-    uint32_t space_left =  BLOCK_SIZE*(block_num + 1) - pos;
+    if(offset >= inode->size)
+        return 0;
 
-    return space_left;
+    if(offset + size > inode->size)
+        size = inode->size - offset;
 
-}
+    file_readahead(ra,inode,offset,size,fs);
+    *runs = malloc(sizeof(file_run_t) * (inode->extent_count + 1));   //Gli extent toccati ed al più una porzione non assegnata
 
+    if(*runs == NULL)
+        return -ENOMEM;
 
-/*----------------------------------------*/
+    while(mapped < size){
 
-/*Gestione Filesystem*/
+        block = map_file_block_from(inode,index,&run,cursor);
 
-void sync_fs(filesystem_t* fs){
-    
-    sync_inode_table(fs);
-    sync_freespace_table(fs);
-    fflush(fs->file);
-}
+        if(block == 0){     //Dopo l'ultimo extent il resto del file non è assegnato
+            (*runs)[count].offset = -1;
+            (*runs)[count++].size = size - mapped;
+            break;
+        }
 
+        chunk = (size_t)run * fs->block_size - offset_inside_block;
+        if(chunk > size - mapped)
+            chunk = size - mapped;
 
-filesystem_t* init_fs(filesystem_t** fs){
-    
-    filesystem_t* new_fs = malloc(sizeof(filesystem_t));
-    new_fs->free_space_table = init_freespace_table();
-    new_fs->inode_table = init_inode_table();
-    new_fs->file = load_fs("FS");
-    new_fs->open_file = NULL;
-    format_fs(new_fs->file);
-
-    if(new_fs->inode_table == NULL || new_fs->free_space_table == NULL)
-        return NULL;
+        (*runs)[count].offset = (off_t)block * fs->block_size + offset_inside_block;
+        (*runs)[count++].size = chunk;
 
-    sync_fs(new_fs);
-    *fs = new_fs;
+        mapped += chunk;
+        index += (offset_inside_block + chunk) / fs->block_size;
+        offset_inside_block = 0;
+    }
 
-    return new_fs;
+    COUNT_STAT(fs,bytes_read,size);
 
+    return count;
 }
 
+/*
+    Porzioni del dispositivo con al più size byte del file inode_num a partire da offset, vedi map_inode_range.
+    Il lock dell'inode viene rilasciato al ritorno.
+*/
+int32_t map_file_range(inode_num_t inode_num, off_t offset, size_t size, file_run_t** runs, filesystem_t* fs){
 
-/*---------------------------*/
-
-
-/*Manipolazione dei file*/
-
-int8_t sync_new_file(file_t* file, filesystem_t* fs){
-    
-    inode_num_t inode_num = get_free_inode_number(fs);
-    block_num_t block_num = get_and_set_free_block(fs);
-
-    if(block_num == 0)
-        return -1;
+    inode_t* inode;
+    int32_t count;
 
-    file->inode_num = inode_num;
+    inode = lock_inode_data(inode_num,NULL,fs);
+    count = map_inode_range(inode,&inode_cache_entry_of(inode)->ra,NULL,offset,size,runs,fs);
+    unlock_inode(inode_num,fs);
 
-    assign_inode_to_block(inode_num, block_num, fs);
-    move_to_block(block_num,0,fs);
-    fwrite(&(file->mode) ,sizeof(mode_t),1,fs->file); //salva sul dispositivo di memorizzazione i metadati del file
-    fwrite(&(file->size) ,sizeof(size_t),1,fs->file);
-    fflush(fs->file); 
-    sync_fs(fs);
-    
-    return block_num;
+    return count;
 }
 
+/*
 
-void update_file_size(inode_num_t file_inode ,size_t new_size,filesystem_t* fs){
-    
-    inode_num_t inode_block = fs->inode_table[file_inode];
-    move_to_block(inode_block,SIZE_OFFSET_IN_INODE,fs);
-    fwrite(&new_size,sizeof(size_t),1,fs->file);
+Gestione dei file aperti
 
-}
+*/
 
-void update_file_mode(inode_num_t file_inode ,mode_t new_mode,filesystem_t* fs){
-    
-    inode_num_t inode_block = fs->inode_table[file_inode];
-    move_to_block(inode_block,MODE_OFFSET_IN_INODE,fs);
-    fwrite(&new_mode,sizeof(mode_t),1,fs->file);
+/*
+    Apre il file inode_num: il suo elemento nella cache degli inode non verrà rimosso fino a close_inode.
+    Ritorna NULL se non c'è memoria.
+*/
+open_file_t* open_inode(inode_num_t inode_num, filesystem_t* fs){
 
-}
+    open_file_t* file = calloc(1,sizeof(open_file_t));
+    inode_cache_entry_t* entry;
+    inode_t* inode;
 
+    if(file == NULL)
+        return NULL;
 
-void init_root_dir(filesystem_t* fs){
+    lock_inode(inode_num,0,fs);
+    inode = get_inode(inode_num,fs);
 
-    file_t new_file;
+    if(inode == NULL){
+        unlock_inode(inode_num,fs);
+        free(file);
+        return NULL;
+    }
 
-    new_file.mode = S_IFDIR | 0644;
-    new_file.size = 0;
-    sync_new_file(&new_file,fs);
+    entry = inode_cache_entry_of(inode);
+    pthread_mutex_lock(&fs->inode_cache->lock);
+    entry->pins++;
+    pthread_mutex_unlock(&fs->inode_cache->lock);
+    unlock_inode(inode_num,fs);
 
-}
+    file->inode_num = inode_num;
+    file->entry = entry;
+    pthread_mutex_init(&file->cursor_lock,NULL);
+    __atomic_fetch_add(&fs->open_files,1,__ATOMIC_RELAXED);
 
-void sync_test_files(filesystem_t* fs,uint8_t num){
+    return file;
+}
 
-    file_t new_file;
+/*
+    Rilascia un riferimento all'elemento della cache preso da open_inode o flush_write_buffers,
+    liberandolo se era l'ultimo e l'inode è stato liberato nel frattempo. Con l'ultimo riferimento
+    vengono liberati anche i blocchi trattenuti da release_file_extent.
+*/
+void unpin_inode(inode_cache_entry_t* entry, filesystem_t* fs){
 
-    new_file.mode = S_IFREG | 0644;
-    new_file.size = 0;
+    extent_t* held = NULL;
+    uint32_t held_count = 0;
 
-    for(int i = 0; i < num ; i++){
+    pthread_mutex_lock(&fs->inode_cache->lock);
+    entry->pins--;
 
-    snprintf(new_file.name,256,"Test_%d",i);
-    new_file_to_dir(new_file,"/",fs);
+    if(entry->pins == 0){
+        held = entry->held;
+        held_count = entry->held_count;
+        entry->held = NULL;
+        entry->held_count = 0;
+        __atomic_store_n(&entry->mapped,0,__ATOMIC_RELAXED);
 
+        if(entry->released)
+            free(entry);
     }
 
-}
+    pthread_mutex_unlock(&fs->inode_cache->lock);
 
-void sync_test_dir(filesystem_t* fs,uint8_t num){
+    for(uint32_t i = 0; i < held_count; i++)
+        release_extent(held[i].start,held[i].length,fs);
 
-    file_t new_file;
+    free(held);
+}
 
-    new_file.mode = S_IFDIR | 0755;
-    new_file.size = 0;
+/*
+    Scrive sul dispositivo il buffer di scrittura del file aperto, vedi flush_write_buffer.
+    Ritorna 0, -ENOSPC se una scrittura del buffer dall'ultima chiamata non è riuscita.
+*/
+int8_t flush_open_file(open_file_t* file, filesystem_t* fs){
 
-    for(int i = 0; i < num ; i++){
+    int8_t ret = 0;
 
-    snprintf(new_file.name,256,"DirTest_%d",i);
-    new_file_to_dir(new_file,"/",fs);
+    lock_inode(file->inode_num,1,fs);
 
+    if(!file->entry->released){
+        flush_write_buffer(file->inode_num,&file->entry->inode,&file->cursor,fs);
+        ret = file->entry->write_error;
+        file->entry->write_error = 0;
     }
 
+    unlock_inode(file->inode_num,fs);
+    end_metadata_op(fs);
+
+    return ret;
 }
 
+/*
+    Scrive sul dispositivo i buffer di scrittura di tutti i file, usata alla sincronizzazione
+    e quando i dati in attesa superano WRITE_BUFFER_TOTAL_MAX.
+    I buffer esistono solo per i file aperti, i cui elementi sono in cache; vengono trattenuti
+    con un riferimento così da poterli scrivere senza il lock della cache. Non va chiamata tenendo il lock di un inode.
+*/
+void flush_write_buffers(filesystem_t* fs){
+
+    inode_cache_t* cache = fs->inode_cache;
+    inode_cache_entry_t** pinned;
+    inode_cache_entry_t* entry;
+    uint32_t count = 0;
 
+    pthread_mutex_lock(&cache->lock);
+    pinned = malloc(sizeof(inode_cache_entry_t*) * (cache->count + 1));
 
-uint8_t is_inode_full(inode_num_t dir_inode_num, filesystem_t* fs){
-    
-    uint8_t i = 0;
-    inode_t inode = read_inode(dir_inode_num,fs); 
-    
-    while(i < MAX_BLOCKS_PER_NODE && inode.index_vector[i] != 0){
-        i++;
+    for(entry = cache->lru_head; entry != NULL && pinned != NULL; entry = entry->lru_next){
+        if(entry->pins > 0){
+            entry->pins++;
+            pinned[count++] = entry;
+        }
     }
 
-    if(inode.index_vector[i] != 0 && move_to_empty_space_in_block(inode.index_vector[i],0,fs) == -1)
-        
-        return 1;
+    pthread_mutex_unlock(&cache->lock);
 
-    else 
+    for(uint32_t i = 0; i < count; i++){
 
-        return 0;
-    
-}
+        lock_inode(pinned[i]->inode_num,1,fs);
 
-int8_t new_file_to_dir(file_t file,const char* path , filesystem_t* fs){
+        if(!pinned[i]->released)
+            flush_write_buffer(pinned[i]->inode_num,&pinned[i]->inode,NULL,fs);
 
-    inode_num_t dir_inode_num;
-    uint8_t ret;
+        unlock_inode(pinned[i]->inode_num,fs);
+        unpin_inode(pinned[i],fs);
+    }
 
-    if(strcmp(path,"/") == 0)
-        dir_inode_num = 0;
-    else
-        dir_inode_num = parent_dir_inode_from_path(path,fs);
-             
+    free(pinned);
+}
 
-    ret = is_inode_full(dir_inode_num,fs);
-    
-    if(ret == 1)
-        return -1;
+/*
+    Chiude il file aperto con open_inode dopo averne scritto il buffer di scrittura, liberando
+    l'elemento della cache se il file è stato liberato nel frattempo.
+*/
+void close_inode(open_file_t* file, filesystem_t* fs){
 
-    sync_new_file(&file,fs);
-    write_file_info(file,dir_inode_num,fs);
-    fflush(fs->file);
+    flush_open_file(file,fs);
+    unpin_inode(file->entry,fs);
 
-    return 0;
+    pthread_mutex_destroy(&file->cursor_lock);
+    free(file);
+    __atomic_fetch_sub(&fs->open_files,1,__ATOMIC_RELAXED);
 }
 
-uint8_t read_dir_entries(file_t* dir ,inode_t inode , filesystem_t* fs){
+/*
+    Lettura dal file aperto, vedi read_inode_data. Ritorna 0 se il file è stato liberato.
+*/
+size_t read_open_file(open_file_t* file, char* buf, off_t offset, size_t size, filesystem_t* fs){
 
-    //TODO
-    block_num_t new_block = inode.index_vector[0];
-    uint32_t k = 0;
-    uint32_t last_entry_num = 0;
+    map_cursor_t cursor;
+    size_t bytes_read = 0;
 
-    uint8_t inode_num_bytes[sizeof(inode_num_t)];
-    uint8_t file_name_lenght_bytes[sizeof(file_name_lenght_t)];
-    uint8_t byte = 0;
-    
-    if(inode.index_vector[last_entry_num] == 0)
-        return 0;      
-    move_to_block(new_block,0,fs);  
+    if(lock_inode_data(file->inode_num,file,fs) != NULL){
 
-    while(inode.index_vector[k] != 0 && last_entry_num < MAX_DIR_ENTRIES){
+        pthread_mutex_lock(&file->cursor_lock);
+        cursor = file->cursor;
+        pthread_mutex_unlock(&file->cursor_lock);
 
-        for(uint8_t j = 0; j < sizeof(inode_num_t); j++){
+        bytes_read = read_inode_data(&file->entry->inode,&file->ra,&cursor,buf,offset,size,fs);
 
-            if(block_free_space_left(new_block, fs) == 0){
-                k++;
-                new_block = inode.index_vector[k];
-                move_to_block(new_block,0,fs);
-            }
+        pthread_mutex_lock(&file->cursor_lock);
+        file->cursor = cursor;
+        pthread_mutex_unlock(&file->cursor_lock);
+    }
 
-            fread(&byte, 1,1,fs->file);    
-            inode_num_bytes[j] = byte & (0xff >> j * 8); 
-        }
+    unlock_inode(file->inode_num,fs);
 
-        memcpy(&dir->entries[last_entry_num].inode_index, inode_num_bytes, sizeof(inode_num_t));
+    return bytes_read;
+}
 
-        if(dir->entries[last_entry_num].inode_index == 0)
-            break;
-            
+/*
+    Scrittura nel file aperto: i dati vengono copiati nel buffer di scrittura se possibile (buffer_write),
+    altrimenti il buffer viene scritto e si riprova con un buffer nuovo, oppure si scrive direttamente
+    sul dispositivo, vedi write_inode_data. Ritorna 0 se il file è stato liberato.
+*/
+size_t write_open_file(open_file_t* file, const char* buf, size_t size, off_t offset, filesystem_t* fs){
 
-        for(uint8_t j = 0; j < sizeof(file_name_lenght_t); j++){
+    inode_t* inode = &file->entry->inode;
+    size_t written = 0;
 
-            if(block_free_space_left(new_block, fs) == 0){
-                k++;
-                new_block = inode.index_vector[k];
-                move_to_block(new_block,0,fs);
-            }
+    lock_inode(file->inode_num,1,fs);     //Con il lock in scrittura nessun'altra operazione usa la posizione
+
+    if(!file->entry->released){
 
-            fread(&byte, 1,1,fs->file);    
-            file_name_lenght_bytes[j] = byte & (0xff >> j * 8); 
+        if(buffer_write(inode,buf,size,offset,fs) == 0)
+            written = size;
+        else{
+            flush_write_buffer(file->inode_num,inode,&file->cursor,fs);
+
+            if(buffer_write(inode,buf,size,offset,fs) == 0)
+                written = size;
+            else
+                written = write_inode_data(file->inode_num,inode,&file->cursor,buf,size,offset,fs);
         }
+    }
 
-        memcpy(&dir->entries[last_entry_num].name_lenght, file_name_lenght_bytes, sizeof(file_name_lenght_t));
-        
-        for(uint32_t i = 0; i < (dir->entries[last_entry_num].name_lenght); i++){
+    unlock_inode(file->inode_num,fs);
+    end_metadata_op(fs);
 
-            if(block_free_space_left(new_block, fs) == 0){
-                k++;
-                new_block = inode.index_vector[k];
-                move_to_block(new_block,0,fs);
-            }
+    if(__atomic_load_n(&fs->buffered_bytes,__ATOMIC_RELAXED) > WRITE_BUFFER_TOTAL_MAX)
+        flush_write_buffers(fs);
 
-            fread(&(dir->entries[last_entry_num].name[i]), 1,1,fs->file);
-            dir->entries[last_entry_num].name[i+1] = '\0';
-        }
-    
-        last_entry_num++;
-    }        
-    dir->entries[last_entry_num].inode_index = 0;
-    return 1;
+    return written;
 }
 
 /*
+    Porzioni del dispositivo con i dati del file aperto, vedi map_inode_range. Ritorna 0 se il file è stato liberato.
+    I blocchi restituiti non vengono riassegnati finché il file resta aperto, vedi release_file_extent.
+*/
+int32_t map_open_file_range(open_file_t* file, off_t offset, size_t size, file_run_t** runs, filesystem_t* fs){
 
-Tokenizzazione path e lookup
+    map_cursor_t cursor;
+    int32_t count = 0;
 
-*/
+    *runs = NULL;
 
+    if(lock_inode_data(file->inode_num,file,fs) != NULL){
 
-uint32_t tokenize_path(const char* path, char** tokens_buffer){
-    
-    char path_buffer[1000];
-    strcpy(path_buffer,path);
-    int n_tokens = 0;
-    char* saveptr; //Usato per garantire la rientranza di strtok_r
-    char* path_token = strtok_r(path_buffer,"/",&saveptr);
-    
-    while(path_token != NULL){
-        
-        strcpy(tokens_buffer[n_tokens],path_token);
-        path_token = strtok_r(NULL,"/",&saveptr);
-        n_tokens++;
+        pthread_mutex_lock(&file->cursor_lock);
+        cursor = file->cursor;
+        pthread_mutex_unlock(&file->cursor_lock);
+
+        count = map_inode_range(&file->entry->inode,&file->ra,&cursor,offset,size,runs,fs);
+
+        if(count > 0)       //I blocchi vengono letti dopo il rilascio del lock, vedi release_file_extent
+            __atomic_store_n(&file->entry->mapped,1,__ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&file->cursor_lock);
+        file->cursor = cursor;
+        pthread_mutex_unlock(&file->cursor_lock);
     }
 
-    return n_tokens;
+    unlock_inode(file->inode_num,fs);
+
+    return count;
 }
 
 
-/*
-Ritorna il numero di inode di un elemento all'interno di una directory
-dato il nome.
-*/
-uint8_t get_dir_element_inode(char* name ,inode_num_t inode_num,filesystem_t* fs){
-    
-    file_t dir = {0};
-    inode_t dir_inode = read_inode(inode_num,fs);
-    uint32_t i = 0;
-    int8_t ret = read_dir_entries(&dir,dir_inode,fs);
-    
-    if(ret == 0)
-        return 0;
 
-    while(i < MAX_DIR_ENTRIES && (strcmp(dir.entries[i].name,name) != 0)){
-        i++;
-    }
 
-    if(i < MAX_DIR_ENTRIES && strcmp(dir.entries[i].name, name) == 0)
-        return dir.entries[i].inode_index;
-    else
-        return 0;
 
-}
+
 
 /*
-Dato il path ritorna l'inode del file individuato.
+    Porta il file a size byte. Accorciandolo vengono liberati i blocchi oltre la nuova fine e azzerata
+    la parte dell'ultimo blocco che la segue, così che un'estensione successiva legga zeri;
+    allungandolo i nuovi byte vengono letti come zeri senza assegnare blocchi, tranne quando i dati
+    nell'inode non vi entrano più e vanno spostati in un blocco. Il chiamante deve tenere il lock
+    dell'inode in scrittura e chiamare end_metadata_op dopo averlo rilasciato.
+    Ritorna 0, -EISDIR per una directory, -ENOSPC se non è stato possibile assegnare il blocco.
 */
-inode_num_t inode_from_path(const char* path,filesystem_t* fs){
-	
+int8_t resize_inode(inode_num_t inode_num, inode_t* inode, uint64_t size, filesystem_t* fs){
 
-	if(strcmp(path,"/") == 0)
-		return 0;
+    uint32_t tail;
+    block_num_t block;
+    uint8_t was_inline;
 
-    char* tokens[500];
-    uint8_t i = 0;
-    inode_num_t inode_num;
+    if(S_ISDIR(inode->mode))
+        return -EISDIR;
 
-    for(int i = 0 ; i<500; i++)
-        tokens[i] = malloc(500);
+    flush_write_buffer(inode_num,inode,NULL,fs);
+    was_inline = inode_is_inline(inode,fs);
 
-    uint32_t n_tokens = tokenize_path(path,tokens);
+    if(inode->extent_count == 0 && inode->size <= INLINE_DATA_MAX(fs) && size <= INLINE_DATA_MAX(fs)){      //I dati restano nell'inode
 
-    if(n_tokens == 1){
-        inode_num = get_dir_element_inode(tokens[0],0,fs);
-        for(int j = 0 ; j<500; j++)
-            free(tokens[j]);
-        return inode_num;  
+        if(size > inode->size)
+            memset(inode->inline_data + inode->size,0,size - inode->size);
     }
-        
+    else if(inode_is_inline(inode,fs)){
 
+        if(grow_inode(inode_num,1,fs) == -1)
+            return -ENOSPC;
+    }
+    else if(size < inode->size){
 
-    inode_num_t last_element_inode = get_dir_element_inode(tokens[i++],0,fs);
+        shrink_inode(inode_num,(size + fs->block_size - 1) / fs->block_size,fs);
+        tail = size % fs->block_size;
+        block = map_file_block(inode,size / fs->block_size,NULL);
 
-    if(last_element_inode == 0){
-        for(int j = 0 ; j<500; j++)
-            free(tokens[j]);
-        return 0;
+        if(tail != 0 && block != 0)
+            memset(block_ptr(block,tail,fs),0,fs->block_size - tail);
     }
 
-    n_tokens--;
-    
-    while(n_tokens>0){
-        last_element_inode = get_dir_element_inode(tokens[i++],last_element_inode,fs);
-        
-        if(last_element_inode == 0){
-            for(int j = 0 ; j<500; j++)
-                free(tokens[j]);
-            return 0;
-        }
-        n_tokens--;
-    }
+    inode->size = size;
 
-    for(int j = 0 ; j<500; j++)
-        free(tokens[j]);
+    if(!was_inline && inode_is_inline(inode,fs))      //L'unione conteneva gli extent, non dati del file
+        memset(inode->inline_data,0,size);
 
-   return last_element_inode;
-}
+    memset(&inode_cache_entry_of(inode)->ra,0,sizeof(readahead_t));
+    mark_inode_dirty(inode_num,fs);
 
+    return 0;
+}
 
 /*
-Dato un path ritorna la directory che contiene il file individuato dal path
-
+    Porta il file inode_num a size byte, vedi resize_inode. Ritorna -ENOMEM se non c'è memoria per l'inode.
 */
-inode_num_t parent_dir_inode_from_path(const char* path,filesystem_t* fs){
+int8_t truncate_file(inode_num_t inode_num, uint64_t size, filesystem_t* fs){
 
-    char* tokens[500];
-    uint8_t i = 0;
+    inode_t* inode;
+    int8_t ret = -ENOMEM;
 
-    for(int i = 0 ; i<500; i++)
-        tokens[i] = malloc(500);
+    lock_inode(inode_num,1,fs);
+    inode = get_inode(inode_num,fs);
 
-    uint32_t n_tokens = tokenize_path(path,tokens);
+    if(inode != NULL)
+        ret = resize_inode(inode_num,inode,size,fs);
 
-    if(n_tokens <= 1)
-        return 0;
+    unlock_inode(inode_num,fs);
+    end_metadata_op(fs);
 
-    inode_num_t last_file = get_dir_element_inode(tokens[i++],0,fs);
+    return ret;
+}
 
-    if(last_file == 0)
-        return 0;
+/*
+    Porta il file aperto a size byte, vedi resize_inode. Ritorna -ESTALE se il file è stato liberato.
+*/
+int8_t truncate_open_file(open_file_t* file, uint64_t size, filesystem_t* fs){
 
-    n_tokens--;
-    
-    while(n_tokens>1){
-        last_file = get_dir_element_inode(tokens[i++],last_file,fs);
-        
-        if(last_file == 0)
-            return 0;
+    int8_t ret = -ESTALE;
 
-        n_tokens--;
-    }
+    lock_inode(file->inode_num,1,fs);
 
-    for(int j = 0 ; j<500; j++)
-        free(tokens[j]);
+    if(!file->entry->released)
+        ret = resize_inode(file->inode_num,&file->entry->inode,size,fs);
 
-   return last_file;
+    unlock_inode(file->inode_num,fs);
+    end_metadata_op(fs);
 
+    return ret;
 }
 
-char* file_name_from_path(const char* path){
-    
-    char* file_name = malloc(MAX_FILE_NAME);
+/*
+    Risolve la directory che contiene l'elemento individuato da path ed in name scrive il puntatore
+    al nome dell'elemento all'interno di path.
+    Ritorna 0, -ENOENT se la directory non esiste, -ENOTDIR se non è una directory,
+    -ENOMEM se non c'è memoria per il suo inode.
+*/
+int8_t resolve_parent(const char* path, inode_num_t* parent, const char** name, filesystem_t* fs){
 
-    if(strcmp(path,"/") == 0)
-		return "/";
+    const char* last_slash = strrchr(path,'/');
+    inode_t* inode;
+    mode_t mode;
 
-    char* tokens[500];
+    if(last_slash == NULL || last_slash[1] == '\0')
+        return -ENOENT;
 
-    for(int i = 0 ; i<500; i++)
-        tokens[i] = malloc(500);
+    *name = last_slash + 1;
+    *parent = parent_dir_inode_from_path(path,fs);
 
-    uint16_t n_tokens = tokenize_path(path,tokens);
+    if(*parent == 0 && last_slash != path)     //0 è la root solo se il path non ha altre componenti
+        return -ENOENT;
 
-    strcpy(file_name,tokens[n_tokens - 1]);
+    lock_inode(*parent,0,fs);
+    inode = get_inode(*parent,fs);
+    mode = inode != NULL ? inode->mode : 0;
+    unlock_inode(*parent,fs);
 
-    for(int j = 0 ; j<500; j++)
-        free(tokens[j]);
+    if(inode == NULL)
+        return -ENOMEM;
 
-   return file_name;
+    return S_ISDIR(mode) ? 0 : -ENOTDIR;
 }
- 
-/*-------------------------*/
-
 
-/*Operazioni */
+/*
+    Rimuove l'elemento individuato da path e ne libera inode e blocchi: un file se dir vale 0,
+    una directory vuota altrimenti.
+    Ritorna 0 o un errore: -ENOENT, -ENOTDIR, -EISDIR, -ENOTEMPTY, -ENOMEM.
+*/
+int8_t remove_file(const char* path, uint8_t dir, filesystem_t* fs){
 
-size_t write_to_file(inode_num_t inode_num,const char* buf, size_t size,off_t offset,filesystem_t* fs){
+    inode_num_t parent;
+    inode_num_t child;
+    const char* name;
+    mode_t mode;
+    int8_t ret = resolve_parent(path,&parent,&name,fs);
 
-    uint8_t i = 0;
-    uint32_t j = 0;
-    uint16_t block_offset = offset / BLOCK_SIZE;
-    uint8_t offset_inside_block = offset % BLOCK_SIZE;
-    inode_t inode = read_inode(inode_num,fs);
-    block_num_t block;
+    if(ret != 0)
+        return ret;
 
-    while(i < block_offset){
+    /* L'elemento viene cercato senza lock, se nel frattempo è stato rimosso o sostituito si riprova */
+    while(1){
 
-        if(inode.index_vector[i] == 0)
-            inode.index_vector[i] = assign_block_to_inode(inode_num,fs);
-        i++;
+        child = get_dir_element_inode(name,strlen(name),parent,fs);
 
-    }
-    
-    if(inode.index_vector[i] == 0)   
-        inode.index_vector[i] = assign_block_to_inode(inode_num,fs);
+        if(child == 0)
+            return -ENOENT;
 
-    block = inode.index_vector[i];
-    move_to_block(block,offset_inside_block,fs);
+        lock_inode_pair(parent,child,fs);
 
-    while(j < size){
+        if(dir_lookup(parent,name,strlen(name),fs) == child)
+            break;
 
-        block = reach_new_block_if_full(inode_num,block,fs);
-        fwrite(buf + j,1,1,fs->file);
-        j++;
+        unlock_inode_pair(parent,child,fs);
+        name_cache_invalidate(parent,name,fs->dentry_cache);
+    }
 
+    mode = get_inode(child,fs)->mode;
+
+    if(dir && !S_ISDIR(mode))
+        ret = -ENOTDIR;
+    else if(!dir && S_ISDIR(mode))
+        ret = -EISDIR;
+    else if(dir && !dir_is_empty(child,fs))
+        ret = -ENOTEMPTY;
+    else if((ret = remove_file_info(name,parent,fs)) == 0){
+        invalidate_dir_entry(parent,name,fs);
+        free_inode(child,fs);
     }
 
-    size_t new_size = (inode.size - (inode.size - offset)) + size;
-    update_file_size(inode_num,new_size,fs);
+    unlock_inode_pair(parent,child,fs);
+
+    if(ret == 0)
+        end_metadata_op(fs);
 
-    fflush(fs->file);
-    return new_size;
+    return ret;
 }
 
-void read_file(char* buf ,inode_num_t inode_num ,off_t offset ,filesystem_t* fs){
+/*
+    Sposta l'elemento from in to cambiando solo le entry delle directory, qualunque sia la dimensione dei dati.
+    Un elemento già presente in to viene sostituito nella sua entry e poi liberato, se noreplace vale 1
+    la rinomina fallisce. Una directory può sostituire solo una directory vuota.
+    Ritorna 0 o un errore: -ENOENT, -ENOTDIR, -EISDIR, -ENOTEMPTY, -EEXIST, -EINVAL (directory spostata
+    al proprio interno), -ENAMETOOLONG, -ENOSPC, -ENOMEM.
+*/
+int8_t rename_file(const char* from, const char* to, uint8_t noreplace, filesystem_t* fs){
+
+    inode_num_t locked[4];
+    inode_num_t from_parent;
+    inode_num_t to_parent;
+    inode_num_t src;
+    inode_num_t dst;
+    const char* from_name;
+    const char* to_name;
+    size_t from_len = strlen(from);
+    mode_t src_mode;
+    mode_t dst_mode;
+    int8_t ret;
+
+    if(strncmp(to,from,from_len) == 0 && to[from_len] == '/')
+        return -EINVAL;
 
-    //TODO? 
-    inode_t inode = read_inode(inode_num,fs);
-    block_num_t block = inode.index_vector[0];
-    uint16_t block_offset = offset / BLOCK_SIZE;
-    uint8_t offset_inside_block = offset % BLOCK_SIZE;
+    ret = resolve_parent(from,&from_parent,&from_name,fs);
+    if(ret == 0)
+        ret = resolve_parent(to,&to_parent,&to_name,fs);
+    if(ret != 0)
+        return ret;
 
+    if(strlen(to_name) > DIR_MAX_NAME(fs))
+        return -ENAMETOOLONG;
 
-    move_to_block(block,offset_inside_block,fs);  
+    /* Come in remove_file gli elementi vengono cercati senza lock e controllati dopo averli presi */
+    while(1){
 
-    while(inode.index_vector[block_offset] != 0){
-        
-        for(uint32_t i = 0; i < inode.size ; i++){
+        src = get_dir_element_inode(from_name,strlen(from_name),from_parent,fs);
 
-            if(block_free_space_left(block, fs) == 0){
-                block = inode.index_vector[block_offset];
-                move_to_block(block,0,fs);
-            }
-            fread(buf + i, 1,1,fs->file);
-        }
-        block_offset++;
-    }        
+        if(src == 0)
+            return -ENOENT;
 
-}
+        dst = get_dir_element_inode(to_name,strlen(to_name),to_parent,fs);
+
+        locked[0] = from_parent;
+        locked[1] = to_parent;
+        locked[2] = src;
+        locked[3] = dst;
+        lock_inodes(locked,dst != 0 ? 4 : 3,fs);
+
+        if(dir_lookup(from_parent,from_name,strlen(from_name),fs) == src && dir_lookup(to_parent,to_name,strlen(to_name),fs) == dst)
+            break;
 
+        unlock_inodes(locked,dst != 0 ? 4 : 3,fs);
+        name_cache_invalidate(from_parent,from_name,fs->dentry_cache);
+        name_cache_invalidate(to_parent,to_name,fs->dentry_cache);
+    }
+
+    src_mode = get_inode(src,fs)->mode;
+    dst_mode = (dst != 0) ? get_inode(dst,fs)->mode : 0;
+
+    if(dst == src)      //Stesso nome nella stessa directory
+        ret = 0;
+    else if(dst != 0 && noreplace)
+        ret = -EEXIST;
+    else if(dst != 0 && S_ISDIR(src_mode) && !S_ISDIR(dst_mode))
+        ret = -ENOTDIR;
+    else if(dst != 0 && !S_ISDIR(src_mode) && S_ISDIR(dst_mode))
+        ret = -EISDIR;
+    else if(dst != 0 && S_ISDIR(dst_mode) && !dir_is_empty(dst,fs))
+        ret = -ENOTEMPTY;
+    else if(dst != 0){
+
+        ret = replace_file_info(to_name,src,to_parent,fs);
+
+        if(ret == 0 && (ret = remove_file_info(from_name,from_parent,fs)) != 0)
+            replace_file_info(to_name,dst,to_parent,fs);        //Il blocco è già nella transazione, non fallisce
+        else if(ret == 0)
+            free_inode(dst,fs);
+    }
+    else{
+        ret = insert_file_info(to_name,src,to_parent,fs);
 
+        if(ret == 0 && (ret = remove_file_info(from_name,from_parent,fs)) != 0)
+            remove_file_info(to_name,to_parent,fs);     //I blocchi toccati dall'inserimento sono già nella transazione
+    }
 
+    if(ret == 0 && dst != src){
+        invalidate_dir_entry(from_parent,from_name,fs);
+        invalidate_dir_entry(to_parent,to_name,fs);
+    }
 
+    unlock_inodes(locked,dst != 0 ? 4 : 3,fs);
 
+    if(ret == 0)
+        end_metadata_op(fs);
 
+    return ret;
+}
 
 /*-----------------------*/
\ No newline at end of file
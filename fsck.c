@@ -0,0 +1,1098 @@
+/*
+    Controllo di consistenza (fsck) di un'immagine del file system, usa direttamente filesystem.h
+    e va eseguito con il file system smontato.
+
+    Dopo il replay del journal gli inode vengono esaminati da più thread, ognuno su gruppi di
+    FSCK_CHUNK numeri di inode consecutivi. Ogni blocco raggiunto da un inode (il blocco dell'inode,
+    i suoi extent ed i blocchi di overflow delle directory) viene segnato in una bitmap con un'operazione
+    atomica: un bit già a 1 indica un blocco assegnato due volte. Le entry delle directory vengono
+    lette bucket per bucket e contate per inode destinazione.
+    Al termine la bitmap dei blocchi raggiunti viene confrontata una parola alla volta con quella
+    dello spazio libero ed i contatori dei riferimenti indicano gli inode senza nome o con più nomi:
+    non c'è mai una ricerca per path.
+
+    Con --repair i problemi trovati vengono corretti con le funzioni del file system, all'interno
+    di transazioni del journal, ed il controllo viene ripetuto: una correzione può lasciarne altre
+    da fare (gli elementi di una directory eliminata restano senza nome, i blocchi tolti ad un file
+    restano segnati occupati) che vengono corrette alla passata successiva.
+
+    Senza --repair l'immagine viene montata in sola lettura (vedi mount_fs_mode): il journal
+    di un file system non smontato correttamente viene riapplicato solo in memoria ed il file non viene scritto.
+
+    Uso: ./fsck [--image=PATH] [--repair] [--threads=N]
+
+    Codice di uscita (come e2fsck): 0 nessun problema, 1 problemi corretti,
+    4 problemi non corretti, 8 immagine non valida o errore di esecuzione.
+*/
+
+#include <time.h>
+#include "filesystem.h"
+
+#define FSCK_CHUNK 1024             //Inode assegnati ad un thread alla volta
+#define FSCK_MAX_PASSES 5
+#define FSCK_MAX_THREADS 64
+
+#define FSCK_CLEAN 0
+#define FSCK_CORRECTED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+/* Problemi di un inode, uno o più bit di fsck_t.damage */
+#define FSCK_BAD_INODE 0x01         //Blocco dell'inode fuori dall'area dati o tipo non valido, l'inode va eliminato
+#define FSCK_BAD_DIR 0x02           //Directory con extent o intestazione dell'indice non validi, va eliminata
+#define FSCK_BAD_EXTENTS 0x04       //File con extent non validi, va accorciato al primo extent non valido
+#define FSCK_DIR_ENTRIES 0x08       //Directory con entry non valide, catene interrotte o intestazione non aggiornata
+#define FSCK_ORPHAN 0x10            //Inode assegnato ma senza nome in nessuna directory
+
+#define FSCK_DROP (FSCK_BAD_INODE | FSCK_BAD_DIR)
+
+static struct fsck_options{
+
+    const char* image;
+    uint32_t repair;
+    uint32_t threads;
+
+}options = {
+    .image = "FS",
+    .repair = 0,
+    .threads = 0
+};
+
+/*
+    Stato di una passata di controllo, condiviso dai thread.
+    claimed e shared hanno una parola per ogni parola della bitmap dello spazio libero,
+    refs e damage un elemento per inode.
+*/
+typedef struct fsck{
+
+    filesystem_t* fs;
+    uint64_t* reserved;         //Blocchi sempre occupati: superblocco, tabelle, journal e bit oltre la fine del dispositivo
+    uint64_t* claimed;          //Blocchi raggiunti da almeno un inode
+    uint64_t* shared;           //Blocchi raggiunti più di una volta
+    uint32_t* refs;             //Entry di directory che indicano l'inode
+    uint8_t* damage;
+    inode_num_t next;           //Primo inode non ancora assegnato ad un thread
+
+    /* Contatori aggiornati atomicamente dai thread */
+    uint64_t dirs;
+    uint64_t entries;
+    uint64_t bad_entries;       //Entry con nome o hash non validi o nel bucket sbagliato
+    uint64_t dangling;          //Entry verso inode non assegnati
+
+    /* Risultati del confronto, calcolati al termine della scansione */
+    uint32_t inodes;
+    uint32_t dropped;
+    uint32_t truncated;
+    uint32_t damaged_dirs;
+    uint32_t orphans;
+    uint32_t multiref;
+    uint64_t invalid_refs;      //Entry verso inode da eliminare
+    uint64_t leaked;            //Blocchi segnati occupati che nessun inode raggiunge
+    uint64_t unmarked;          //Blocchi raggiunti ma segnati liberi
+    uint64_t shared_blocks;
+
+}fsck_t;
+
+static uint64_t now_ns(){
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+static int parse_options(int argc, char* argv[]){
+
+    for(int i = 1; i < argc; i++){
+
+        if(strncmp(argv[i],"--image=",8) == 0)
+            options.image = argv[i] + 8;
+        else if(strcmp(argv[i],"--repair") == 0)
+            options.repair = 1;
+        else if(strncmp(argv[i],"--threads=",10) == 0 && sscanf(argv[i] + 10,"%u",&options.threads) == 1)
+            continue;
+        else{
+            fprintf(stderr,"Opzione non riconosciuta: %s\n",argv[i]);
+            return -1;
+        }
+    }
+
+    if(options.threads == 0){
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        options.threads = (cpus > 0) ? cpus : 1;
+    }
+
+    if(options.threads > FSCK_MAX_THREADS)
+        options.threads = FSCK_MAX_THREADS;
+
+    return 0;
+
+}
+
+static uint8_t in_data_area(uint64_t block, filesystem_t* fs){
+
+    return block >= fs->sb.data_start && block < fs->sb.blocks_count;
+}
+
+/*
+    Segna come raggiunti length blocchi a partire da start, una parola alla volta.
+    I blocchi già raggiunti da un altro inode (o dallo stesso) vengono segnati in shared.
+*/
+static void claim_blocks(block_num_t start, uint32_t length, fsck_t* ck){
+
+    uint64_t end = (uint64_t)start + length;
+    uint64_t next;
+    uint64_t mask;
+    uint64_t previous;
+
+    for(uint64_t block = start; block < end; block = next){
+
+        next = (block / BITS_PER_WORD + 1) * BITS_PER_WORD;
+        if(next > end)
+            next = end;
+
+        mask = (next - block == BITS_PER_WORD) ? ~0ULL : ((1ULL << (next - block)) - 1) << (block % BITS_PER_WORD);
+        previous = __atomic_fetch_or(&ck->claimed[block / BITS_PER_WORD],mask,__ATOMIC_RELAXED);
+
+        if(previous & mask)
+            __atomic_fetch_or(&ck->shared[block / BITS_PER_WORD],previous & mask,__ATOMIC_RELAXED);
+    }
+
+}
+
+/*
+    Durante la scansione la transazione è sempre vuota (il montaggio ed ogni riparazione terminano con
+    un commit): i blocchi vengono letti direttamente dalla mappatura, senza il lock del journal
+    che meta_ptr prende ad ogni accesso.
+*/
+static block_num_t raw_overflow(block_num_t block, filesystem_t* fs){
+
+    block_num_t overflow;
+    memcpy(&overflow,block_ptr(block,BUCKET_OVERFLOW_OFFSET,fs),sizeof(block_num_t));
+    return overflow;
+}
+
+static uint16_t raw_used(block_num_t block, filesystem_t* fs){
+
+    uint16_t used;
+    memcpy(&used,block_ptr(block,BUCKET_USED_OFFSET,fs),sizeof(uint16_t));
+    return used;
+}
+
+/*
+    Blocco che segue block nella catena di un bucket, 0 se la catena finisce.
+    Un blocco di overflow fuori dall'area dati termina la catena e viene segnalato in broken.
+*/
+static block_num_t chain_next(block_num_t block, block_num_t (*overflow)(block_num_t, filesystem_t*), uint8_t* broken, filesystem_t* fs){
+
+    block_num_t next = overflow(block,fs);
+
+    if(next != 0 && !in_data_area(next,fs)){
+        *broken = 1;
+        return 0;
+    }
+
+    return next;
+}
+
+/*
+    Numero di blocchi distinti della catena che inizia in first: una catena danneggiata può
+    richiudersi su sé stessa, il ciclo viene trovato con l'algoritmo di Brent senza memoria aggiuntiva.
+    In broken viene scritto 1 se la catena contiene un ciclo o un blocco fuori dall'area dati.
+*/
+static uint32_t chain_length(block_num_t first, block_num_t (*overflow)(block_num_t, filesystem_t*), uint8_t* broken, filesystem_t* fs){
+
+    block_num_t tortoise = first;
+    block_num_t hare = chain_next(first,overflow,broken,fs);
+    uint32_t power = 1;
+    uint32_t lambda = 1;
+    uint32_t mu = 0;
+
+    while(hare != 0 && hare != tortoise){
+
+        if(power == lambda){
+            tortoise = hare;
+            power *= 2;
+            lambda = 0;
+        }
+
+        hare = chain_next(hare,overflow,broken,fs);
+        lambda++;
+    }
+
+    if(hare == 0){      //Nessun ciclo, la lunghezza è il numero di passi fino alla fine
+        lambda = 1;
+        for(block_num_t block = first; (block = chain_next(block,overflow,broken,fs)) != 0;)
+            lambda++;
+        return lambda;
+    }
+
+    *broken = 1;
+    tortoise = hare = first;
+
+    for(uint32_t i = 0; i < lambda; i++)
+        hare = chain_next(hare,overflow,broken,fs);
+
+    while(tortoise != hare){
+        tortoise = chain_next(tortoise,overflow,broken,fs);
+        hare = chain_next(hare,overflow,broken,fs);
+        mu++;
+    }
+
+    return mu + lambda;
+}
+
+/*
+    Numero di extent validi dall'inizio del vettore: ogni extent deve essere non vuoto
+    e cadere interamente nell'area dati.
+*/
+static uint32_t valid_extents(const inode_t* inode, uint32_t count, filesystem_t* fs){
+
+    for(uint32_t i = 0; i < count; i++){
+
+        const extent_t* extent = &inode->extents[i];
+
+        if(extent->length == 0 || !in_data_area(extent->start,fs) || (uint64_t)extent->start + extent->length > fs->sb.blocks_count)
+            return i;
+    }
+
+    return count;
+}
+
+/*
+    Ritorna 1 se l'intestazione dell'indice è coerente con i blocchi della directory:
+    ogni bucket deve avere il proprio blocco logico.
+*/
+static uint8_t valid_dir_header(const dir_header_t* header, uint32_t blocks){
+
+    if(header->level >= 31 || header->split >= (DIR_INITIAL_BUCKETS << header->level))
+        return 0;
+
+    return (uint64_t)dir_bucket_count(header) + 1 <= blocks;
+}
+
+/*
+    Ritorna 1 se la entry, di nome name e lunghezza name_lenght, si trova dove la cerca dir_find_entry:
+    hash del nome corretto, nel bucket indicato dall'hash e con un nome che non contiene '/' o '\0'.
+*/
+static uint8_t entry_in_place(uint32_t hash, const char* name, file_name_lenght_t name_lenght, uint32_t bucket, const dir_header_t* header){
+
+    if(memchr(name,'/',name_lenght) != NULL || memchr(name,'\0',name_lenght) != NULL)
+        return 0;
+
+    return hash == name_hash(0,name,name_lenght) && dir_bucket_of(hash,header) == bucket;
+}
+
+/*
+    Controlla le entry di un blocco di un bucket e conta i riferimenti agli inode destinazione.
+    Ritorna 0 se il blocco è valido, -1 altrimenti.
+*/
+static int8_t check_bucket_block(inode_num_t dir_num, block_num_t block, uint32_t bucket, const dir_header_t* header, uint64_t* entries, uint64_t* bytes, fsck_t* ck){
+
+    filesystem_t* fs = ck->fs;
+    const uint8_t* data = block_ptr(block,BUCKET_HEADER_SIZE,fs);
+    uint16_t used = raw_used(block,fs);
+    int8_t ret = 0;
+    inode_num_t target;
+    uint32_t hash;
+    file_name_lenght_t name_lenght;
+
+    if(used > BUCKET_CAPACITY(fs)){
+        used = BUCKET_CAPACITY(fs);
+        ret = -1;
+    }
+
+    for(uint32_t off = 0; off < used; off += DIR_ENTRY_HEADER_SIZE + name_lenght){
+
+        if(used - off < DIR_ENTRY_HEADER_SIZE)
+            return -1;
+
+        memcpy(&target,data + off,sizeof(inode_num_t));
+        memcpy(&hash,data + off + sizeof(inode_num_t),sizeof(uint32_t));
+        memcpy(&name_lenght,data + off + sizeof(inode_num_t) + sizeof(uint32_t),sizeof(file_name_lenght_t));
+
+        if(name_lenght == 0 || name_lenght > DIR_MAX_NAME(fs) || DIR_ENTRY_HEADER_SIZE + name_lenght > used - off)
+            return -1;
+
+        if(!entry_in_place(hash,(const char*)data + off + DIR_ENTRY_HEADER_SIZE,name_lenght,bucket,header)){
+            __atomic_fetch_add(&ck->bad_entries,1,__ATOMIC_RELAXED);
+            ret = -1;
+        }
+
+        if(target == 0 || target == dir_num || target >= fs->sb.inodes_count || fs->inode_table[target] == 0){
+            __atomic_fetch_add(&ck->dangling,1,__ATOMIC_RELAXED);
+            ret = -1;
+        }
+        else
+            __atomic_fetch_add(&ck->refs[target],1,__ATOMIC_RELAXED);
+
+        (*entries)++;
+        *bytes += DIR_ENTRY_HEADER_SIZE + name_lenght;
+    }
+
+    return ret;
+}
+
+/*
+    Controlla l'indice di una directory con extent validi: intestazione, catene dei bucket ed entry.
+    I blocchi di overflow vengono segnati come raggiunti dalla directory.
+*/
+static void check_dir(inode_num_t dir_num, const inode_t* dir, uint32_t blocks, fsck_t* ck){
+
+    filesystem_t* fs = ck->fs;
+    dir_header_t header;
+    block_num_t block;
+    uint32_t length;
+    uint8_t broken = 0;
+    uint8_t damaged = 0;
+    uint64_t entries = 0;
+    uint64_t bytes = 0;
+
+    __atomic_fetch_add(&ck->dirs,1,__ATOMIC_RELAXED);
+
+    if(dir->extent_count == 0)     //Indice mai creato per mancanza di spazio, la directory risulta vuota
+        return;
+
+    prefetch_file_blocks(dir,0,blocks,fs);
+
+    memcpy(&header,block_ptr(map_file_block(dir,DIR_HEADER_BLOCK,NULL),0,fs),sizeof(dir_header_t));
+
+    if(!valid_dir_header(&header,blocks)){
+        ck->damage[dir_num] |= FSCK_BAD_DIR;
+        return;
+    }
+
+    for(uint32_t bucket = 0; bucket < dir_bucket_count(&header); bucket++){
+
+        block = map_file_block(dir,bucket + 1,NULL);
+        length = chain_length(block,raw_overflow,&broken,fs);
+
+        for(uint32_t i = 0; i < length; i++){
+
+            if(i > 0)
+                claim_blocks(block,1,ck);
+
+            if(check_bucket_block(dir_num,block,bucket,&header,&entries,&bytes,ck) == -1)
+                damaged = 1;
+
+            block = raw_overflow(block,fs);
+        }
+    }
+
+    if(broken || damaged || header.entry_count != entries || header.entry_bytes != bytes)
+        ck->damage[dir_num] |= FSCK_DIR_ENTRIES;
+
+    __atomic_fetch_add(&ck->entries,entries,__ATOMIC_RELAXED);
+
+}
+
+/*
+    Controlla un inode assegnato e segna i blocchi che raggiunge. L'inode viene letto dal suo blocco,
+    senza passare dalla cache e senza limitare il numero di extent come fa load_inode.
+*/
+static void check_inode(inode_num_t inode_num, fsck_t* ck){
+
+    filesystem_t* fs = ck->fs;
+    block_num_t block = fs->inode_table[inode_num];
+    const uint8_t* raw;
+    inode_t inode;
+    uint32_t count;
+    uint32_t valid;
+    uint32_t blocks = 0;
+
+    if(!in_data_area(block,fs)){
+        ck->damage[inode_num] |= FSCK_BAD_INODE;
+        return;
+    }
+
+    raw = block_ptr(block,0,fs);
+    memcpy(&inode.mode,raw + MODE_OFFSET_IN_INODE,sizeof(mode_t));
+    memcpy(&inode.extent_count,raw + EXTENT_COUNT_OFFSET_IN_INODE,sizeof(uint32_t));
+    memcpy(&inode.size,raw + SIZE_OFFSET_IN_INODE,sizeof(uint64_t));
+
+    if(!S_ISREG(inode.mode) && !S_ISDIR(inode.mode)){
+        ck->damage[inode_num] |= FSCK_BAD_INODE;
+        return;
+    }
+
+    claim_blocks(block,1,ck);
+
+    count = inode.extent_count;
+
+    if(count > MAX_EXTENTS_PER_NODE(fs)){
+        count = MAX_EXTENTS_PER_NODE(fs);
+        ck->damage[inode_num] |= S_ISDIR(inode.mode) ? FSCK_BAD_DIR : FSCK_BAD_EXTENTS;
+    }
+
+    memcpy(inode.extents,raw + EXTENTS_OFFSET_IN_INODE,sizeof(extent_t) * count);
+    inode.extent_count = count;
+    valid = valid_extents(&inode,count,fs);
+
+    if(valid < count)
+        ck->damage[inode_num] |= S_ISDIR(inode.mode) ? FSCK_BAD_DIR : FSCK_BAD_EXTENTS;
+
+    for(uint32_t i = 0; i < valid; i++){
+        claim_blocks(inode.extents[i].start,inode.extents[i].length,ck);
+        blocks += inode.extents[i].length;
+    }
+
+    if(S_ISDIR(inode.mode) && !(ck->damage[inode_num] & FSCK_BAD_DIR))
+        check_dir(inode_num,&inode,blocks,ck);
+
+}
+
+/*
+    Chiede al kernel i blocchi degli inode [first, last) prima di esaminarli, con una madvise per ogni
+    gruppo di blocchi contigui: la mappatura è ad accesso casuale (vedi load_fs) e, ad immagine
+    non ancora in memoria, ogni inode costerebbe altrimenti una lettura sincrona.
+*/
+static void prefetch_inodes(inode_num_t first, inode_num_t last, filesystem_t* fs){
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    block_num_t start = 0;
+    block_num_t end = 0;
+    block_num_t block;
+    size_t from;
+
+    for(uint64_t i = first; i <= last; i++){
+
+        block = (i < last) ? fs->inode_table[i] : 0;
+
+        if(i < last && !in_data_area(block,fs))
+            continue;
+
+        if(block == end && end != 0){
+            end++;
+            continue;
+        }
+
+        if(end != 0){
+            from = (size_t)start * fs->block_size;
+            from -= from % page_size;
+            madvise(fs->image + from,(size_t)end * fs->block_size - from,MADV_WILLNEED);
+        }
+
+        start = block;
+        end = block + 1;
+    }
+
+}
+
+static void* check_worker(void* arg){
+
+    fsck_t* ck = arg;
+    inode_num_t inodes_count = ck->fs->sb.inodes_count;
+    inode_num_t first;
+    inode_num_t last;
+
+    while((first = __atomic_fetch_add(&ck->next,FSCK_CHUNK,__ATOMIC_RELAXED)) < inodes_count){
+
+        last = (inodes_count - first < FSCK_CHUNK) ? inodes_count : first + FSCK_CHUNK;
+        prefetch_inodes(first,last,ck->fs);
+
+        for(inode_num_t i = first; i < last; i++){
+            if(ck->fs->inode_table[i] != 0)
+                check_inode(i,ck);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+    Confronta i risultati della scansione: riferimenti per inode e blocchi raggiunti
+    rispetto alla bitmap dello spazio libero. Stampa un riga per ogni inode con problemi.
+*/
+static void compare_results(fsck_t* ck){
+
+    filesystem_t* fs = ck->fs;
+    uint64_t expected;
+    uint64_t used;
+
+    for(inode_num_t i = 0; i < fs->sb.inodes_count; i++){
+
+        if(fs->inode_table[i] == 0)
+            continue;
+
+        ck->inodes++;
+
+        if(ck->damage[i] & FSCK_BAD_INODE){
+            printf("inode %u: blocco %u fuori dall'area dati o tipo non valido\n",i,fs->inode_table[i]);
+            ck->dropped++;
+        }
+        else if(ck->damage[i] & FSCK_BAD_DIR){
+            printf("directory %u: extent o intestazione dell'indice non validi\n",i);
+            ck->dropped++;
+        }
+
+        if(ck->damage[i] & FSCK_DROP){
+            ck->invalid_refs += ck->refs[i];
+            continue;
+        }
+
+        if(ck->damage[i] & FSCK_BAD_EXTENTS){
+            printf("inode %u: extent non validi\n",i);
+            ck->truncated++;
+        }
+
+        if(ck->damage[i] & FSCK_DIR_ENTRIES){
+            printf("directory %u: entry non valide, catene interrotte o intestazione non aggiornata\n",i);
+            ck->damaged_dirs++;
+        }
+
+        if(i != 0 && ck->refs[i] == 0){
+            printf("inode %u: non ha un nome in nessuna directory\n",i);
+            ck->damage[i] |= FSCK_ORPHAN;
+            ck->orphans++;
+        }
+        else if(ck->refs[i] > 1){
+            printf("inode %u: %u nomi\n",i,ck->refs[i]);
+            ck->multiref++;
+        }
+    }
+
+    for(uint32_t w = 0; w < fs->free_space_words; w++){
+
+        expected = ck->claimed[w] | ck->reserved[w];
+        used = fs->free_space_table[w];
+
+        ck->leaked += __builtin_popcountll(used & ~expected);
+        ck->unmarked += __builtin_popcountll(expected & ~used);
+        ck->shared_blocks += __builtin_popcountll(ck->shared[w]);
+    }
+
+}
+
+static uint64_t problem_count(const fsck_t* ck){
+
+    return ck->dropped + ck->truncated + ck->damaged_dirs + ck->orphans + ck->multiref
+        + ck->bad_entries + ck->dangling + ck->invalid_refs + ck->leaked + ck->unmarked + ck->shared_blocks;
+}
+
+/*
+    Esegue la scansione con options.threads thread ed il confronto dei risultati.
+    Ritorna il numero di problemi trovati.
+*/
+static uint64_t check_fs(fsck_t* ck){
+
+    filesystem_t* fs = ck->fs;
+    pthread_t threads[FSCK_MAX_THREADS];
+    uint64_t start = now_ns();
+
+    memset(ck->claimed,0,sizeof(uint64_t) * fs->free_space_words);
+    memset(ck->shared,0,sizeof(uint64_t) * fs->free_space_words);
+    memset(ck->refs,0,sizeof(uint32_t) * fs->sb.inodes_count);
+    memset(ck->damage,0,fs->sb.inodes_count);
+    memset(&ck->next,0,sizeof(fsck_t) - offsetof(fsck_t,next));     //Cursore e contatori seguono next
+
+    for(uint32_t i = 0; i < options.threads; i++)
+        pthread_create(&threads[i],NULL,check_worker,ck);
+
+    for(uint32_t i = 0; i < options.threads; i++)
+        pthread_join(threads[i],NULL);
+
+    compare_results(ck);
+
+    printf("inode: %u assegnati, %u non validi, %u con extent non validi, %u senza nome, %u con più nomi\n",
+        ck->inodes,ck->dropped,ck->truncated,ck->orphans,ck->multiref);
+    printf("directory: %lu, entry: %lu (%lu non valide, %lu verso inode non assegnati, %lu verso inode non validi), %u da correggere\n",
+        ck->dirs,ck->entries,ck->bad_entries,ck->dangling,ck->invalid_refs,ck->damaged_dirs);
+    printf("blocchi: %lu occupati non raggiunti, %lu raggiunti ma liberi, %lu condivisi\n",ck->leaked,ck->unmarked,ck->shared_blocks);
+    printf("controllo completato in %.3f s con %u thread\n",(now_ns() - start) / 1e9,options.threads);
+
+    return problem_count(ck);
+}
+
+
+/* Riparazione, eseguita da un solo thread con le funzioni del file system */
+
+/*
+    Ricostruisce la bitmap dello spazio libero dai blocchi raggiunti: i blocchi non raggiunti vengono liberati,
+    quelli raggiunti ma liberi segnati occupati, prima che le riparazioni successive assegnino blocchi.
+*/
+static void rebuild_freespace(fsck_t* ck){
+
+    filesystem_t* fs = ck->fs;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+
+    for(uint32_t w = 0; w < fs->free_space_words; w++)
+        fs->free_space_table[w] = ck->claimed[w] | ck->reserved[w];
+
+    memset(fs->free_space_dirty,1,fs->sb.freespace_table_blocks);
+    fs->free_blocks = count_free_blocks(fs);
+    fs->alloc_cursor = fs->sb.data_start;
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+}
+
+/*
+    Assegna ad un solo proprietario i blocchi condivisi di un intervallo: il primo a raggiungerli in kept
+    li tiene. Ritorna il primo blocco dell'intervallo già tenuto da un altro, 0 se non ce ne sono.
+*/
+static block_num_t keep_blocks(block_num_t start, uint32_t length, uint64_t* kept, fsck_t* ck){
+
+    uint64_t end = (uint64_t)start + length;
+    uint64_t next;
+    uint64_t mask;
+    uint64_t taken;
+
+    for(uint64_t block = start; block < end; block = next){
+
+        next = (block / BITS_PER_WORD + 1) * BITS_PER_WORD;
+        if(next > end)
+            next = end;
+
+        mask = (next - block == BITS_PER_WORD) ? ~0ULL : ((1ULL << (next - block)) - 1) << (block % BITS_PER_WORD);
+        mask &= ck->shared[block / BITS_PER_WORD];
+        taken = mask & kept[block / BITS_PER_WORD];
+
+        if(taken != 0)
+            return (block / BITS_PER_WORD) * BITS_PER_WORD + __builtin_ctzll(taken);
+
+        kept[block / BITS_PER_WORD] |= mask;
+    }
+
+    return 0;
+}
+
+/*
+    Tronca i blocchi logici di un file da keep in poi senza liberarli: sono condivisi con un altro inode
+    o non validi, quelli rimasti solo a questo file vengono liberati alla passata successiva.
+*/
+static void cut_extents(inode_num_t inode_num, uint32_t keep, filesystem_t* fs){
+
+    inode_t* inode = get_inode(inode_num,fs);
+    uint32_t first = 0;
+
+    for(uint32_t i = 0; i < inode->extent_count; i++){
+
+        if(keep - first < inode->extents[i].length){
+            inode->extents[i].length = keep - first;
+            inode->extent_count = (keep == first) ? i : i + 1;
+            break;
+        }
+
+        first += inode->extents[i].length;
+    }
+
+    inode_cache_entry_of(inode)->map_generation++;
+    mark_inode_dirty(inode_num,fs);
+
+}
+
+/*
+    Assegna ai proprietari in kept i blocchi condivisi raggiunti dalle directory (dirs = 1) o dai file (dirs = 0).
+    Una directory che perde un extent viene eliminata e la catena di overflow che perde un blocco
+    interrotta prima di questo, un file viene accorciato al primo blocco perso.
+*/
+static void keep_inode_blocks(uint8_t dirs, uint64_t* kept, fsck_t* ck){
+
+    filesystem_t* fs = ck->fs;
+    inode_t* inode;
+    dir_header_t header;
+    block_num_t lost;
+    block_num_t block;
+    block_num_t prev;
+    uint32_t valid;
+    uint32_t length;
+    uint32_t first;
+    uint8_t broken;
+
+    for(inode_num_t i = 0; i < fs->sb.inodes_count; i++){
+
+        if(fs->inode_table[i] == 0 || (ck->damage[i] & FSCK_DROP))
+            continue;
+
+        inode = get_inode(i,fs);
+
+        if(S_ISDIR(inode->mode) != dirs)
+            continue;
+
+        valid = valid_extents(inode,inode->extent_count,fs);
+        first = 0;
+
+        for(uint32_t e = 0; e < valid; e++){
+
+            lost = keep_blocks(inode->extents[e].start,inode->extents[e].length,kept,ck);
+
+            if(lost != 0 && dirs){
+                printf("directory %u: blocco %u condiviso, directory eliminata\n",i,lost);
+                ck->damage[i] |= FSCK_BAD_DIR;
+                break;
+            }
+
+            if(lost != 0){
+                printf("inode %u: blocco %u condiviso, file troncato al blocco logico %u\n",i,lost,first + (lost - inode->extents[e].start));
+                cut_extents(i,first + (lost - inode->extents[e].start),fs);
+                break;
+            }
+
+            first += inode->extents[e].length;
+        }
+
+        if(!dirs || (ck->damage[i] & FSCK_DROP) || inode->extent_count == 0)
+            continue;
+
+        read_dir_header(inode,&header,fs);
+
+        for(uint32_t bucket = 0; bucket < dir_bucket_count(&header); bucket++){
+
+            prev = map_file_block(inode,bucket + 1,NULL);
+            broken = 0;
+            length = chain_length(prev,bucket_overflow,&broken,fs);
+
+            for(uint32_t k = 1; k < length; k++, prev = block){
+
+                block = bucket_overflow(prev,fs);
+
+                if(keep_blocks(block,1,kept,ck) != 0){
+                    printf("directory %u: blocco di overflow %u condiviso, catena interrotta\n",i,block);
+                    set_bucket_header(prev,bucket_used(prev,fs),0,fs);
+                    ck->damage[i] |= FSCK_DIR_ENTRIES;
+                    break;
+                }
+            }
+        }
+    }
+
+}
+
+/*
+    Assegna un solo proprietario ai blocchi condivisi, nell'ordine: blocchi degli inode,
+    blocchi delle directory, blocchi dei file. Un inode che perde il proprio blocco viene eliminato.
+*/
+static void resolve_shared(fsck_t* ck){
+
+    filesystem_t* fs = ck->fs;
+    uint64_t* kept = calloc(fs->free_space_words,sizeof(uint64_t));
+
+    for(inode_num_t i = 0; i < fs->sb.inodes_count; i++){
+        if(fs->inode_table[i] != 0 && !(ck->damage[i] & FSCK_DROP) && keep_blocks(fs->inode_table[i],1,kept,ck) != 0){
+            printf("inode %u: blocco %u condiviso, inode eliminato\n",i,fs->inode_table[i]);
+            ck->damage[i] |= FSCK_BAD_INODE;
+        }
+    }
+
+    keep_inode_blocks(1,kept,ck);
+    keep_inode_blocks(0,kept,ck);
+    free(kept);
+
+}
+
+/*
+    Toglie dalla tabella gli inode non validi senza leggerli: i blocchi che raggiungono vengono
+    liberati dalla ricostruzione della bitmap, le entry che li indicano da repair_dir
+    ed i loro elementi, se directory, restano senza nome fino alla passata successiva.
+*/
+static void drop_inodes(fsck_t* ck){
+
+    filesystem_t* fs = ck->fs;
+
+    for(inode_num_t i = 1; i < fs->sb.inodes_count; i++){
+
+        if(fs->inode_table[i] == 0 || !(ck->damage[i] & FSCK_DROP))
+            continue;
+
+        inode_cache_drop(i,fs);
+        pthread_mutex_lock(&fs->alloc_lock);
+        set_inode_table_entry(i,0,fs);
+        pthread_mutex_unlock(&fs->alloc_lock);
+    }
+
+}
+
+/*
+    Entry da reinserire in una directory perché non si trova nel bucket in cui la cerca dir_find_entry.
+*/
+typedef struct misplaced_entry{
+
+    inode_num_t inode_num;
+    char name[MAX_FILE_NAME + 1];
+
+}misplaced_entry_t;
+
+/*
+    Riscrive l'indice di una directory: vengono tolte le entry non valide o verso inode non assegnati,
+    quelle verso un inode già nominato in seen (un inode con più nomi tiene il primo) ed interrotte
+    le catene che escono dall'area dati o si richiudono. Le entry nel bucket sbagliato o con l'hash
+    errato vengono reinserite con insert_file_info, l'intestazione viene ricalcolata.
+    Un blocco viene aggiunto alla transazione solo se cambia.
+*/
+static void repair_dir(inode_num_t dir_num, uint64_t* seen, fsck_t* ck){
+
+    filesystem_t* fs = ck->fs;
+    inode_t* dir = get_inode(dir_num,fs);
+    dir_header_t header;
+    uint8_t kept[MAX_BLOCK_SIZE];
+    misplaced_entry_t* misplaced = NULL;
+    uint32_t misplaced_count = 0;
+    uint32_t reinserted = 0;
+    uint32_t dropped = 0;
+    const uint8_t* data;
+    block_num_t block;
+    block_num_t next;
+    uint32_t length;
+    uint8_t broken;
+    uint16_t used;
+    uint16_t kept_size;
+    inode_num_t target;
+    uint32_t hash;
+    file_name_lenght_t name_lenght;
+    uint32_t entry_size;
+    uint32_t entries = 0;
+    uint32_t bytes = 0;
+
+    if(dir->extent_count == 0)
+        return;
+
+    read_dir_header(dir,&header,fs);
+
+    for(uint32_t bucket = 0; bucket < dir_bucket_count(&header); bucket++){
+
+        block = map_file_block(dir,bucket + 1,NULL);
+        broken = 0;
+        length = chain_length(block,bucket_overflow,&broken,fs);
+
+        for(uint32_t i = 0; i < length; i++, block = next){
+
+            next = (i + 1 < length) ? bucket_overflow(block,fs) : 0;
+            data = meta_ptr(block,BUCKET_HEADER_SIZE,0,fs);
+            used = bucket_used(block,fs);
+            kept_size = 0;
+
+            if(used > BUCKET_CAPACITY(fs))
+                used = BUCKET_CAPACITY(fs);
+
+            for(uint32_t off = 0; off + DIR_ENTRY_HEADER_SIZE <= used; off += entry_size){
+
+                memcpy(&target,data + off,sizeof(inode_num_t));
+                memcpy(&hash,data + off + sizeof(inode_num_t),sizeof(uint32_t));
+                memcpy(&name_lenght,data + off + sizeof(inode_num_t) + sizeof(uint32_t),sizeof(file_name_lenght_t));
+                entry_size = DIR_ENTRY_HEADER_SIZE + name_lenght;
+
+                if(name_lenght == 0 || name_lenght > DIR_MAX_NAME(fs) || entry_size > used - off){     //Il resto del blocco non è leggibile
+                    dropped++;
+                    break;
+                }
+
+                if(target == 0 || target == dir_num || target >= fs->sb.inodes_count || fs->inode_table[target] == 0
+                    || (seen[target / BITS_PER_WORD] >> (target % BITS_PER_WORD)) & 1){
+                    dropped++;
+                    continue;
+                }
+
+                if(memchr(data + off + DIR_ENTRY_HEADER_SIZE,'/',name_lenght) != NULL || memchr(data + off + DIR_ENTRY_HEADER_SIZE,'\0',name_lenght) != NULL){
+                    dropped++;
+                    continue;
+                }
+
+                seen[target / BITS_PER_WORD] |= 1ULL << (target % BITS_PER_WORD);
+
+                if(!entry_in_place(hash,(const char*)data + off + DIR_ENTRY_HEADER_SIZE,name_lenght,bucket,&header)){
+                    misplaced = realloc(misplaced,sizeof(misplaced_entry_t) * (misplaced_count + 1));
+                    misplaced[misplaced_count].inode_num = target;
+                    memcpy(misplaced[misplaced_count].name,data + off + DIR_ENTRY_HEADER_SIZE,name_lenght);
+                    misplaced[misplaced_count].name[name_lenght] = '\0';
+                    misplaced_count++;
+                    continue;
+                }
+
+                memcpy(kept + kept_size,data + off,entry_size);
+                kept_size += entry_size;
+            }
+
+            if(kept_size != bucket_used(block,fs) || next != bucket_overflow(block,fs)){
+                memcpy(meta_ptr(block,BUCKET_HEADER_SIZE,1,fs),kept,kept_size);
+                set_bucket_header(block,kept_size,next,fs);
+            }
+
+            bytes += kept_size;
+
+            for(uint32_t off = 0; off < kept_size; off += DIR_ENTRY_HEADER_SIZE + name_lenght){
+                memcpy(&name_lenght,kept + off + sizeof(inode_num_t) + sizeof(uint32_t),sizeof(file_name_lenght_t));
+                entries++;
+            }
+        }
+    }
+
+    if(header.entry_count != entries || header.entry_bytes != bytes){
+        header.entry_count = entries;
+        header.entry_bytes = bytes;
+        write_dir_header(dir,&header,fs);
+    }
+
+    for(uint32_t i = 0; i < misplaced_count; i++){
+
+        if(insert_file_info(misplaced[i].name,misplaced[i].inode_num,dir_num,fs) != 0){
+            printf("directory %u: impossibile reinserire \"%s\"\n",dir_num,misplaced[i].name);
+            seen[misplaced[i].inode_num / BITS_PER_WORD] &= ~(1ULL << (misplaced[i].inode_num % BITS_PER_WORD));
+            dropped++;
+        }
+        else
+            reinserted++;
+    }
+
+    if(dropped > 0 || reinserted > 0)
+        printf("directory %u: %u entry tolte, %u reinserite\n",dir_num,dropped,reinserted);
+
+    free(misplaced);
+
+}
+
+/*
+    Directory in cui vengono nominati gli inode senza nome, creata nella root se non esiste.
+    Ritorna -1 se non è stato possibile crearla.
+*/
+static int8_t lost_found_dir(inode_num_t* dir_num, filesystem_t* fs){
+
+    file_t lost_found;
+
+    *dir_num = dir_lookup(0,"lost+found",strlen("lost+found"),fs);
+
+    if(*dir_num == 0){
+
+        strcpy(lost_found.name,"lost+found");
+        lost_found.mode = S_IFDIR | 0700;
+        lost_found.size = 0;
+
+        if(new_file_to_dir(lost_found,"/",fs) != 0)
+            return -1;
+
+        *dir_num = dir_lookup(0,"lost+found",strlen("lost+found"),fs);
+    }
+
+    return S_ISDIR(get_inode(*dir_num,fs)->mode) ? 0 : -1;
+}
+
+/*
+    Dà un nome in lost+found, "#numero di inode", agli inode trovati senza nome dalla scansione.
+*/
+static void link_orphans(fsck_t* ck){
+
+    filesystem_t* fs = ck->fs;
+    inode_num_t lost_found;
+    char name[MAX_FILE_NAME];
+
+    if(lost_found_dir(&lost_found,fs) == -1){
+        printf("impossibile creare /lost+found, %u inode restano senza nome\n",ck->orphans);
+        return;
+    }
+
+    for(inode_num_t i = 1; i < fs->sb.inodes_count; i++){
+
+        if(!(ck->damage[i] & FSCK_ORPHAN) || fs->inode_table[i] == 0 || i == lost_found)
+            continue;
+
+        snprintf(name,sizeof(name),"#%u",i);
+
+        if(insert_file_info(name,i,lost_found,fs) != 0)
+            printf("inode %u: impossibile aggiungerlo a /lost+found\n",i);
+        else
+            printf("inode %u: aggiunto come /lost+found/%s\n",i,name);
+    }
+
+}
+
+/*
+    Corregge i problemi trovati dall'ultima scansione ed esegue il commit delle modifiche.
+*/
+static void repair_fs(fsck_t* ck){
+
+    filesystem_t* fs = ck->fs;
+    uint64_t* seen;
+    uint8_t all_dirs = ck->multiref > 0 || ck->invalid_refs > 0 || ck->shared_blocks > 0;
+
+    rebuild_freespace(ck);
+
+    if(ck->shared_blocks > 0)
+        resolve_shared(ck);
+
+    drop_inodes(ck);
+
+    for(inode_num_t i = 0; i < fs->sb.inodes_count; i++){
+        if(fs->inode_table[i] != 0 && (ck->damage[i] & FSCK_BAD_EXTENTS)){
+            inode_t* inode = get_inode(i,fs);
+            uint32_t first = 0;
+            uint32_t valid = valid_extents(inode,inode->extent_count,fs);
+
+            for(uint32_t e = 0; e < valid; e++)
+                first += inode->extents[e].length;
+
+            cut_extents(i,first,fs);
+            printf("inode %u: troncato a %u blocchi\n",i,first);
+        }
+    }
+
+    /* Le entry verso inode eliminati o con più nomi possono trovarsi in qualunque directory */
+    seen = calloc(fs->inode_bitmap_words,sizeof(uint64_t));
+
+    for(inode_num_t i = 0; i < fs->sb.inodes_count; i++){
+        if(fs->inode_table[i] != 0 && (all_dirs || (ck->damage[i] & FSCK_DIR_ENTRIES)) && S_ISDIR(get_inode(i,fs)->mode))
+            repair_dir(i,seen,ck);
+    }
+
+    free(seen);
+
+    if(ck->orphans > 0)
+        link_orphans(ck);
+
+    sync_fs(fs);
+
+}
+
+int main(int argc, char* argv[]){
+
+    filesystem_t* fs;
+    fsck_t ck = {0};
+    uint64_t problems;
+    uint32_t pass;
+    int status = FSCK_CLEAN;
+
+    if(parse_options(argc,argv) == -1)
+        return FSCK_ERROR;
+
+    if(mount_fs_mode(&fs,options.image,!options.repair) == NULL){
+        fprintf(stderr,"Impossibile aprire il file system in %s\n",options.image);
+        return FSCK_ERROR;
+    }
+
+    ck.fs = fs;
+    ck.reserved = init_freespace_table(&fs->sb);
+    ck.claimed = malloc(sizeof(uint64_t) * fs->free_space_words);
+    ck.shared = malloc(sizeof(uint64_t) * fs->free_space_words);
+    ck.refs = malloc(sizeof(uint32_t) * fs->sb.inodes_count);
+    ck.damage = malloc(fs->sb.inodes_count);
+
+    if(ck.reserved == NULL || ck.claimed == NULL || ck.shared == NULL || ck.refs == NULL || ck.damage == NULL){
+        fprintf(stderr,"Memoria insufficiente\n");
+        return FSCK_ERROR;
+    }
+
+    for(pass = 1; ; pass++){
+
+        printf("passata %u\n",pass);
+        problems = check_fs(&ck);
+
+        if(problems == 0)
+            break;
+
+        if(!options.repair || pass == FSCK_MAX_PASSES){
+            status = FSCK_UNCORRECTED;
+            break;
+        }
+
+        repair_fs(&ck);
+        status = FSCK_CORRECTED;
+    }
+
+    close_fs(fs);
+    free(ck.reserved);
+    free(ck.claimed);
+    free(ck.shared);
+    free(ck.refs);
+    free(ck.damage);
+
+    return status;
+
+}
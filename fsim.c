@@ -28,12 +28,201 @@
 #include <fcntl.h>
 #include <stddef.h>
 #include <assert.h>
+#include <time.h>
 #include "filesystem.h"
 
+#define STATS_PATH "/.fsim_stats"
+#define STATS_MAX_SIZE 8192
+#define LATENCY_BUCKETS 32
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
 
 
 filesystem_t* filesystem;
 
+/*
+ * Opzioni da riga di comando: file che contiene il file system e, con --mkfs,
+ * geometria con cui viene formattato. Senza --mkfs viene montato il file system già presente.
+ * --verbose=1 stampa una riga per ogni chiamata, --sync-io usa chiamate bloccanti al posto di io_uring.
+ */
+static struct options {
+	const char *image;
+	int mkfs;
+	unsigned int block_size;
+	unsigned int blocks;
+	unsigned int inodes;
+	unsigned int journal_blocks;
+	unsigned int readahead_kb;
+	unsigned int verbose;
+	int sync_io;
+} options;
+
+#define OPTION(t, p)                           \
+    { t, offsetof(struct options, p), 1 }
+static const struct fuse_opt option_spec[] = {
+	OPTION("--image=%s", image),
+	OPTION("--mkfs", mkfs),
+	OPTION("--block-size=%u", block_size),
+	OPTION("--blocks=%u", blocks),
+	OPTION("--inodes=%u", inodes),
+	OPTION("--journal-blocks=%u", journal_blocks),
+	OPTION("--readahead-kb=%u", readahead_kb),
+	OPTION("--verbose=%u", verbose),
+	OPTION("--sync-io", sync_io),
+	FUSE_OPT_END
+};
+
+/*
+ * Log di ogni chiamata, stampato solo se il livello di verbosità (--verbose, modificabile
+ * scrivendo "verbose=N" in STATS_PATH) è almeno level.
+ */
+#define LOG(level, ...)                                                        \
+	do {                                                                   \
+		if (__atomic_load_n(&options.verbose, __ATOMIC_RELAXED) >= (level)) \
+			printf(__VA_ARGS__);                                   \
+	} while (0)
+
+/*
+ * Statistiche delle operazioni FUSE: chiamate, errori e istogramma delle latenze,
+ * latency[i] conta le chiamate durate tra 2^i e 2^(i+1) nanosecondi.
+ * I contatori vengono aggiornati atomicamente dai thread del loop di FUSE.
+ */
+enum fsim_op {
+	OP_GETATTR,
+	OP_READDIR,
+	OP_OPEN,
+	OP_READ,
+	OP_WRITE,
+	OP_CREATE,
+	OP_CHMOD,
+	OP_TRUNCATE,
+	OP_UNLINK,
+	OP_RMDIR,
+	OP_RENAME,
+	OP_FSYNC,
+	OP_FLUSH,
+	OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = {
+	"getattr", "readdir", "open", "read", "write", "create", "chmod", "truncate",
+	"unlink", "rmdir", "rename", "fsync", "flush"
+};
+
+static struct op_stats {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t latency[LATENCY_BUCKETS];
+} op_stats[OP_COUNT];
+
+static uint64_t op_begin(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Registra la durata di una chiamata iniziata in start e ne ritorna il risultato ret.
+ */
+static int op_end(enum fsim_op op, uint64_t start, int ret)
+{
+	struct op_stats *stats = &op_stats[op];
+	uint64_t ns = op_begin() - start;
+	uint64_t max = __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED);
+	uint32_t bucket = 63 - __builtin_clzll(ns | 1);
+
+	if (bucket >= LATENCY_BUCKETS)
+		bucket = LATENCY_BUCKETS - 1;
+
+	__atomic_fetch_add(&stats->calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->total_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->latency[bucket], 1, __ATOMIC_RELAXED);
+
+	if (ret < 0)
+		__atomic_fetch_add(&stats->errors, 1, __ATOMIC_RELAXED);
+
+	while (ns > max && !__atomic_compare_exchange_n(&stats->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	return ret;
+}
+
+/*
+ * Limite superiore, in nanosecondi, del bucket dell'istogramma che contiene il percentile p.
+ */
+static uint64_t op_percentile(const uint64_t *latency, uint64_t calls, double p)
+{
+	uint64_t seen = 0;
+
+	for (uint32_t i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += latency[i];
+		if (seen > 0 && seen >= calls * p)
+			return 2ULL << i;
+	}
+
+	return 0;
+}
+
+/*
+ * Contenuto di STATS_PATH: una riga per operazione con numero di chiamate, errori, latenza media,
+ * p50, p99 e massima, una riga con l'istogramma (bucket non vuoti, "limite:chiamate"),
+ * seguite dai contatori del file system. Ritorna la lunghezza del testo.
+ */
+static int format_stats(char *buf, size_t size)
+{
+	struct op_stats snap;
+	int len = snprintf(buf, size, "op calls errors avg_ns p50_ns p99_ns max_ns\n");
+
+	for (int op = 0; op < OP_COUNT && (size_t)len < size; op++) {
+
+		uint64_t *counters = (uint64_t *)&snap;
+		for (size_t i = 0; i < sizeof(snap) / sizeof(uint64_t); i++)
+			counters[i] = __atomic_load_n((uint64_t *)&op_stats[op] + i, __ATOMIC_RELAXED);
+
+		if (snap.calls == 0)
+			continue;
+
+		len += snprintf(buf + len, size - len, "%s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n%s_hist",
+				op_names[op], snap.calls, snap.errors, snap.total_ns / snap.calls,
+				op_percentile(snap.latency, snap.calls, 0.5),
+				op_percentile(snap.latency, snap.calls, 0.99), snap.max_ns, op_names[op]);
+
+		for (uint32_t i = 0; i < LATENCY_BUCKETS && (size_t)len < size; i++)
+			if (snap.latency[i] != 0)
+				len += snprintf(buf + len, size - len, " %llu:%" PRIu64, 2ULL << i, snap.latency[i]);
+
+		if ((size_t)len < size)
+			len += snprintf(buf + len, size - len, "\n");
+	}
+
+	if ((size_t)len < size)
+		len += format_fs_stats(buf + len, size - len, filesystem);
+
+	return (size_t)len < size ? len : (int)size - 1;
+}
+
+static void reset_stats(void)
+{
+	for (int op = 0; op < OP_COUNT; op++) {
+		uint64_t *counters = (uint64_t *)&op_stats[op];
+		for (size_t i = 0; i < sizeof(struct op_stats) / sizeof(uint64_t); i++)
+			__atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+	}
+
+	reset_fs_stats(filesystem);
+}
+
+static int is_stats_path(const char *path)
+{
+	return strcmp(path, STATS_PATH) == 0;
+}
+
 static void *hello_init(struct fuse_conn_info *conn,
 			struct fuse_config *cfg)
 {
@@ -41,178 +230,503 @@ static void *hello_init(struct fuse_conn_info *conn,
 	cfg->kernel_cache = 1;
 	cfg->use_ino = 1;
 
-	init_root_dir(filesystem);
-	sync_test_files(filesystem,53);
-	sync_test_dir(filesystem,5);
-	fflush(filesystem->file);
+	if (options.mkfs) {
+		init_root_dir(filesystem);
+		sync_test_files(filesystem,53);
+		sync_test_dir(filesystem,5);
+	}
 
 	return NULL;
 }
 
+/*
+ * Attributi di un inode, il chiamante deve tenerne il lock.
+ */
+static void fill_stat(inode_num_t inode_num, const inode_t *inode, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_mode = inode->mode;
+	stbuf->st_size = inode_size(inode);
+	stbuf->st_nlink = 2;
+	stbuf->st_ino = inode_num;
+}
+
+/*
+ * Il file aperto associato a fi da hello_open o myfs_create, NULL per STATS_PATH
+ * o se la richiesta non viene da un file aperto.
+ */
+static open_file_t *file_handle(const char *path, struct fuse_file_info *fi)
+{
+	if (fi == NULL || fi->fh == 0 || is_stats_path(path))
+		return NULL;
+
+	return (open_file_t *)(uintptr_t)fi->fh;
+}
+
 static int hello_getattr(const char *path, struct stat *stbuf,
 			 struct fuse_file_info *fi)
 {
-	(void) fi;
-	inode_t inode;
-	inode_num_t inode_num; 
-	printf("getattr %s\n",path);
+	open_file_t *file = file_handle(path, fi);
+	uint64_t start = op_begin();
+	inode_num_t inode_num = 0; 
+	inode_t *inode;
+	LOG(1, "getattr %s\n",path);
+
+	if (is_stats_path(path)) {
+		memset(stbuf, 0, sizeof(struct stat));
+		stbuf->st_mode = S_IFREG | 0644;
+		stbuf->st_nlink = 1;
+		stbuf->st_ino = filesystem->sb.inodes_count;	//Fuori dall'intervallo degli inode
+		return op_end(OP_GETATTR, start, 0);
+	}
 
-	memset(stbuf, 0, sizeof(struct stat));
-	if (strcmp(path, "/") == 0) {
-		inode_num = 0;
-		inode = read_inode(inode_num,filesystem);
-		stbuf->st_mode = inode.mode;
-		stbuf->st_size = inode.size;
-		stbuf->st_nlink = 2;
-		stbuf->st_ino = inode_num;
-		return 0;
-	} 
-	
-	inode_num = inode_from_path(path,filesystem);
+	if (file != NULL)
+		inode_num = file->inode_num;
+	else if (strcmp(path, "/") != 0) {
+		inode_num = inode_from_path(path,filesystem);
 
-	if(inode_num == 0)
-		return -ENOENT;
-	
-	if(inode_num != 0){
-		inode = read_inode(inode_num,filesystem);	
-		stbuf->st_mode = inode.mode;
-		stbuf->st_size = inode.size;
-		stbuf->st_nlink = 2;
-		stbuf->st_ino = inode_num;
-		return 0;
+		if(inode_num == 0)
+			return op_end(OP_GETATTR, start, -ENOENT);
 	}
-	
-	return -ENOENT;
+
+	lock_inode(inode_num,0,filesystem);
+
+	if (file != NULL && file->entry->released) {	//L'inode è stato liberato e il numero può essere già riusato
+		unlock_inode(inode_num,filesystem);
+		return op_end(OP_GETATTR, start, -ESTALE);
+	}
+
+	inode = get_inode(inode_num,filesystem);
+
+	if (inode != NULL)
+		fill_stat(inode_num,inode,stbuf);
+
+	unlock_inode(inode_num,filesystem);
+
+	return op_end(OP_GETATTR, start, inode != NULL ? 0 : -ENOMEM);
 }
 
+/*
+ * Le entry vengono passate a filler direttamente dai blocchi della directory, ognuna con il cookie
+ * da cui riprendere (1 e 2 per "." e ".."), e la lettura si ferma quando il buffer di FUSE è pieno.
+ * Con FUSE_READDIR_PLUS vengono restituiti anche gli attributi, evitando una getattr per ogni entry:
+ * il lock della directory è già preso, quindi quello di ogni elemento viene solo provato e,
+ * se è occupato, l'elemento viene restituito senza attributi.
+ */
 static int hello_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 			 off_t offset, struct fuse_file_info *fi,
 			 enum fuse_readdir_flags flags)
 {
-	(void) offset;
 	(void) fi;
-	(void) flags;
-	printf("readdir %s\n",path);
-	inode_t inode;
-	file_t dir = {0};
-	if (strcmp(path, "/") == 0){
-		inode_num_t dir_inode_num = 0;
-		inode = read_inode(dir_inode_num,filesystem);
-	}
-	else{
-		inode_num_t dir_inode_num = inode_from_path(path,filesystem);
+	uint64_t start = op_begin();
+	LOG(1, "readdir %s\n",path);
+	inode_num_t dir_inode_num = 0;
+	dir_iter_t it;
+	struct stat st;
+	inode_t *inode;
+	enum fuse_fill_dir_flags fill_flags;
+
+	if (strcmp(path, "/") != 0){
+		dir_inode_num = inode_from_path(path,filesystem);
 		if(dir_inode_num == 0)
-			return -ENOENT;
-		inode = read_inode(dir_inode_num,filesystem);
+			return op_end(OP_READDIR, start, -ENOENT);
 	}
-	read_dir_entries(&dir,inode,filesystem);
-	uint16_t i = 0;
 
-	filler(buf, ".", NULL, 0, 0);
-	filler(buf, "..", NULL, 0, 0);
+	lock_inode(dir_inode_num,0,filesystem);
 
-	while(dir.entries[i].inode_index != 0){
-		filler(buf, dir.entries[i].name, NULL, 0, 0);
-		i++;
+	if (dir_iter_start(&it,dir_inode_num,offset,filesystem) == -1) {
+		unlock_inode(dir_inode_num,filesystem);
+		return op_end(OP_READDIR, start, -ENOTDIR);
 	}
-	return 0;
+
+	if ((offset < 1 && filler(buf, ".", NULL, 1, 0)) || (offset < 2 && filler(buf, "..", NULL, 2, 0))) {
+		unlock_inode(dir_inode_num,filesystem);
+		return op_end(OP_READDIR, start, 0);
+	}
+
+	while (dir_iter_next(&it,filesystem) == 1) {
+
+		fill_flags = 0;
+
+		if ((flags & FUSE_READDIR_PLUS) && try_lock_inode(it.inode_num,filesystem) == 0) {
+			inode = get_inode(it.inode_num,filesystem);
+
+			if (inode != NULL) {	//Senza memoria l'elemento viene passato senza attributi
+				fill_stat(it.inode_num,inode,&st);
+				fill_flags = FUSE_FILL_DIR_PLUS;
+			}
+
+			unlock_inode(it.inode_num,filesystem);
+		}
+
+		if (filler(buf, it.name, fill_flags ? &st : NULL, dir_iter_cookie(&it), fill_flags))
+			break;
+	}
+
+	unlock_inode(dir_inode_num,filesystem);
+	return op_end(OP_READDIR, start, 0);
 }
 
+/*
+ * All'apertura di STATS_PATH viene preparata una copia delle statistiche, letta dalle read
+ * successive (fi->fh) così che il testo resti coerente anche se letto a pezzi.
+ * Per gli altri file fi->fh è il file aperto (open_inode), così che read e write
+ * non debbano risolvere di nuovo il percorso.
+ */
 static int hello_open(const char *path, struct fuse_file_info *fi)
 {
+	uint64_t start = op_begin();
+	char *snapshot;
+	open_file_t *file;
+	inode_num_t inode_num;
 
-	printf("open %s\n",path);
+	LOG(1, "open %s\n",path);
 	//if ((fi->flags & O_ACCMODE) != O_RDONLY)
 	//	return -EACCES;
 
-	return 0; 
+	if (is_stats_path(path)) {
+		snapshot = malloc(STATS_MAX_SIZE);
+		if (snapshot == NULL)
+			return op_end(OP_OPEN, start, -ENOMEM);
+
+		format_stats(snapshot, STATS_MAX_SIZE);
+		fi->fh = (uint64_t)(uintptr_t)snapshot;
+		fi->direct_io = 1;	//La dimensione riportata da getattr non è quella del contenuto
+		return op_end(OP_OPEN, start, 0);
+	}
+
+	inode_num = inode_from_path(path,filesystem);
+
+	if (inode_num == 0)
+		return op_end(OP_OPEN, start, -ENOENT);
+
+	file = open_inode(inode_num,filesystem);
+	if (file == NULL)
+		return op_end(OP_OPEN, start, -ENOMEM);
+
+	fi->fh = (uint64_t)(uintptr_t)file;
+
+	return op_end(OP_OPEN, start, 0); 
+}
+
+static int hello_release(const char *path, struct fuse_file_info *fi)
+{
+	open_file_t *file = file_handle(path, fi);
+
+	if (file != NULL)
+		close_inode(file,filesystem);
+	else
+		free((char *)(uintptr_t)fi->fh);
+
+	return 0;
 }
 
 
 
 static int myfs_create(const char* path, mode_t mode, struct fuse_file_info * fi){
-	//TODO sistemare rilevazione errori
-	(void)fi;
-	
+	uint64_t start = op_begin();
 	int8_t ret = 0;
 	file_t new_file = {0};
-	char* name = file_name_from_path(path);
-	strncpy(new_file.name,name,MAX_FILE_NAME);
+	open_file_t *file;
+	inode_num_t inode_num;
+
+	if (is_stats_path(path))
+		return op_end(OP_CREATE, start, -EEXIST);
+
+	strncpy(new_file.name,file_name_from_path(path),MAX_FILE_NAME - 1);
 	new_file.mode = mode;
 	
 	ret = new_file_to_dir(new_file,path,filesystem);
 
-	free(name);
+	if (ret != 0)
+		return op_end(OP_CREATE, start, ret);
+
+	inode_num = inode_from_path(path,filesystem);
 
-	if(ret == -1)
-		return -EEXIST;
+	if (inode_num == 0)		//Rimosso subito dopo la creazione
+		return op_end(OP_CREATE, start, -ENOENT);
 
-	printf("create file %s\n",path);
-	return 0;
+	file = open_inode(inode_num,filesystem);
+	if (file == NULL)
+		return op_end(OP_CREATE, start, -ENOMEM);
+
+	fi->fh = (uint64_t)(uintptr_t)file;
+
+	LOG(1, "create file %s\n",path);
+	return op_end(OP_CREATE, start, 0);
 }
 
 
+/*
+ * Comandi accettati da STATS_PATH: "reset" azzera le statistiche, "verbose=N" imposta il livello di log.
+ */
+static int stats_command(const char *buf, size_t size)
+{
+	char command[32] = {0};
+	unsigned int level;
+
+	memcpy(command, buf, size < sizeof(command) - 1 ? size : sizeof(command) - 1);
+
+	if (strncmp(command, "reset", 5) == 0)
+		reset_stats();
+	else if (sscanf(command, "verbose=%u", &level) == 1)
+		__atomic_store_n(&options.verbose, level, __ATOMIC_RELAXED);
+	else
+		return -EINVAL;
+
+	return size;
+}
 
 static int myfs_write(const char *path, const char *buf, size_t size, off_t offset,
 		      struct fuse_file_info *fi)
 {
-	(void) fi;
+	uint64_t start = op_begin();
+	open_file_t *file = file_handle(path, fi);
+	size_t written; 
+
+	LOG(1, "Writing to file %s\n",path);
+
+	if (is_stats_path(path))
+		return op_end(OP_WRITE, start, stats_command(buf, size));
 
-	uint8_t inode_num = inode_from_path(path,filesystem);
-	uint16_t new_size; 
+	if (file == NULL)
+		return op_end(OP_WRITE, start, -EBADF);
 
-	printf("Writing to file %s\n",path);
+	written = write_open_file(file,buf,size,offset,filesystem);
 
-	new_size = write_to_file(inode_num,buf,size,offset,filesystem);
+	if(written == 0 && size > 0)
+		return op_end(OP_WRITE, start, -ENOSPC);
 
-	return new_size;
+	return op_end(OP_WRITE, start, written);
+}
+
+/*
+ * Lettura con copia nel buffer, usata da myfs_read e da myfs_read_buf per STATS_PATH e per i file
+ * con i dati nell'inode.
+ */
+static int read_copy(const char *path, char *buf, size_t size, off_t offset,
+		     struct fuse_file_info *fi)
+{
+	open_file_t *file = file_handle(path, fi);
+	const char *snapshot = (const char *)(uintptr_t)fi->fh;
+	size_t len;
+
+	if (is_stats_path(path)) {
+		len = strlen(snapshot);
+		if ((size_t)offset >= len)
+			return 0;
+		if (size > len - offset)
+			size = len - offset;
+		memcpy(buf, snapshot + offset, size);
+		return size;
+	}
+
+	if (file == NULL)
+		return -EBADF;
+
+	return read_open_file(file,buf,offset,size,filesystem);     //Ritorna 0 se offset è oltre la fine del file
 }
 
 static int myfs_read(const char *path, char *buf, size_t size, off_t offset,
 		      struct fuse_file_info *fi)
 {
-	(void) fi;
+	uint64_t start = op_begin();
 
-	uint8_t inode_num = inode_from_path(path,filesystem);
-	inode_t inode = read_inode(inode_num,filesystem);
-	size_t len;
-	printf("Reading file %s\n",path);
-	
-	if(inode_num == 0)
-		return -ENOENT;
-		
-	//if file->size == 0 return 0
+	LOG(1, "Reading file %s\n",path);
+
+	return op_end(OP_READ, start, read_copy(path, buf, size, offset, fi));
+}
+
+/*
+ * Lettura senza copia: per ogni extent toccato viene restituito un buffer che indica la posizione
+ * dei dati nel file del dispositivo (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK), così che FUSE possa passarli
+ * al kernel con splice senza copiarli in memoria. La parte non assegnata del file è un buffer di zeri.
+ * I blocchi vengono letti dopo il ritorno: se nel frattempo il file viene accorciato restano assegnati
+ * fino al rilascio del file (release_file_extent), così che non possano contenere i dati di un altro file.
+ * I buffer vengono liberati da FUSE: solo quelli in memoria con free.
+ */
+static int myfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+			 struct fuse_file_info *fi)
+{
+	uint64_t start = op_begin();
+	struct fuse_bufvec *vec;
+	file_run_t *runs = NULL;
+	open_file_t *file = file_handle(path, fi);
+	int32_t count = -1;
+	int ret;
+
+	LOG(1, "Reading file %s\n",path);
+
+	if (!is_stats_path(path)) {
+		if (file == NULL)
+			return op_end(OP_READ, start, -EBADF);
+		count = map_open_file_range(file,offset,size,&runs,filesystem);
+		if (count < -1)
+			return op_end(OP_READ, start, count);
+	}
 
-	len = inode.size;
+	vec = malloc(sizeof(struct fuse_bufvec) + (count > 1 ? count - 1 : 0) * sizeof(struct fuse_buf));
+	if (vec == NULL) {
+		free(runs);
+		return op_end(OP_READ, start, -ENOMEM);
+	}
 
+	*vec = FUSE_BUFVEC_INIT(0);
+
+	if (count == -1) {	//STATS_PATH o dati nell'inode
+		vec->buf[0].mem = malloc(size);
+		if (vec->buf[0].mem == NULL) {
+			free(vec);
+			return op_end(OP_READ, start, -ENOMEM);
+		}
+		ret = read_copy(path, vec->buf[0].mem, size, offset, fi);
+		vec->buf[0].size = ret > 0 ? ret : 0;
+		*bufp = vec;
+		return op_end(OP_READ, start, ret < 0 ? ret : 0);
+	}
 
-	if(offset < len) {
+	vec->count = count > 0 ? count : 1;
 
-		if (offset + size > len)
-			size = len - offset;
-		read_file(buf,inode_num,offset,filesystem);
+	for (int32_t i = 0; i < count; i++) {
+		vec->buf[i] = FUSE_BUFVEC_INIT(runs[i].size).buf[0];
 
-	} 
-	
-	else
-		size = 0;
+		if (runs[i].offset == -1) {
+			vec->buf[i].mem = calloc(1, runs[i].size);
+			if (vec->buf[i].mem == NULL) {
+				free(runs);
+				free(vec);		//La porzione di zeri è sempre l'ultima, non ci sono altri buffer in memoria
+				return op_end(OP_READ, start, -ENOMEM);
+			}
+			continue;
+		}
 
-	return size;
+		vec->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		vec->buf[i].fd = filesystem->fd;
+		vec->buf[i].pos = runs[i].offset;
+	}
+
+	free(runs);
+	*bufp = vec;
+	return op_end(OP_READ, start, 0);
 }
 
 static int myfs_chmod(const char* path, mode_t new_mode, struct fuse_file_info *fi){
 	
 	(void)fi;
+	uint64_t start = op_begin();
 	inode_num_t file_inode = inode_from_path(path,filesystem);
 
 	if(file_inode == 0)
-		return -ENOENT;
+		return op_end(OP_CHMOD, start, -ENOENT);
 
-	printf("Changing mode of file %s to %d\n", path, new_mode);
+	LOG(1, "Changing mode of file %s to %d\n", path, new_mode);
 	
 	update_file_mode(file_inode,new_mode,filesystem);
 
-	return 0;
+	return op_end(OP_CHMOD, start, 0);
+}
+
+/*
+ * Il troncamento di STATS_PATH non fa nulla, così che "echo reset > /.fsim_stats" funzioni.
+ */
+static int myfs_truncate(const char* path, off_t size, struct fuse_file_info *fi){
+
+	open_file_t *file = file_handle(path, fi);
+	uint64_t start = op_begin();
+	inode_num_t inode_num;
+
+	LOG(1, "truncate %s to %lld\n", path, (long long)size);
+
+	if (is_stats_path(path))
+		return op_end(OP_TRUNCATE, start, 0);
+
+	if (size < 0)
+		return op_end(OP_TRUNCATE, start, -EINVAL);
+
+	if ((uint64_t)size > (uint64_t)filesystem->sb.blocks_count * filesystem->block_size)
+		return op_end(OP_TRUNCATE, start, -EFBIG);
+
+	if (file != NULL)
+		return op_end(OP_TRUNCATE, start, truncate_open_file(file,size,filesystem));
+
+	inode_num = inode_from_path(path,filesystem);
+
+	if (inode_num == 0)
+		return op_end(OP_TRUNCATE, start, strcmp(path, "/") == 0 ? -EISDIR : -ENOENT);
+
+	return op_end(OP_TRUNCATE, start, truncate_file(inode_num,size,filesystem));
+}
+
+static int myfs_unlink(const char* path){
+
+	uint64_t start = op_begin();
+
+	LOG(1, "unlink %s\n", path);
+
+	if (is_stats_path(path))
+		return op_end(OP_UNLINK, start, -EPERM);
+
+	return op_end(OP_UNLINK, start, remove_file(path,0,filesystem));
+}
+
+static int myfs_rmdir(const char* path){
+
+	uint64_t start = op_begin();
+
+	LOG(1, "rmdir %s\n", path);
+
+	return op_end(OP_RMDIR, start, remove_file(path,1,filesystem));
+}
+
+/*
+ * Con FUSE "hard_remove" disattivato un file aperto viene rinominato invece di essere rimosso,
+ * ed eliminato al rilascio. RENAME_EXCHANGE non è supportato.
+ */
+static int myfs_rename(const char* from, const char* to, unsigned int flags){
+
+	uint64_t start = op_begin();
+
+	LOG(1, "rename %s to %s\n", from, to);
+
+	if (is_stats_path(from) || is_stats_path(to))
+		return op_end(OP_RENAME, start, -EPERM);
+
+	if (flags & ~RENAME_NOREPLACE)
+		return op_end(OP_RENAME, start, -EINVAL);
+
+	return op_end(OP_RENAME, start, rename_file(from,to,(flags & RENAME_NOREPLACE) != 0,filesystem));
+}
+
+
+/*
+ * Chiamata ad ogni close: scrive il buffer di scrittura del file, così che un errore
+ * di spazio dovuto all'allocazione ritardata venga riportato alla chiusura.
+ */
+static int myfs_flush(const char* path, struct fuse_file_info *fi){
+
+	open_file_t *file = file_handle(path, fi);
+	uint64_t start = op_begin();
+
+	if (file == NULL)
+		return op_end(OP_FLUSH, start, 0);
+
+	return op_end(OP_FLUSH, start, flush_open_file(file,filesystem));
+}
+
+static int myfs_fsync(const char* path, int datasync, struct fuse_file_info *fi){
+
+	(void)datasync;
+
+	open_file_t *file = file_handle(path, fi);
+	uint64_t start = op_begin();
+	int ret = 0;
+
+	if (file != NULL)
+		ret = flush_open_file(file,filesystem);
+
+	flush_fs(filesystem);
+
+	return op_end(OP_FSYNC, start, ret);
 }
 
 
@@ -221,22 +735,58 @@ static const struct fuse_operations hello_oper = {
 	.getattr	= hello_getattr,
 	.readdir	= hello_readdir,
 	.open		= hello_open,
+	.release	= hello_release,
 	.read		= myfs_read,
+	.read_buf	= myfs_read_buf,
 	.write		= 	myfs_write,
 	.create		= myfs_create,
-	.chmod		= myfs_chmod
+	.chmod		= myfs_chmod,
+	.truncate	= myfs_truncate,
+	.unlink		= myfs_unlink,
+	.rmdir		= myfs_rmdir,
+	.rename		= myfs_rename,
+	.fsync		= myfs_fsync,
+	.flush		= myfs_flush
 };
 
 int main(int argc, char *argv[])
 {
 	int ret;
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	superblock_t geometry = {0};
+
+	options.image = strdup("FS");
+	options.block_size = DEFAULT_BLOCK_SIZE;
+	options.blocks = DEFAULT_BLOCKS_NUM;
+	options.inodes = DEFAULT_INODES;
+	options.readahead_kb = READAHEAD_DEFAULT_KB;
+
+	if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
+		return 1;
+
+	geometry.block_size = options.block_size;
+	geometry.blocks_count = options.blocks;
+	geometry.inodes_count = options.inodes;
+	geometry.journal_blocks = options.journal_blocks;	//0: dimensione predefinita
+
+	if (options.mkfs) {
+		if (init_fs(&filesystem, options.image, &geometry) == NULL) {
+			fprintf(stderr, "Impossibile creare il file system in %s\n", options.image);
+			return 1;
+		}
+	}
+	else if (mount_fs(&filesystem, options.image) == NULL) {
+		fprintf(stderr, "Impossibile montare il file system in %s (usare --mkfs per crearlo)\n", options.image);
+		return 1;
+	}
+
+	set_readahead_budget(options.readahead_kb, filesystem);
+
+	if (options.sync_io)
+		set_io_engine(IO_ENGINE_SYNC, filesystem);
 
-	init_fs(&filesystem);
 	ret = fuse_main(args.argc, args.argv, &hello_oper, NULL);
 	fuse_opt_free_args(&args);
-	free(filesystem->free_space_table);
-	free(filesystem->inode_table);
-	free(filesystem);
+	close_fs(filesystem);
 	return ret;
 }
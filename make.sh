@@ -1 +1,3 @@
-gcc -g -Wall -fsanitize=address fsim.c `pkg-config fuse3 --cflags --libs` -o fsim
+gcc -g -Wall -pthread -fsanitize=address fsim.c `pkg-config fuse3 --cflags --libs` -o fsim
+gcc -O2 -g -Wall -pthread bench.c -o bench
+gcc -O2 -g -Wall -pthread fsck.c -o fsck